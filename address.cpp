@@ -2,12 +2,208 @@
 // See the file LICENSE.txt for copying conditions.
 
 #include "address.h"
-#include <sstream>
-#include <iostream>
+#include <cstdint>
 
 namespace net
 {
 
+namespace
+{
+
+// Parses a whole decimal number with at most maxDigits digits
+bool parseDecimal(const char* str, std::size_t length, std::size_t maxDigits, std::uint32_t maxValue, std::uint32_t& value)
+{
+    bool status = (length > 0 && length <= maxDigits);
+    std::uint32_t result = 0;
+    for (std::size_t i = 0; status && i < length; ++i)
+    {
+        status = (str[i] >= '0' && str[i] <= '9');
+        result = result * 10 + (str[i] - '0');
+    }
+    status = (status && result <= maxValue);
+    if (status)
+        value = result;
+    return status;
+}
+
+bool parseHexGroup(const char* str, std::size_t length, std::uint32_t& value)
+{
+    bool status = (length > 0 && length <= 4);
+    std::uint32_t result = 0;
+    for (std::size_t i = 0; status && i < length; ++i)
+    {
+        char c = str[i];
+        if (c >= '0' && c <= '9')
+            result = (result << 4) | (c - '0');
+        else if (c >= 'a' && c <= 'f')
+            result = (result << 4) | (c - 'a' + 10);
+        else if (c >= 'A' && c <= 'F')
+            result = (result << 4) | (c - 'A' + 10);
+        else
+            status = false;
+    }
+    if (status)
+        value = result;
+    return status;
+}
+
+bool parsePort(const char* str, std::size_t length, unsigned short& port)
+{
+    std::uint32_t value = 0;
+    bool status = parseDecimal(str, length, 5, 65535, value);
+    if (status)
+        port = static_cast<unsigned short>(value);
+    return status;
+}
+
+// Dotted decimal, like "192.168.1.1"
+bool parseIpv4(const char* str, std::size_t length, std::uint32_t& ip)
+{
+    bool status = true;
+    std::uint32_t result = 0;
+    std::size_t start = 0;
+    for (unsigned part = 0; status && part < 4; ++part)
+    {
+        std::size_t end = start;
+        while (end < length && str[end] != '.')
+            ++end;
+        std::uint32_t value = 0;
+        status = (parseDecimal(str + start, end - start, 3, 255, value) && (part == 3) == (end == length));
+        result = (result << 8) | value;
+        start = end + 1;
+    }
+    if (status)
+        ip = result;
+    return status;
+}
+
+// Eight groups of hex digits, where "::" can stand for any number of zero groups, and the last two can be IPv4
+bool parseIpv6(const char* str, std::size_t length, std::uint32_t (&groups)[8])
+{
+    std::uint32_t parsed[8] = {};
+    std::size_t count = 0;
+    std::size_t gap = 8; // Where the "::" was, only used if there was one
+    bool hasGap = false;
+    std::size_t i = 0;
+    bool status = (length >= 2);
+    if (status && str[0] == ':')
+    {
+        status = (str[1] == ':');
+        gap = 0;
+        hasGap = true;
+        i = 2;
+    }
+    while (status && i < length)
+    {
+        std::size_t end = i;
+        bool dotted = false;
+        while (end < length && str[end] != ':')
+        {
+            if (str[end] == '.')
+                dotted = true;
+            ++end;
+        }
+        if (dotted)
+        {
+            // The IPv4 part has to be at the end
+            std::uint32_t ip = 0;
+            status = (end == length && count <= 6 && parseIpv4(str + i, end - i, ip));
+            if (status)
+            {
+                parsed[count++] = ip >> 16;
+                parsed[count++] = ip & 0xFFFF;
+            }
+        }
+        else
+            status = (count < 8 && parseHexGroup(str + i, end - i, parsed[count++]));
+        i = end;
+        if (status && i < length)
+        {
+            // A single colon separates the groups, and a double one is the gap (which can only happen once)
+            if (i + 1 < length && str[i + 1] == ':')
+            {
+                status = !hasGap;
+                gap = count;
+                hasGap = true;
+                i += 2;
+            }
+            else
+            {
+                ++i;
+                status = (i < length);
+            }
+        }
+    }
+    // The gap has to stand for at least one group
+    status = (status && (hasGap ? count < 8 : count == 8));
+    if (status)
+    {
+        // The groups after the gap go at the end
+        std::size_t zeros = 8 - count;
+        for (std::size_t j = 0; j < 8; ++j)
+        {
+            if (j < gap)
+                groups[j] = parsed[j];
+            else if (j < gap + zeros)
+                groups[j] = 0;
+            else
+                groups[j] = parsed[j - zeros];
+        }
+    }
+    return status;
+}
+
+// Parses an IPv4 literal, or an IPv6 literal that maps to an IPv4 address
+bool parseIp(const char* str, std::size_t length, sf::IpAddress& ip)
+{
+    std::uint32_t value = 0;
+    bool status = parseIpv4(str, length, value);
+    if (!status)
+    {
+        std::uint32_t groups[8] = {};
+        status = (parseIpv6(str, length, groups) && groups[0] == 0 && groups[1] == 0 && groups[2] == 0 &&
+            groups[3] == 0 && groups[4] == 0 && groups[5] == 0xFFFF);
+        value = (groups[6] << 16) | groups[7];
+    }
+    if (status)
+        ip = sf::IpAddress(value);
+    return status;
+}
+
+// Returns where the number ends, or null if it doesn't fit
+char* formatDecimal(char* buffer, char* end, std::uint32_t value)
+{
+    char digits[10];
+    std::size_t count = 0;
+    do
+    {
+        digits[count++] = static_cast<char>('0' + value % 10);
+        value /= 10;
+    }
+    while (value > 0);
+    char* result = nullptr;
+    if (buffer && end - buffer >= static_cast<std::ptrdiff_t>(count))
+    {
+        while (count > 0)
+            *buffer++ = digits[--count];
+        result = buffer;
+    }
+    return result;
+}
+
+char* formatChar(char* buffer, char* end, char c)
+{
+    char* result = nullptr;
+    if (buffer && buffer < end)
+    {
+        *buffer++ = c;
+        result = buffer;
+    }
+    return result;
+}
+
+}
+
 Address::Address():
     port(0)
 {
@@ -20,39 +216,35 @@ Address::Address(const std::string& str):
 }
 
 Address::Address(const std::string& str, unsigned short p):
-    ip(str),
-    port(p)
+    Address()
 {
+    set(str, p);
 }
 
 bool Address::set(const std::string& str)
 {
-    bool status = false;
-    auto separator = str.find(':');
-    if (separator != std::string::npos)
-    {
-        // Split the string
-        std::string ipStr = str.substr(0, separator);
-        std::string portStr = str.substr(separator + 1);
-        // Extract the port number
-        std::istringstream tmpStream(portStr);
-        unsigned short tmpPort = 0;
-        status = (tmpStream >> tmpPort);
-        // Set the values if all went well
-        if (status)
+    bool status = parse(str.data(), str.size());
+    if (!status)
+    {
+        // Not a literal, so it might be a host name with a port
+        auto separator = str.rfind(':');
+        if (separator != std::string::npos)
         {
-            ip = ipStr;
-            port = tmpPort;
+            unsigned short tmpPort = 0;
+            status = parsePort(str.data() + separator + 1, str.size() - separator - 1, tmpPort);
+            if (status)
+                set(str.substr(0, separator), tmpPort);
         }
+        else
+            status = set(str, 0); // Just parse the IP, and set the port to 0
     }
-    else
-        status = set(str, 0); // Just parse the IP, and set the port to 0
     return status;
 }
 
 bool Address::set(const std::string& str, unsigned short p)
 {
-    ip = str;
+    if (!parseIp(str.data(), str.size(), ip))
+        ip = str;
     port = p;
     return true;
 }
@@ -64,9 +256,76 @@ bool Address::operator=(const std::string& str)
 
 std::string Address::toString() const
 {
-    std::ostringstream tmpStream;
-    tmpStream << ip.toString() << ":" << port;
-    return tmpStream.str();
+    char buffer[maxStringSize];
+    return std::string(buffer, format(buffer, sizeof(buffer)));
+}
+
+bool Address::parse(const char* str, std::size_t length)
+{
+    sf::IpAddress tmpIp;
+    unsigned short tmpPort = 0;
+    bool status = false;
+    if (length > 0 && str[0] == '[')
+    {
+        // An IPv6 literal in brackets, which is the only way it can have a port
+        std::size_t end = 1;
+        while (end < length && str[end] != ']')
+            ++end;
+        status = (end < length && parseIp(str + 1, end - 1, tmpIp));
+        if (status && end + 1 < length)
+            status = (str[end + 1] == ':' && parsePort(str + end + 2, length - end - 2, tmpPort));
+        else
+            status = (status && end + 1 == length);
+    }
+    else
+    {
+        // Either "ip", "ip:port", or an IPv6 literal without brackets
+        std::size_t separator = 0;
+        std::size_t colons = 0;
+        for (std::size_t i = 0; i < length; ++i)
+        {
+            if (str[i] == ':')
+            {
+                separator = i;
+                ++colons;
+            }
+        }
+        if (colons == 1)
+            status = (parseIp(str, separator, tmpIp) && parsePort(str + separator + 1, length - separator - 1, tmpPort));
+        else
+            status = parseIp(str, length, tmpIp);
+    }
+    if (status)
+    {
+        ip = tmpIp;
+        port = tmpPort;
+    }
+    return status;
+}
+
+std::size_t Address::format(char* buffer, std::size_t size) const
+{
+    // The null terminator needs to fit too
+    char* end = buffer + (size > 0 ? size - 1 : 0);
+    char* position = buffer;
+    auto value = ip.toInteger();
+    for (unsigned part = 0; part < 4; ++part)
+    {
+        if (part > 0)
+            position = formatChar(position, end, '.');
+        position = formatDecimal(position, end, (value >> (8 * (3 - part))) & 0xFF);
+    }
+    position = formatChar(position, end, ':');
+    position = formatDecimal(position, end, port);
+    std::size_t length = 0;
+    if (position)
+    {
+        *position = '\0';
+        length = static_cast<std::size_t>(position - buffer);
+    }
+    else if (size > 0)
+        buffer[0] = '\0';
+    return length;
 }
 
 bool Address::operator<(const Address& addr) const
@@ -82,4 +341,14 @@ bool Address::operator==(const Address& addr) const
     return (ip == addr.ip && port == addr.port);
 }
 
+std::size_t AddressHash::operator()(const Address& address) const
+{
+    // Put the IP and port together, and mix the bits so that similar addresses end up far apart
+    std::uint64_t value = (static_cast<std::uint64_t>(address.ip.toInteger()) << 16) | address.port;
+    value ^= value >> 33;
+    value *= 0xff51afd7ed558ccdULL;
+    value ^= value >> 33;
+    return static_cast<std::size_t>(value);
+}
+
 }
@@ -4,6 +4,8 @@
 #ifndef ADDRESS_H
 #define ADDRESS_H
 
+#include <cstddef>
+#include <functional>
 #include <SFML/Network.hpp>
 
 namespace net
@@ -11,11 +13,15 @@ namespace net
 
 // Simple class that stores an IP address and port
 // Can be set from a string, and can generate a string
+// IPv6 literals are understood, but since SFML only has IPv4 sockets, only IPv4-mapped ones (::ffff:a.b.c.d) can be used
 struct Address
 {
+    static const std::size_t maxStringSize = 22; // Longest string from format(), including the null terminator
+
     Address();
 
-    // These use a format like "ip:port"
+    // These use a format like "ip:port", or "[ipv6]:port"
+    // IP literals are parsed directly, anything else is resolved as a host name by SFML
     Address(const std::string& str);
     Address(const std::string& str, unsigned short p); // The string here should just be the IP
     bool set(const std::string& str);
@@ -23,6 +29,10 @@ struct Address
     bool operator=(const std::string& str);
     std::string toString() const;
 
+    // These never allocate or resolve host names, so they are safe to use for every packet
+    bool parse(const char* str, std::size_t length); // Only takes IP literals, and leaves the address unchanged if it fails
+    std::size_t format(char* buffer, std::size_t size) const; // Returns the length, or 0 if the buffer is too small
+
     // For use with associative containers
     bool operator<(const Address& addr) const;
     bool operator==(const Address& addr) const;
@@ -32,6 +42,27 @@ struct Address
     unsigned short port;
 };
 
+// For use with unordered containers, this hashes the IP and port together
+struct AddressHash
+{
+    std::size_t operator()(const Address& address) const;
+};
+
+}
+
+// So addresses can be used as keys of unordered containers without naming the hash
+namespace std
+{
+
+template <>
+struct hash<net::Address>
+{
+    std::size_t operator()(const net::Address& address) const
+    {
+        return net::AddressHash()(address);
+    }
+};
+
 }
 
 #endif
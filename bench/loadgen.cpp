@@ -0,0 +1,642 @@
+// See the file COPYRIGHT.txt for authors and copyright information.
+// See the file LICENSE.txt for copying conditions.
+
+/*
+Load generator for TcpServer, which simulates many clients over loopback.
+Scenarios:
+    echo - Every client sends packets at the given rate, and the server sends each one back
+    broadcast - One client sends packets at the given rate, and the server sends each one to all of the others
+    slow - Like broadcast, but some of the clients never read anything, so their send queues fill up
+Every packet carries the time it was sent, so the round trip (or publish to delivery) latency is measured
+    when it comes back. The clients are plain non-blocking sockets, spread over a few generator threads.
+The results are measured after a warmup:
+    Throughput in messages and bytes per second (received by the clients)
+    Latency percentiles (p50, p99, p999)
+    CPU time per message, for the whole process (use --server and --connect to measure only the server)
+    Allocations per message, counted with a replaced operator new
+The server can also be run by itself with --server, and the clients with --connect, in separate processes.
+Run with --help to see all of the options.
+*/
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <new>
+#include <ctime>
+#include <SFML/Network.hpp>
+#include "tcpserver.h"
+#include "frame.h"
+#include "address.h"
+#ifndef _WIN32
+    #include <sys/resource.h>
+#endif
+
+namespace
+{
+
+std::atomic<std::uint64_t> allocationCount(0);
+
+}
+
+// Every allocation in the process is counted, the generator itself doesn't allocate while measuring
+void* operator new(std::size_t size)
+{
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    void* pointer = std::malloc(size > 0 ? size : 1);
+    if (!pointer)
+        throw std::bad_alloc();
+    return pointer;
+}
+
+void operator delete(void* pointer) noexcept
+{
+    std::free(pointer);
+}
+
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+
+enum MessageKind: std::uint8_t
+{
+    Echo = 0,
+    Broadcast = 1
+};
+
+// Kind and send time, the rest of the packet is padding
+const std::size_t messageHeaderSize = 9;
+const std::size_t maxPendingBytes = 256 * 1024; // A client stops generating once this much is waiting to be sent
+
+struct Options
+{
+    Options();
+
+    std::string scenario;
+    unsigned clients;
+    double rate; // Packets per second, for each client in echo, or for the publisher otherwise
+    std::size_t size;
+    double duration; // Seconds
+    double warmup;
+    unsigned serverThreads;
+    unsigned generatorThreads;
+    unsigned short port;
+    unsigned slowClients;
+    std::size_t queueLimit;
+    std::string policy;
+    std::size_t batch;
+    bool serverOnly;
+    std::string connect;
+};
+
+Options::Options():
+    scenario("echo"),
+    clients(100),
+    rate(1000.0),
+    size(64),
+    duration(5.0),
+    warmup(1.0),
+    serverThreads(1),
+    generatorThreads(2),
+    port(35500),
+    slowClients(0),
+    queueLimit(64 * 1024),
+    policy("drop"),
+    batch(0),
+    serverOnly(false)
+{
+}
+
+void printUsage()
+{
+    std::cout <<
+        "Usage: netlib_loadgen [options]\n"
+        "  --scenario echo|broadcast|slow  What to simulate (echo)\n"
+        "  --clients N                     Simulated clients (100)\n"
+        "  --rate M                        Packets per second, per client for echo, from the publisher otherwise (1000)\n"
+        "  --size BYTES                    Packet size, at least 9 (64)\n"
+        "  --duration SECONDS              Time measured after the warmup (5)\n"
+        "  --warmup SECONDS                Time before measuring (1)\n"
+        "  --threads N                     Server threads (1)\n"
+        "  --generators N                  Client threads (2)\n"
+        "  --port PORT                     Port to use (35500)\n"
+        "  --slow N                        Clients that never read, for the slow scenario (10% of the clients)\n"
+        "  --queue-limit BYTES             Server send queue limit (65536)\n"
+        "  --policy block|drop|kick        What the server does when a queue is full (drop)\n"
+        "  --batch BYTES                   Server send batching, 0 is off (0)\n"
+        "  --server                        Only run the server, until the process is killed\n"
+        "  --connect IP:PORT               Only run the clients, against a server somewhere else\n";
+}
+
+bool parseOptions(int argc, char** argv, Options& options)
+{
+    bool status = true;
+    for (int i = 1; status && i < argc; ++i)
+    {
+        std::string name = argv[i];
+        bool hasValue = (i + 1 < argc);
+        std::string value = (hasValue ? argv[i + 1] : "");
+        if (name == "--server")
+            options.serverOnly = true;
+        else if (!hasValue)
+            status = false;
+        else
+        {
+            if (name == "--scenario")
+                options.scenario = value;
+            else if (name == "--clients")
+                options.clients = static_cast<unsigned>(std::atoi(value.c_str()));
+            else if (name == "--rate")
+                options.rate = std::atof(value.c_str());
+            else if (name == "--size")
+                options.size = static_cast<std::size_t>(std::atol(value.c_str()));
+            else if (name == "--duration")
+                options.duration = std::atof(value.c_str());
+            else if (name == "--warmup")
+                options.warmup = std::atof(value.c_str());
+            else if (name == "--threads")
+                options.serverThreads = static_cast<unsigned>(std::atoi(value.c_str()));
+            else if (name == "--generators")
+                options.generatorThreads = static_cast<unsigned>(std::atoi(value.c_str()));
+            else if (name == "--port")
+                options.port = static_cast<unsigned short>(std::atoi(value.c_str()));
+            else if (name == "--slow")
+                options.slowClients = static_cast<unsigned>(std::atoi(value.c_str()));
+            else if (name == "--queue-limit")
+                options.queueLimit = static_cast<std::size_t>(std::atol(value.c_str()));
+            else if (name == "--policy")
+                options.policy = value;
+            else if (name == "--batch")
+                options.batch = static_cast<std::size_t>(std::atol(value.c_str()));
+            else if (name == "--connect")
+                options.connect = value;
+            else
+                status = false;
+            ++i;
+        }
+    }
+    if (options.scenario == "slow" && options.slowClients == 0)
+        options.slowClients = std::max(1u, options.clients / 10);
+    status = (status && (options.scenario == "echo" || options.scenario == "broadcast" || options.scenario == "slow"));
+    status = (status && (options.policy == "block" || options.policy == "drop" || options.policy == "kick"));
+    status = (status && options.clients > 0 && options.rate > 0.0 && options.size >= messageHeaderSize);
+    status = (status && options.generatorThreads > 0 && options.serverThreads > 0);
+    return status;
+}
+
+std::uint64_t getNanoseconds()
+{
+    auto elapsed = Clock::now().time_since_epoch();
+    return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+}
+
+// User and system time used by the whole process, in microseconds
+std::uint64_t getCpuTime()
+{
+    #ifdef _WIN32
+        return static_cast<std::uint64_t>(std::clock()) * 1000000 / CLOCKS_PER_SEC;
+    #else
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return static_cast<std::uint64_t>(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 +
+            usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+    #endif
+}
+
+// The server side, which sends the packets back or to everyone else depending on their kind
+class Server
+{
+    public:
+        bool start(const Options& options)
+        {
+            server.setCallbackLocking(false);
+            server.setThreadCount(options.serverThreads);
+            auto policy = net::TcpServer::Drop;
+            if (options.policy == "block")
+                policy = net::TcpServer::Block;
+            else if (options.policy == "kick")
+                policy = net::TcpServer::Kick;
+            server.setSendQueueLimit(options.queueLimit, policy);
+            if (options.batch > 0)
+                server.setSendBatching(options.batch);
+            server.setPacketCallback([this](sf::Packet& packet, int id)
+            {
+                auto data = static_cast<const char*>(packet.getData());
+                if (packet.getDataSize() > 0 && data[0] == Broadcast)
+                    server.sendToAll(packet, id);
+                else
+                    server.send(packet, id);
+            });
+            server.setListeningPort(options.port);
+            server.start();
+            return true;
+        }
+
+        void stop()
+        {
+            server.stop();
+        }
+
+        net::ServerMetrics getMetrics() const
+        {
+            return server.getMetrics();
+        }
+
+    private:
+        net::TcpServer server;
+};
+
+struct SimulatedClient
+{
+    SimulatedClient():
+        sender(false),
+        reader(true),
+        outOffset(0),
+        inSize(0),
+        nextSend(0)
+    {
+    }
+
+    sf::TcpSocket socket;
+    bool sender;
+    bool reader;
+    std::vector<char> out; // Framed packets waiting to be sent
+    std::size_t outOffset;
+    std::vector<char> in;
+    std::size_t inSize;
+    std::uint64_t nextSend; // Nanoseconds
+};
+
+// Counters and samples of one generator thread, these are only read after it has stopped
+struct GeneratorStats
+{
+    GeneratorStats():
+        sent(0),
+        received(0),
+        bytesReceived(0),
+        skipped(0),
+        disconnected(0)
+    {
+    }
+
+    std::uint64_t sent;
+    std::uint64_t received;
+    std::uint64_t bytesReceived;
+    std::uint64_t skipped; // Packets that weren't generated because too much was waiting to be sent
+    std::uint64_t disconnected;
+    std::vector<std::uint32_t> latencies; // Microseconds
+};
+
+class Generator
+{
+    public:
+        Generator(const Options& options, const std::atomic_bool& running, const std::atomic_bool& measuring):
+            options(options),
+            running(running),
+            measuring(measuring),
+            interval(static_cast<std::uint64_t>(1e9 / options.rate))
+        {
+        }
+
+        bool addClient(const net::Address& address, bool sender, bool reader)
+        {
+            std::unique_ptr<SimulatedClient> client(new SimulatedClient);
+            bool status = (client->socket.connect(address.ip, address.port, sf::seconds(5)) == sf::Socket::Done);
+            if (status)
+            {
+                client->socket.setBlocking(false);
+                client->sender = sender;
+                client->reader = reader;
+                client->out.reserve(maxPendingBytes + options.size + net::frameHeaderSize);
+                client->in.resize(64 * 1024);
+                clients.push_back(std::move(client));
+            }
+            return status;
+        }
+
+        void reserveSamples(std::size_t count)
+        {
+            stats.latencies.reserve(count);
+        }
+
+        void start()
+        {
+            thread = std::thread(&Generator::run, this);
+        }
+
+        void join()
+        {
+            if (thread.joinable())
+                thread.join();
+        }
+
+        const GeneratorStats& getStats() const
+        {
+            return stats;
+        }
+
+    private:
+        void run()
+        {
+            // Spread out the first sends, so the clients don't all send at the same time
+            auto now = getNanoseconds();
+            for (std::size_t i = 0; i < clients.size(); ++i)
+                clients[i]->nextSend = now + interval * i / std::max<std::size_t>(clients.size(), 1);
+            while (running)
+            {
+                bool busy = false;
+                now = getNanoseconds();
+                for (auto& client: clients)
+                {
+                    if (client->socket.getRemotePort() != 0)
+                    {
+                        if (client->sender)
+                            busy = (generate(*client, now) || busy);
+                        busy = (send(*client) || busy);
+                        if (client->reader)
+                            busy = (receive(*client) || busy);
+                    }
+                }
+                if (!busy)
+                    std::this_thread::sleep_for(std::chrono::microseconds(50));
+            }
+        }
+
+        bool generate(SimulatedClient& client, std::uint64_t now)
+        {
+            // Catch up on the packets that are due, like an open-loop client would
+            bool generated = false;
+            MessageKind kind = (options.scenario == "echo" ? Echo : Broadcast);
+            while (client.nextSend <= now)
+            {
+                if (client.out.size() - client.outOffset < maxPendingBytes)
+                {
+                    appendMessage(client.out, kind, now);
+                    if (measuring)
+                        ++stats.sent;
+                }
+                else if (measuring)
+                    ++stats.skipped;
+                client.nextSend += interval;
+                generated = true;
+            }
+            return generated;
+        }
+
+        void appendMessage(std::vector<char>& buffer, MessageKind kind, std::uint64_t now)
+        {
+            // Written by hand instead of with an sf::Packet, so the generator doesn't allocate
+            auto start = buffer.size();
+            buffer.resize(start + net::frameHeaderSize + options.size, 0);
+            char* data = &buffer[start];
+            auto size = static_cast<std::uint32_t>(options.size);
+            for (unsigned i = 0; i < 4; ++i)
+                data[i] = static_cast<char>((size >> (8 * (3 - i))) & 0xFF);
+            data[net::frameHeaderSize] = static_cast<char>(kind);
+            std::memcpy(data + net::frameHeaderSize + 1, &now, sizeof(now));
+        }
+
+        bool send(SimulatedClient& client)
+        {
+            bool sentAny = false;
+            if (client.outOffset < client.out.size())
+            {
+                std::size_t sent = 0;
+                client.socket.send(client.out.data() + client.outOffset, client.out.size() - client.outOffset, sent);
+                client.outOffset += sent;
+                if (client.outOffset == client.out.size())
+                {
+                    client.out.clear();
+                    client.outOffset = 0;
+                }
+                sentAny = (sent > 0);
+            }
+            return sentAny;
+        }
+
+        bool receive(SimulatedClient& client)
+        {
+            bool receivedAny = false;
+            auto socketStatus = sf::Socket::Done;
+            while (socketStatus == sf::Socket::Done)
+            {
+                std::size_t received = 0;
+                socketStatus = client.socket.receive(&client.in[client.inSize], client.in.size() - client.inSize, received);
+                client.inSize += received;
+                receivedAny = (receivedAny || received > 0);
+
+                // Measure every complete packet, and keep the incomplete one for later
+                auto now = getNanoseconds();
+                std::size_t start = 0;
+                std::size_t packetSize = 0;
+                while (net::findFrame(&client.in[start], client.inSize - start, packetSize))
+                {
+                    const char* packet = &client.in[start + net::frameHeaderSize];
+                    if (packetSize >= messageHeaderSize && measuring)
+                    {
+                        std::uint64_t sentTime = 0;
+                        std::memcpy(&sentTime, packet + 1, sizeof(sentTime));
+                        if (stats.latencies.size() < stats.latencies.capacity())
+                            stats.latencies.push_back(static_cast<std::uint32_t>((now - sentTime) / 1000));
+                        ++stats.received;
+                        stats.bytesReceived += packetSize + net::frameHeaderSize;
+                    }
+                    start += net::frameHeaderSize + packetSize;
+                }
+                std::memmove(client.in.data(), client.in.data() + start, client.inSize - start);
+                client.inSize -= start;
+                if (client.inSize == client.in.size())
+                    client.in.resize(client.in.size() * 2); // Only happens for packets bigger than the buffer
+            }
+            if (socketStatus == sf::Socket::Disconnected || socketStatus == sf::Socket::Error)
+            {
+                client.socket.disconnect();
+                ++stats.disconnected;
+            }
+            return receivedAny;
+        }
+
+        const Options& options;
+        const std::atomic_bool& running;
+        const std::atomic_bool& measuring;
+        std::uint64_t interval; // Nanoseconds between the packets of a sender
+        std::vector<std::unique_ptr<SimulatedClient> > clients;
+        GeneratorStats stats;
+        std::thread thread;
+};
+
+std::uint32_t getPercentile(const std::vector<std::uint32_t>& sorted, double percentile)
+{
+    std::uint32_t value = 0;
+    if (!sorted.empty())
+    {
+        auto index = static_cast<std::size_t>(percentile / 100.0 * (sorted.size() - 1) + 0.5);
+        value = sorted[std::min(index, sorted.size() - 1)];
+    }
+    return value;
+}
+
+int runClients(const Options& options, Server* server)
+{
+    net::Address address("127.0.0.1", options.port);
+    if (!options.connect.empty() && !address.parse(options.connect.data(), options.connect.size()))
+    {
+        std::cerr << "Invalid address: " << options.connect << "\n";
+        return 1;
+    }
+
+    // In the broadcast scenarios the first client is the publisher, and the slow clients are at the end
+    std::atomic_bool running(true);
+    std::atomic_bool measuring(false);
+    std::vector<std::unique_ptr<Generator> > generators;
+    for (unsigned i = 0; i < options.generatorThreads; ++i)
+        generators.emplace_back(new Generator(options, running, measuring));
+    bool echo = (options.scenario == "echo");
+    unsigned readers = options.clients - (echo ? 0 : 1);
+    for (unsigned i = 0; i < options.clients; ++i)
+    {
+        bool sender = (echo || i == 0);
+        bool reader = (echo || (i > 0 && i < options.clients - options.slowClients));
+        if (!generators[i % generators.size()]->addClient(address, sender, reader))
+        {
+            std::cerr << "Couldn't connect client " << i << " to " << address.toString() << "\n";
+            return 1;
+        }
+    }
+
+    // Room for every latency sample, so nothing is allocated while measuring
+    double expected = options.rate * options.duration * (echo ? options.clients : readers) * 1.1;
+    for (auto& generator: generators)
+        generator->reserveSamples(static_cast<std::size_t>(expected / generators.size()) + 1024);
+
+    std::cout << "Scenario " << options.scenario << ": " << options.clients << " clients, " << options.rate
+        << " packets/s " << (echo ? "each" : "published") << ", " << options.size << " bytes";
+    if (options.slowClients > 0)
+        std::cout << ", " << options.slowClients << " slow clients";
+    std::cout << "\n";
+
+    for (auto& generator: generators)
+        generator->start();
+    std::this_thread::sleep_for(std::chrono::milliseconds(static_cast<int>(options.warmup * 1000)));
+
+    // Everything from here to the end of the duration is measured
+    net::ServerMetrics startMetrics;
+    if (server)
+        startMetrics = server->getMetrics();
+    auto startCpu = getCpuTime();
+    auto startAllocations = allocationCount.load();
+    auto startTime = Clock::now();
+    measuring = true;
+    std::this_thread::sleep_for(std::chrono::milliseconds(static_cast<int>(options.duration * 1000)));
+    measuring = false;
+    auto elapsed = std::chrono::duration<double>(Clock::now() - startTime).count();
+    auto cpu = getCpuTime() - startCpu;
+    auto allocations = allocationCount.load() - startAllocations;
+    net::ServerMetrics endMetrics;
+    if (server)
+        endMetrics = server->getMetrics();
+    running = false;
+    for (auto& generator: generators)
+        generator->join();
+
+    // Put the results of the generator threads together
+    GeneratorStats total;
+    for (auto& generator: generators)
+    {
+        auto& stats = generator->getStats();
+        total.sent += stats.sent;
+        total.received += stats.received;
+        total.bytesReceived += stats.bytesReceived;
+        total.skipped += stats.skipped;
+        total.disconnected += stats.disconnected;
+        total.latencies.insert(total.latencies.end(), stats.latencies.begin(), stats.latencies.end());
+    }
+    std::sort(total.latencies.begin(), total.latencies.end());
+    double messages = static_cast<double>(std::max<std::uint64_t>(total.received, 1));
+
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << "  sent " << total.sent << ", received " << total.received << " in " << elapsed << " s";
+    if (total.skipped > 0)
+        std::cout << " (" << total.skipped << " not sent, the server fell behind)";
+    std::cout << "\n";
+    std::cout << "  throughput: " << total.received / elapsed << " msg/s, "
+        << total.bytesReceived / elapsed / (1024.0 * 1024.0) << " MB/s\n";
+    std::cout << "  latency (us): p50 " << getPercentile(total.latencies, 50.0)
+        << ", p99 " << getPercentile(total.latencies, 99.0)
+        << ", p999 " << getPercentile(total.latencies, 99.9)
+        << ", max " << (total.latencies.empty() ? 0 : total.latencies.back()) << "\n";
+    std::cout << "  cpu: " << cpu / messages << " us/msg" << (server ? " (server and clients)" : " (clients only)")
+        << ", allocations: " << allocations / messages << " /msg\n";
+    if (server)
+    {
+        std::cout << "  server: " << endMetrics.packetsReceived - startMetrics.packetsReceived << " received, "
+            << endMetrics.packetsSent - startMetrics.packetsSent << " sent, "
+            << endMetrics.sendFailures - startMetrics.sendFailures << " send failures, "
+            << endMetrics.clientsDisconnected - startMetrics.clientsDisconnected << " disconnected\n";
+    }
+    if (total.disconnected > 0)
+        std::cout << "  " << total.disconnected << " clients were disconnected\n";
+    return 0;
+}
+
+int runServer(const Options& options)
+{
+    // Prints what the server did every few seconds, the CPU and allocations are for the server only
+    Server server;
+    server.start(options);
+    std::cout << "Server running on port " << options.port << "\n";
+    auto lastMetrics = server.getMetrics();
+    auto lastCpu = getCpuTime();
+    auto lastAllocations = allocationCount.load();
+    while (true)
+    {
+        std::this_thread::sleep_for(std::chrono::seconds(5));
+        auto metrics = server.getMetrics();
+        auto cpu = getCpuTime();
+        auto allocations = allocationCount.load();
+        double messages = static_cast<double>(std::max<std::uint64_t>(metrics.packetsSent - lastMetrics.packetsSent, 1));
+        std::cout << std::fixed << std::setprecision(2) << "  " << (metrics.packetsReceived - lastMetrics.packetsReceived) / 5.0
+            << " received/s, " << (metrics.packetsSent - lastMetrics.packetsSent) / 5.0 << " sent/s, cpu "
+            << (cpu - lastCpu) / messages << " us/msg, allocations " << (allocations - lastAllocations) / messages
+            << " /msg, " << metrics.sendFailures - lastMetrics.sendFailures << " send failures\n";
+        lastMetrics = metrics;
+        lastCpu = cpu;
+        lastAllocations = allocations;
+    }
+    return 0;
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+    int status = 0;
+    if (!parseOptions(argc, argv, options))
+    {
+        printUsage();
+        status = 1;
+    }
+    else if (options.serverOnly)
+        status = runServer(options);
+    else if (!options.connect.empty())
+        status = runClients(options, nullptr);
+    else
+    {
+        Server server;
+        server.start(options);
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        status = runClients(options, &server);
+        server.stop();
+    }
+    return status;
+}
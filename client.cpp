@@ -2,13 +2,36 @@
 // See the file LICENSE.txt for copying conditions.
 
 #include "client.h"
+#include "frame.h"
+#include "protocol.h"
+#include "nativesocket.h"
+#include <algorithm>
 
 namespace net
 {
 
 Client::Client():
-    tcpConnected(false),
-    udpReady(false)
+    connectionStatus(Disconnected),
+    udpReady(false),
+    attemptInProgress(false),
+    reconnectEnabled(false),
+    reconnectDelay(sf::milliseconds(defaultReconnectDelay)),
+    maxReconnectDelay(sf::seconds(defaultMaxReconnectDelay)),
+    reconnectAttempts(0),
+    random(std::random_device()()),
+    heartbeatEnabled(false),
+    heartbeatTimeout(sf::Time::Zero),
+    snapshotsEnabled(false),
+    batchSize(0),
+    batchDelay(sf::milliseconds(defaultBatchDelay)),
+    compressionEnabled(false),
+    compressionAccepted(false),
+    udpBatch(udpSocket),
+    staticHandler(nullptr),
+    receivedPacket(packetPool.acquire()),
+    storedPackets(packetPool),
+    receiveSize(0),
+    tcpGeneration(0)
 {
     udpSocket.setBlocking(false);
     tcpSocket.setBlocking(false);
@@ -17,10 +40,19 @@ Client::Client():
 bool Client::connect(const sf::IpAddress& address, unsigned short port, sf::Time timeout)
 {
     // Use a blocking connect
+    serverAddress.ip = address;
+    serverAddress.port = port;
+    connectTimeout = timeout;
+    attemptInProgress = false;
+    reconnectAttempts = 0;
     tcpSocket.setBlocking(true);
-    tcpConnected = (tcpSocket.connect(address, port, timeout) == sf::Socket::Done);
+    bool connected = (tcpSocket.connect(address, port, timeout) == sf::Socket::Done);
     tcpSocket.setBlocking(false);
-    return tcpConnected;
+    if (connected)
+        setConnected();
+    else
+        setConnectionStatus(Failed);
+    return isConnected();
 }
 
 bool Client::connect(const Address& address, sf::Time timeout)
@@ -28,10 +60,80 @@ bool Client::connect(const Address& address, sf::Time timeout)
     return connect(address.ip, address.port, timeout);
 }
 
+bool Client::connectAsync(const sf::IpAddress& address, unsigned short port, sf::Time timeout)
+{
+    serverAddress.ip = address;
+    serverAddress.port = port;
+    connectTimeout = timeout;
+    reconnectAttempts = 0;
+    return startConnecting();
+}
+
+bool Client::connectAsync(const Address& address, sf::Time timeout)
+{
+    return connectAsync(address.ip, address.port, timeout);
+}
+
 void Client::disconnect()
 {
+    // Nothing is scheduled, since there is no callback for leaving on purpose
     tcpSocket.disconnect();
-    tcpConnected = false;
+    connectionStatus = Disconnected;
+    attemptInProgress = false;
+    resetTcp();
+}
+
+void Client::setHeartbeat(bool enabled, sf::Time timeout)
+{
+    heartbeatEnabled = enabled;
+    heartbeatTimeout = timeout;
+}
+
+void Client::setSnapshots(bool enabled, std::size_t history)
+{
+    snapshotsEnabled = enabled;
+    snapshots.setCapacity(history);
+}
+
+sf::Time Client::getRtt() const
+{
+    return serverRtt;
+}
+
+sf::Time Client::getJitter() const
+{
+    return serverJitter;
+}
+
+Client::ConnectionStatus Client::getConnectionStatus() const
+{
+    return connectionStatus;
+}
+
+void Client::setConnectCallback(ConnectCallbackType callback)
+{
+    connectCallback = callback;
+}
+
+void Client::setReconnect(bool enabled, sf::Time delay, sf::Time maxDelay)
+{
+    reconnectEnabled = enabled;
+    reconnectDelay = delay;
+    maxReconnectDelay = maxDelay;
+}
+
+void Client::setSendBatching(std::size_t bytes, sf::Time delay)
+{
+    batchSize = bytes;
+    batchDelay = delay;
+    if (bytes == 0)
+        flushTcp();
+}
+
+void Client::setCompression(bool enabled, const Compressor& compressor)
+{
+    compressionEnabled = enabled;
+    this->compressor = compressor;
 }
 
 void Client::bindPort(unsigned short port)
@@ -45,19 +147,47 @@ void Client::setSafeAddresses(AddressSet& addresses)
     safeAddresses = addresses;
 }
 
+void Client::setUdpBatching(std::size_t batchSize, std::size_t bufferSize)
+{
+    udpBatch.setSize(batchSize, bufferSize);
+}
+
 int Client::receive(const std::string& groupName)
+{
+    return receive(getGroup(groupName));
+}
+
+int Client::receive(GroupHandle group)
 {
     // Handle the stored packets first, since those are the oldest
-    int status = handleStoredPackets(groupName);
-    status |= receiveUdp(groupName);
-    status |= receiveTcp(groupName);
+    updateConnection();
+    int status = handleStoredPackets(group);
+    status |= receiveUdp(group);
+    status |= receiveTcp(group);
+    // Anything queued by the callbacks is sent together, along with the acks and resends of the channels
+    updateChannels();
+    flush();
     // This returns true if anything was handled or received
     return status;
 }
 
 bool Client::send(sf::Packet& packet)
 {
-    return (tcpConnected && tcpSocket.send(packet) == sf::Socket::Done);
+    // Everything goes through the write buffer, so a frame that was only partially sent is always finished
+    // before the next one, including the control packets that receive() sends by itself
+    bool status = isConnected();
+    if (status)
+    {
+        if (writeBuffer.empty())
+            bufferedSince = clock.getElapsedTime();
+        std::size_t size = 0;
+        const void* data = getPacketData(packet, size);
+        if (!compressionAccepted || !compressor.appendCompressedFrame(data, size, writeBuffer))
+            appendFrame(packet, writeBuffer);
+        if (writeBuffer.size() >= batchSize || clock.getElapsedTime() - bufferedSince >= batchDelay)
+            status = flushTcp();
+    }
+    return status;
 }
 
 bool Client::send(sf::Packet& packet, const Address& address)
@@ -70,116 +200,510 @@ bool Client::send(sf::Packet& packet, const sf::IpAddress& address, unsigned sho
     return (udpSocket.send(packet, address, port) == sf::Socket::Done);
 }
 
+bool Client::send(sf::Packet& packet, const Address& address, Connection::Channel channel)
+{
+    auto& connection = connections[address];
+    bool status = connection.send(channel, packet);
+    if (status)
+    {
+        connection.update(clock.getElapsedTime().asMilliseconds(), udpBatch, address);
+        status = udpBatch.flush();
+    }
+    return status;
+}
+
+bool Client::queueSend(sf::Packet& packet, const Address& address)
+{
+    return udpBatch.queue(packet, address);
+}
+
+bool Client::flush()
+{
+    bool status = flushTcp();
+    return (udpBatch.flush() && status);
+}
+
 bool Client::isConnected() const
 {
-    return tcpConnected;
+    return (connectionStatus == Connected);
+}
+
+sf::Time Client::getRtt(const Address& address) const
+{
+    auto found = connections.find(address);
+    auto rtt = (found != connections.end() ? found->second.getRtt() : 0);
+    return sf::milliseconds(static_cast<sf::Int32>(rtt));
+}
+
+void Client::addChannels(const Address& address)
+{
+    connections[address];
+}
+
+void Client::removeChannels(const Address& address)
+{
+    connections.erase(address);
 }
 
 void Client::registerCallback(PacketType type, CallbackType callback)
 {
-    callbacks[type] = callback;
+    if (type >= 0 && type < denseTypeCount)
+        denseCallbacks[type] = callback;
+    else
+        callbacks[type] = callback;
+}
+
+Client::GroupHandle Client::setGroup(const std::string& groupName, std::initializer_list<PacketType> packetTypes)
+{
+    // Setting an existing group replaces it, but keeps the same handle
+    auto found = groupHandles.find(groupName);
+    GroupHandle group = (found != groupHandles.end() ? found->second : static_cast<GroupHandle>(groups.size()));
+    if (found == groupHandles.end())
+    {
+        groups.emplace_back();
+        groupHandles[groupName] = group;
+    }
+    auto& types = groups[group];
+    types = Group();
+    for (auto type: packetTypes)
+    {
+        if (type >= 0 && type < denseTypeCount)
+            types.denseTypes.set(type);
+        else
+            types.otherTypes.insert(type);
+    }
+    return group;
 }
 
-void Client::setGroup(const std::string& groupName, std::initializer_list<PacketType> packetTypes)
+Client::GroupHandle Client::getGroup(const std::string& groupName) const
 {
-    groups[groupName] = packetTypes;
+    GroupHandle group = allTypes;
+    if (!groupName.empty())
+    {
+        auto found = groupHandles.find(groupName);
+        group = (found != groupHandles.end() ? found->second : noTypes);
+    }
+    return group;
 }
 
 void Client::keepOnly(const std::string& groupName)
 {
-    auto groupFound = groups.find(groupName);
-    if (groupFound != groups.end())
+    auto group = getGroup(groupName);
+    if (group != noTypes)
+        keepOnly(group);
+}
+
+void Client::keepOnly(GroupHandle group)
+{
+    if (group != noTypes)
     {
-        auto shouldRemove = [&](const PacketPair& packet)
-        {
-            // The packet should be removed if the type is not found in the group
-            return (groupFound->second.find(packet.first) == groupFound->second.end());
-        };
-        packets.erase(std::remove_if(packets.begin(), packets.end(), shouldRemove), packets.end());
+        // The packets should be kept if their type is found in the group
+        storedPackets.keepOnly([&](PacketType type){ return isInGroup(type, group); });
     }
 }
 
 void Client::clear()
 {
-    packets.clear();
+    storedPackets.clear();
 }
 
-int Client::receiveUdp(const std::string& groupName)
+void Client::setStoredPacketLimit(PacketType type, std::size_t limit)
+{
+    storedPackets.setLimit(type, limit);
+}
+
+int Client::receiveUdp(GroupHandle group)
 {
     // Receive and handle any UDP packets
     int status = Nothing;
-    if (udpReady)
+    if (udpReady && udpBatch.getBatchSize() > 0)
+        status = receiveUdpBatch(group);
+    else if (udpReady)
     {
         Address address;
-        sf::Packet packet;
-        while (udpSocket.receive(packet, address.ip, address.port) == sf::Socket::Done)
+        while (udpSocket.receive(*receivedPacket, address.ip, address.port) == sf::Socket::Done)
         {
             if (isSafeAddress(address))
+                status |= handleDatagram(receivedPacket, address, group);
+        }
+    }
+    return status;
+}
+
+int Client::receiveUdpBatch(GroupHandle group)
+{
+    // Receive batches until there is nothing left, the packets point into the batch's buffers
+    int status = Nothing;
+    while (udpBatch.receive())
+    {
+        for (std::size_t i = 0; i < udpBatch.getCount(); ++i)
+        {
+            if (isSafeAddress(udpBatch.getAddress(i)))
             {
-                status |= Received;
-                status |= handlePacket(packet, groupName);
+                receivedPacket->clear();
+                receivedPacket->append(udpBatch.getData(i), udpBatch.getSize(i));
+                status |= handleDatagram(receivedPacket, udpBatch.getAddress(i), group);
             }
         }
     }
     return status;
 }
 
-int Client::receiveTcp(const std::string& groupName)
+int Client::handleDatagram(PacketPtr& packet, const Address& address, GroupHandle group)
+{
+    // Datagrams of the channels have messages inside of them, everything else is a packet
+    // Only addresses that already have channels get them, so a datagram can't create any state here
+    int status = Received;
+    sf::Int32 type = 0;
+    auto data = static_cast<const char*>(packet->getData());
+    auto found = connections.end();
+    if (readPacketType(data, packet->getDataSize(), type) && type == ChannelData)
+        found = connections.find(address);
+    if (found != connections.end())
+        status |= receiveChannels(data, packet->getDataSize(), found->second, group);
+    else
+        status |= handlePacket(packet, group);
+    return status;
+}
+
+int Client::receiveChannels(const char* data, std::size_t size, Connection& connection, GroupHandle group)
+{
+    // The connection copies the messages out, so the received packet can be reused for them
+    int status = Nothing;
+    connection.receive(clock.getElapsedTime().asMilliseconds(), data, size);
+    for (std::size_t i = 0; i < connection.getMessageCount(); ++i)
+    {
+        receivedPacket->clear();
+        receivedPacket->append(connection.getMessageData(i), connection.getMessageSize(i));
+        status |= handlePacket(receivedPacket, group);
+    }
+    return status;
+}
+
+void Client::updateChannels()
+{
+    auto now = clock.getElapsedTime().asMilliseconds();
+    for (auto& connection: connections)
+    {
+        if (!connection.second.isIdle())
+            connection.second.update(now, udpBatch, connection.first);
+    }
+}
+
+int Client::receiveTcp(GroupHandle group)
 {
     // Receive and handle any TCP packets
     int status = Nothing;
-    if (tcpConnected)
+    if (isConnected())
+    {
+        // Read everything that is available, handling the complete packets after every read
+        // A callback that disconnects or connects again resets the connection, and then nothing else is read
+        auto generation = tcpGeneration;
+        auto socketStatus = sf::Socket::Done;
+        while (socketStatus == sf::Socket::Done && generation == tcpGeneration)
+        {
+            if (receiveBuffer.size() < receiveSize + receiveChunkSize)
+                receiveBuffer.resize(receiveSize + receiveChunkSize);
+            std::size_t received = 0;
+            socketStatus = tcpSocket.receive(&receiveBuffer[receiveSize], receiveChunkSize, received);
+            receiveSize += received;
+            if (received > 0)
+                lastReceived = clock.getElapsedTime();
+            status |= handleReceivedFrames(group);
+        }
+        // Only a connection that was lost by itself is reconnected
+        if (generation == tcpGeneration && (socketStatus == sf::Socket::Disconnected || socketStatus == sf::Socket::Error))
+        {
+            tcpSocket.disconnect();
+            setConnectionStatus(Disconnected);
+        }
+    }
+    return status;
+}
+
+bool Client::flushTcp()
+{
+    bool status = true;
+    if (isConnected() && !writeBuffer.empty())
+    {
+        // Whatever couldn't be sent stays in the buffer for next time
+        std::size_t sent = 0;
+        auto socketStatus = tcpSocket.send(writeBuffer.data(), writeBuffer.size(), sent);
+        writeBuffer.erase(writeBuffer.begin(), writeBuffer.begin() + sent);
+        bufferedSince = clock.getElapsedTime();
+        status = (socketStatus == sf::Socket::Done || socketStatus == sf::Socket::Partial ||
+            socketStatus == sf::Socket::NotReady);
+    }
+    return status;
+}
+
+bool Client::startConnecting()
+{
+    // With a non-blocking socket and no timeout, SFML only starts connecting
+    resetTcp();
+    attemptInProgress = true;
+    connectStarted = clock.getElapsedTime();
+    connectionStatus = Connecting;
+    auto socketStatus = tcpSocket.connect(serverAddress.ip, serverAddress.port);
+    if (socketStatus == sf::Socket::Done)
+        setConnected();
+    else if (socketStatus != sf::Socket::NotReady)
+        setConnectionStatus(Failed);
+    return (connectionStatus != Failed);
+}
+
+void Client::updateConnection()
+{
+    if (connectionStatus == Connecting && attemptInProgress)
+    {
+        // A timeout of zero means waiting for as long as the OS does
+        auto socketStatus = getConnectStatus(tcpSocket);
+        bool timedOut = (connectTimeout > sf::Time::Zero && clock.getElapsedTime() - connectStarted >= connectTimeout);
+        if (socketStatus == sf::Socket::Done)
+            setConnected();
+        else if (socketStatus == sf::Socket::Error || timedOut)
+        {
+            tcpSocket.disconnect();
+            setConnectionStatus(Failed);
+        }
+    }
+    else if (connectionStatus == Connecting && clock.getElapsedTime() >= reconnectTime)
+        startConnecting();
+    else if (connectionStatus == Connected && heartbeatEnabled && heartbeatTimeout > sf::Time::Zero &&
+        clock.getElapsedTime() - lastReceived >= heartbeatTimeout)
     {
+        // The connection might be half-open, where the socket wouldn't notice anything for a long time
+        tcpSocket.disconnect();
+        setConnectionStatus(Disconnected);
+    }
+}
+
+void Client::setConnected()
+{
+    attemptInProgress = false;
+    reconnectAttempts = 0;
+    resetTcp();
+    connectionStatus = Connected;
+    if (compressionEnabled)
+    {
+        // This is the first thing the server gets, and nothing is compressed until it answers
         sf::Packet packet;
-        auto socketStatus = tcpSocket.receive(packet);
-        while (socketStatus == sf::Socket::Done)
+        makeControlPacket(packet, CompressionRequest);
+        packet << compressor.getDictionaryId();
+        if (!sendControlPacket(packet))
         {
-            status |= Received;
-            status |= handlePacket(packet, groupName);
-            socketStatus = tcpSocket.receive(packet);
+            tcpSocket.disconnect();
+            connectionStatus = Failed;
         }
-        if (socketStatus == sf::Socket::Disconnected || socketStatus == sf::Socket::Error)
-            tcpConnected = false;
+    }
+    setConnectionStatus(connectionStatus);
+}
+
+void Client::setConnectionStatus(ConnectionStatus status)
+{
+    // While waiting to reconnect the status is Connecting, and the callback can still call disconnect() to stop it
+    connectionStatus = status;
+    attemptInProgress = false;
+    if (status != Connected && reconnectEnabled)
+    {
+        // Double the delay for every failed attempt, and pick a random time in the second half of it
+        auto delay = reconnectDelay.asMicroseconds();
+        for (unsigned i = 0; i < reconnectAttempts && delay < maxReconnectDelay.asMicroseconds(); ++i)
+            delay *= 2;
+        delay = std::max<sf::Int64>(std::min(delay, maxReconnectDelay.asMicroseconds()), 1);
+        std::uniform_int_distribution<sf::Int64> jitter(delay / 2, delay);
+        reconnectTime = clock.getElapsedTime() + sf::microseconds(jitter(random));
+        ++reconnectAttempts;
+        connectionStatus = Connecting;
+    }
+    if (connectCallback)
+        connectCallback(status);
+}
+
+void Client::resetTcp()
+{
+    ++tcpGeneration;
+    lastReceived = clock.getElapsedTime();
+    serverRtt = sf::Time::Zero;
+    serverJitter = sf::Time::Zero;
+    snapshots.clear();
+    receiveSize = 0;
+    writeBuffer.clear();
+    compressionAccepted = false;
+}
+
+int Client::handleReceivedFrames(GroupHandle group)
+{
+    // The callbacks can reset the connection, which empties the buffer, so the rest of it is stale
+    int status = Nothing;
+    auto generation = tcpGeneration;
+    std::size_t start = 0;
+    std::size_t packetSize = 0;
+    while (generation == tcpGeneration && findFrame(&receiveBuffer[start], receiveSize - start, packetSize))
+    {
+        start += frameHeaderSize;
+        status |= handleFrame(&receiveBuffer[start], packetSize, group);
+        start += packetSize;
+    }
+
+    // Move the incomplete packet to the front, so it can be finished by the next read
+    if (generation == tcpGeneration)
+    {
+        std::copy(receiveBuffer.begin() + start, receiveBuffer.begin() + receiveSize, receiveBuffer.begin());
+        receiveSize -= start;
     }
     return status;
 }
 
-int Client::handlePacket(sf::Packet& packet, const std::string& groupName)
+int Client::handleFrame(const char* data, std::size_t size, GroupHandle group)
+{
+    // The server's answer to the compression request is handled here, and compressed packets are decompressed first
+    // Control packets of features that are off are handled like any other packet
+    int status = Received;
+    sf::Int32 type = 0;
+    readPacketType(data, size, type);
+    if (type == CompressionAccept && compressionEnabled)
+    {
+        sf::Int32 dictionaryId = 0;
+        readPacketType(data + sizeof(sf::Int32), size - sizeof(sf::Int32), dictionaryId);
+        compressionAccepted = (static_cast<sf::Uint32>(dictionaryId) == compressor.getDictionaryId());
+    }
+    else if (type == Ping && heartbeatEnabled)
+        handlePing(data, size);
+    else if (type == Snapshot && snapshotsEnabled)
+        status |= handleSnapshot(data, size, group);
+    else if (type == Compressed && compressionEnabled)
+    {
+        decompressBuffer.clear();
+        if (compressor.decompressPacket(data, size, decompressBuffer))
+        {
+            receivedPacket->clear();
+            receivedPacket->append(decompressBuffer.data(), decompressBuffer.size());
+            status |= handlePacket(receivedPacket, group);
+        }
+    }
+    else
+    {
+        // Copy the data into the pooled packet, which only allocates if it isn't big enough
+        receivedPacket->clear();
+        receivedPacket->append(data, size);
+        status |= handlePacket(receivedPacket, group);
+    }
+    return status;
+}
+
+void Client::handlePing(const char* data, std::size_t size)
+{
+    // The timestamp goes back as it is, and the server's estimates are kept
+    sf::Int32 values[3] = {0, 0, 0};
+    for (std::size_t i = 0; i < 3; ++i)
+    {
+        auto offset = (i + 1) * sizeof(sf::Int32);
+        if (offset < size)
+            readPacketType(data + offset, size - offset, values[i]);
+    }
+    serverRtt = sf::microseconds(static_cast<sf::Uint32>(values[1]));
+    serverJitter = sf::microseconds(static_cast<sf::Uint32>(values[2]));
+
+    sf::Packet packet;
+    makeControlPacket(packet, Pong);
+    packet << static_cast<sf::Uint32>(values[0]);
+    sendControlPacket(packet);
+}
+
+int Client::handleSnapshot(const char* data, std::size_t size, GroupHandle group)
+{
+    // Snapshots that can't be rebuilt are acked as 0, so the server sends a whole one next
+    int status = Nothing;
+    sf::Int32 id = 0;
+    sf::Int32 baselineId = 0;
+    const std::size_t headerSize = 3 * sizeof(sf::Int32);
+    bool valid = (size >= headerSize);
+    if (valid)
+    {
+        readPacketType(data + sizeof(sf::Int32), size - sizeof(sf::Int32), id);
+        readPacketType(data + 2 * sizeof(sf::Int32), size - 2 * sizeof(sf::Int32), baselineId);
+        auto baseline = snapshots.find(static_cast<SnapshotId>(baselineId));
+        valid = (id != 0 && (baselineId == 0 || baseline) &&
+            applyDelta((baseline ? baseline->data() : nullptr), (baseline ? baseline->size() : 0),
+                data + headerSize, size - headerSize, snapshotBuffer));
+    }
+    if (valid)
+    {
+        // The buffer is swapped with the history's, so nothing is copied
+        snapshots.add(static_cast<SnapshotId>(id)).swap(snapshotBuffer);
+        auto& snapshot = *snapshots.find(static_cast<SnapshotId>(id));
+        receivedPacket->clear();
+        receivedPacket->append(snapshot.data(), snapshot.size());
+        status = handlePacket(receivedPacket, group);
+    }
+    sf::Packet packet;
+    makeControlPacket(packet, SnapshotAck);
+    packet << static_cast<sf::Uint32>(valid ? id : 0);
+    sendControlPacket(packet);
+    return status;
+}
+
+bool Client::sendControlPacket(sf::Packet& packet)
+{
+    if (writeBuffer.empty())
+        bufferedSince = clock.getElapsedTime();
+    appendFrame(packet, writeBuffer);
+    return flushTcp();
+}
+
+int Client::handlePacket(PacketPtr& packet, GroupHandle group)
 {
     int status = Nothing;
     // Extract the packet type and make sure it is valid
     PacketType type = -1;
-    if (packet >> type)
+    if (*packet >> type)
     {
-        // Handle the packet if no group name is specified
-        if (groupName.empty())
+        // Only handle the packet if the type is part of the group
+        // Otherwise, store the packet for later
+        if (isInGroup(type, group))
         {
-            handlePacketType(packet, type);
+            handlePacketType(*packet, type);
             status = Handled;
         }
         else
-        {
-            // Only handle the packet if the group is valid and the type is part of the group
-            // Otherwise, store the packet for later
-            auto groupFound = groups.find(groupName);
-            if (groupFound != groups.end() && groupFound->second.find(type) != groupFound->second.end())
-            {
-                handlePacketType(packet, type);
-                status = Handled;
-            }
-            else
-                storePacket(packet, type);
-        }
+            storePacket(packet, type);
     }
     return status;
 }
 
 void Client::handlePacketType(sf::Packet& packet, PacketType type)
 {
-    // Lookup the callback to use, and call it if it exists
-    auto found = callbacks.find(type);
-    if (found != callbacks.end() && found->second)
-        found->second(packet);
+    // The static handlers are tried first, then the callback is looked up and called if it exists
+    if (!staticHandler || !staticHandler(packet, type))
+    {
+        if (type >= 0 && type < denseTypeCount)
+        {
+            auto& callback = denseCallbacks[type];
+            if (callback)
+                callback(packet);
+        }
+        else
+        {
+            auto found = callbacks.find(type);
+            if (found != callbacks.end() && found->second)
+                found->second(packet);
+        }
+    }
+}
+
+bool Client::isInGroup(PacketType type, GroupHandle group) const
+{
+    bool status = (group == allTypes);
+    if (group >= 0 && group < static_cast<GroupHandle>(groups.size()))
+    {
+        auto& types = groups[group];
+        if (type >= 0 && type < denseTypeCount)
+            status = types.denseTypes.test(type);
+        else
+            status = (types.otherTypes.find(type) != types.otherTypes.end());
+    }
+    return status;
 }
 
 bool Client::isSafeAddress(const Address& address) const
@@ -187,44 +711,22 @@ bool Client::isSafeAddress(const Address& address) const
     return (safeAddresses.empty() || safeAddresses.find(address) != safeAddresses.end());
 }
 
-void Client::storePacket(sf::Packet& packet, PacketType type)
+void Client::storePacket(PacketPtr& packet, PacketType type)
 {
-    packets.emplace_back(type, packet);
+    storedPackets.push(type, std::move(packet));
+    packet = packetPool.acquire();
 }
 
-int Client::handleStoredPackets(const std::string& groupName)
+int Client::handleStoredPackets(GroupHandle group)
 {
     int status = Nothing;
-    if (!packets.empty())
+    if (!storedPackets.empty() && group != noTypes)
     {
-        if (groupName.empty())
-        {
-            // Handle all of the stored packets, then clear them
-            for (auto& packet: packets)
-                handlePacketType(packet.second, packet.first);
-            packets.clear();
+        // Handle only the packets in the group, in the order they were received
+        auto inGroup = [&](PacketType type){ return isInGroup(type, group); };
+        auto handle = [&](sf::Packet& packet, PacketType type){ handlePacketType(packet, type); };
+        if (storedPackets.handle(inGroup, handle))
             status = Handled;
-        }
-        else
-        {
-            auto groupFound = groups.find(groupName);
-            if (groupFound != groups.end())
-            {
-                // Handle only the specified packets, and erase them
-                auto packet = packets.begin();
-                while (packet != packets.end())
-                {
-                    if (groupFound->second.find(packet->first) != groupFound->second.end())
-                    {
-                        handlePacketType(packet->second, packet->first);
-                        packet = packets.erase(packet);
-                        status = Handled;
-                    }
-                    else
-                        ++packet;
-                }
-            }
-        }
     }
     return status;
 }
@@ -6,11 +6,23 @@
 
 #include <map>
 #include <set>
-#include <deque>
+#include <unordered_map>
+#include <vector>
+#include <array>
+#include <bitset>
 #include <functional>
+#include <random>
 #include <initializer_list>
 #include <SFML/Network.hpp>
 #include "address.h"
+#include "packetpool.h"
+#include "packetstore.h"
+#include "udpbatch.h"
+#include "connection.h"
+#include "compressor.h"
+#include "packethandlers.h"
+#include "message.h"
+#include "snapshot.h"
 
 namespace net
 {
@@ -23,6 +35,39 @@ About Client:
     Packets get automatically handled by callbacks that you can set for each packet type.
     It is meant to be used with client-side applications, and can communicate with a single server.
         If you need to communicate with multiple servers, simply make multiple instances of this class.
+    Received packets come from a pool, and stored packets are moved into storage instead of being copied.
+        Once the pool and receive buffer have grown enough, receiving doesn't allocate any memory.
+    Stored packets are kept in a queue for each packet type, so handling a group only costs as much as
+        the packets in that group. The number of stored packets of a type can be limited.
+    Callbacks for packet types 0 to 255 are kept in a flat array, and groups are kept as bitsets.
+        Groups can be used by their handles (returned by setGroup()) instead of their names,
+        which avoids looking up the name every time.
+    Handlers can also be set at compile time with setStaticHandlers() (see packethandlers.h).
+    Messages of the compact message format (see message.h) can be handled with registerMessage(),
+        which decodes them in place before calling the callback.
+    UDP packets can be received in batches with setUdpBatching(), and queued with queueSend() to be sent
+        all at once by flush() or receive(). On Linux, each batch only costs one system call (see udpbatch.h).
+    UDP packets can also be sent on channels, which can be reliable and/or ordered (see connection.h).
+        The channels keep their state for each address, and are updated (resends and acks) by receive().
+        Only addresses that were sent to on a channel, or were added with addChannels(), are received from
+        on channels. Anything else is handled as a normal packet, so unknown addresses can't use up memory.
+    TCP packets can be batched with setSendBatching(), and are then sent together by flush() or receive(),
+        or when enough of them were sent. The framing stays the same, so the server doesn't need to know.
+    TCP packets can be compressed with setCompression() (see compressor.h). The client asks for it when
+        it connects, and only compresses what it sends once the server agrees.
+    Connecting can be done without waiting with connectAsync(). The connection is then finished by the
+        following calls to receive(), which call the connect callback once it is done or has failed.
+    With setReconnect(), the client connects again by itself when the connection is lost or fails.
+        The delay doubles with every failed attempt, up to a limit, and is randomized so that many
+        clients don't all reconnect at the same moment.
+    With setHeartbeat(), pings from a TcpServer with a heartbeat are answered by receive(), and carry the
+        round trip time the server measured, which getRtt() returns. A server that hasn't sent anything
+        for too long can also be treated as a lost connection.
+    With setSnapshots(), snapshots from TcpServer::sendSnapshot() are rebuilt from their deltas and acked
+        by receive(), and are then handled like any other packet of their type (see snapshot.h).
+    Packet types from firstControlType to -1 are reserved for the library's control packets (see protocol.h).
+        Only the ones of the features that are on (compression, the heartbeat, and snapshots) are
+        intercepted, so while a feature is off, packets of its types still reach the callbacks.
 
 Usage:
     Refer to README.md.
@@ -39,12 +84,30 @@ class Client
         using PacketType = sf::Int32;
         using AddressSet = std::set<Address>;
         using CallbackType = std::function<void(sf::Packet&)>;
+        using GroupHandle = int;
         enum Status
         {
             Nothing = 0,
             Received = 1,
             Handled = 2
         };
+        enum ConnectionStatus
+        {
+            Disconnected,
+            Connecting, // Also used while waiting to reconnect
+            Connected,
+            Failed
+        };
+        using ConnectCallbackType = std::function<void(ConnectionStatus)>;
+
+        static const PacketType denseTypeCount = 256; // Packet types below this are looked up in flat arrays
+        static const GroupHandle allTypes = -1; // Used for all of the packet types
+        static const GroupHandle noTypes = -2; // Used for none of the packet types (like a group that doesn't exist)
+        static const std::size_t defaultBatchSize = 16 * 1024; // In bytes
+        static const int defaultBatchDelay = 5; // Milliseconds
+        static const int defaultConnectTimeout = 5; // Seconds
+        static const int defaultReconnectDelay = 250; // Milliseconds
+        static const int defaultMaxReconnectDelay = 30; // Seconds
 
         // Constructors/setup
         Client();
@@ -52,55 +115,195 @@ class Client
         // TCP socket
         bool connect(const sf::IpAddress& address, unsigned short port, sf::Time timeout = sf::Time::Zero);
         bool connect(const Address& address, sf::Time timeout = sf::Time::Zero);
-        void disconnect();
+        bool connectAsync(const sf::IpAddress& address, unsigned short port, sf::Time timeout = sf::seconds(defaultConnectTimeout));
+        bool connectAsync(const Address& address, sf::Time timeout = sf::seconds(defaultConnectTimeout));
+            // Returns right away, receive() finishes connecting (returns false if it failed right away)
+        void disconnect(); // Also stops reconnecting
+        ConnectionStatus getConnectionStatus() const;
+        void setConnectCallback(ConnectCallbackType callback); // Called with Connected, Failed, or Disconnected when it is lost
+        void setReconnect(bool enabled, sf::Time delay = sf::milliseconds(defaultReconnectDelay),
+            sf::Time maxDelay = sf::seconds(defaultMaxReconnectDelay)); // Off by default
+        void setHeartbeat(bool enabled, sf::Time timeout = sf::Time::Zero);
+            // Answers the server's pings (off by default), and disconnects if nothing is received for timeout (0 = never)
+        sf::Time getRtt() const; // Round trip time of the TCP connection, as measured by the server's heartbeat
+        sf::Time getJitter() const;
+        void setSnapshots(bool enabled, std::size_t history = defaultSnapshotHistory);
+            // Rebuilds and acks the server's snapshots (off by default), the history should be the same as the server's
+        void setSendBatching(std::size_t bytes = defaultBatchSize, sf::Time delay = sf::milliseconds(defaultBatchDelay));
+            // TCP packets are batched until there are this many bytes, or the first one is this old (0 bytes turns this off)
+        void setCompression(bool enabled, const Compressor& compressor = Compressor()); // Used from the next connect()
 
         // UDP socket
         void bindPort(unsigned short port); // Bind UDP port to receive data on
         void setSafeAddresses(AddressSet& addresses); // Only accept UDP packets from these addresses
             // Note: If this is not set, then it will accept all packets
+        void setUdpBatching(std::size_t batchSize, std::size_t bufferSize = UdpBatch::defaultBufferSize);
+            // Receives up to batchSize UDP packets at once (0 turns this off)
+            // Note: While this is on, UDP packets bigger than bufferSize are dropped
 
         // Communication
         int receive(const std::string& groupName = ""); // Receives and handles all or specified packet types
-        bool send(sf::Packet& packet); // Send packet through TCP
+        int receive(GroupHandle group);
+        bool send(sf::Packet& packet); // Send packet through TCP, whatever the socket can't take yet is sent by receive() or flush()
         bool send(sf::Packet& packet, const Address& address); // Send packet through UDP
         bool send(sf::Packet& packet, const sf::IpAddress& address, unsigned short port); // Send packet through UDP
+        bool send(sf::Packet& packet, const Address& address, Connection::Channel channel); // Send packet on a UDP channel
+            // Note: This also sends the packets queued with queueSend()
+        bool queueSend(sf::Packet& packet, const Address& address); // Queue packet to be sent through UDP
+        bool flush(); // Sends all of the queued UDP packets and batched TCP packets, this is also done at the end of receive()
         bool isConnected() const; // Returns true if connected through TCP
+        sf::Time getRtt(const Address& address) const; // Round trip time measured by the channels
+        void addChannels(const Address& address); // Accepts channel data from an address before sending to it
+        void removeChannels(const Address& address); // Forgets the channel state for an address
 
         // Packet handling
         void registerCallback(PacketType type, CallbackType callback);
-        void setGroup(const std::string& groupName, std::initializer_list<PacketType> packetTypes);
+        template <typename Message>
+        void registerMessage(std::function<void(const Message&)> callback); // Uses Message::type (see message.h)
+        template <typename Handlers>
+        void setStaticHandlers(); // These are tried before the callbacks (see packethandlers.h)
+        GroupHandle setGroup(const std::string& groupName, std::initializer_list<PacketType> packetTypes);
+        GroupHandle getGroup(const std::string& groupName) const; // Returns allTypes for "", and noTypes if not found
         void keepOnly(const std::string& groupName); // Removes all other packets
+        void keepOnly(GroupHandle group);
         void clear(); // Removes all of the stored unhandled packets
+        void setStoredPacketLimit(PacketType type, std::size_t limit); // Drops the oldest ones over this (0 = no limit)
 
     private:
-        int receiveUdp(const std::string& groupName = "");
-        int receiveTcp(const std::string& groupName = "");
-        int handlePacket(sf::Packet& packet, const std::string& groupName = "");
+        using PacketPtr = PacketPool::PacketPtr;
+        using StaticHandlerType = bool (*)(sf::Packet&, PacketType);
+
+        // A set of packet types, the common ones are kept in a bitset
+        struct Group
+        {
+            std::bitset<denseTypeCount> denseTypes;
+            std::set<PacketType> otherTypes;
+        };
+
+        static const std::size_t receiveChunkSize = 16 * 1024; // Bytes read from the TCP socket at once
+
+        // Connecting
+        bool startConnecting();
+        void updateConnection(); // Checks on the connection attempt, or starts the next one
+        void setConnected();
+        void setConnectionStatus(ConnectionStatus status); // Calls the callback, and schedules reconnecting
+        void resetTcp(); // Forgets everything about the last connection, and starts a new generation
+        int receiveUdp(GroupHandle group);
+        int receiveUdpBatch(GroupHandle group);
+        int handleDatagram(PacketPtr& packet, const Address& address, GroupHandle group); // The packet has the datagram
+        int receiveChannels(const char* data, std::size_t size, Connection& connection, GroupHandle group);
+        void updateChannels();
+        int receiveTcp(GroupHandle group);
+        bool flushTcp(); // Sends as much of the write buffer as possible
+        int handleReceivedFrames(GroupHandle group);
+        int handleFrame(const char* data, std::size_t size, GroupHandle group);
+        void handlePing(const char* data, std::size_t size);
+        int handleSnapshot(const char* data, std::size_t size, GroupHandle group);
+        bool sendControlPacket(sf::Packet& packet); // Sent right away, after anything already in the write buffer
+        int handlePacket(PacketPtr& packet, GroupHandle group);
         void handlePacketType(sf::Packet& packet, PacketType type);
+        bool isInGroup(PacketType type, GroupHandle group) const;
         bool isSafeAddress(const Address& address) const;
-        void storePacket(sf::Packet& packet, PacketType type);
-        int handleStoredPackets(const std::string& groupName = "");
+        void storePacket(PacketPtr& packet, PacketType type); // Takes the packet, and replaces it with a new one
+        int handleStoredPackets(GroupHandle group);
 
         // Sockets
         sf::TcpSocket tcpSocket;
         sf::UdpSocket udpSocket;
-        bool tcpConnected;
+        ConnectionStatus connectionStatus;
         bool udpReady;
 
-        // Callbacks are stored in here
+        // The last server connected to, and the state of connecting to it without blocking
+        Address serverAddress;
+        sf::Time connectTimeout;
+        sf::Time connectStarted; // When the current attempt started, from the clock
+        bool attemptInProgress; // Whether the socket is connecting, instead of waiting to reconnect
+        ConnectCallbackType connectCallback;
+
+        // Reconnecting with exponential backoff
+        bool reconnectEnabled;
+        sf::Time reconnectDelay;
+        sf::Time maxReconnectDelay;
+        sf::Time reconnectTime; // When the next attempt starts, from the clock
+        unsigned reconnectAttempts; // Failed attempts since the last connection
+        std::minstd_rand random; // For the jitter of the delay
+
+        // The server's heartbeat
+        bool heartbeatEnabled;
+        sf::Time heartbeatTimeout;
+        sf::Time lastReceived; // When TCP data was last received, from the clock
+        sf::Time serverRtt;
+        sf::Time serverJitter;
+
+        // Snapshots that can be used as baselines, and the one being rebuilt
+        bool snapshotsEnabled;
+        SnapshotHistory snapshots;
+        std::vector<char> snapshotBuffer;
+
+        // Framed TCP packets that haven't been sent yet, which are held back for a while when batching
+        std::vector<char> writeBuffer;
+        std::size_t batchSize; // 0 if batching is off
+        sf::Time batchDelay;
+        sf::Time bufferedSince; // When the first packet in the write buffer was added
+
+        // TCP compression, which is only used for sending once the server accepts it
+        Compressor compressor;
+        bool compressionEnabled;
+        bool compressionAccepted;
+        std::vector<char> decompressBuffer;
+
+        // Batched UDP receiving and sending
+        UdpBatch udpBatch;
+
+        // Channels for each address, and the clock they use
+        std::unordered_map<Address, Connection, AddressHash> connections;
+        sf::Clock clock;
+
+        // Callbacks are stored in here, only the ones that aren't dense are in the map
+        std::array<CallbackType, denseTypeCount> denseCallbacks;
         std::map<PacketType, CallbackType> callbacks;
+        StaticHandlerType staticHandler;
+
+        // Groups of packet types are stored in here, and the names map to their handles
+        std::vector<Group> groups;
+        std::map<std::string, GroupHandle> groupHandles;
 
-        // Groups of packet types are stored in here
-        std::map<std::string, std::set<PacketType> > groups;
+        // Packets are received into this one, stored packets go back into the pool after being handled
+        PacketPool packetPool;
+        PacketPtr receivedPacket;
 
         // Packets to be handled when specified
-        using PacketPair = std::pair<PacketType, sf::Packet>;
-        std::deque<PacketPair> packets;
+        PacketStore storedPackets;
+
+        // TCP data is read into here, and may end with an incomplete packet
+        std::vector<char> receiveBuffer;
+        std::size_t receiveSize;
+        unsigned tcpGeneration; // Changed by every reset, so receiving can tell when a callback reset the connection
 
         // UDP packets will only be received from these addresses
         AddressSet safeAddresses;
 };
 
+template <typename Message>
+void Client::registerMessage(std::function<void(const Message&)> callback)
+{
+    // The type was already read from the packet, so only the rest of it is decoded
+    registerCallback(Message::type, [callback](sf::Packet& packet)
+    {
+        Message message = Message();
+        auto data = static_cast<const char*>(packet.getData());
+        if (packet.getDataSize() >= sizeof(PacketType) &&
+            decodeMessageBody(data + sizeof(PacketType), packet.getDataSize() - sizeof(PacketType), message))
+            callback(message);
+    });
+}
+
+template <typename Handlers>
+void Client::setStaticHandlers()
+{
+    staticHandler = &Handlers::handle;
+}
+
 }
 
 #endif
@@ -0,0 +1,343 @@
+// See the file COPYRIGHT.txt for authors and copyright information.
+// See the file LICENSE.txt for copying conditions.
+
+#include "compressor.h"
+#include "frame.h"
+#include "protocol.h"
+#include <cstring>
+#include <algorithm>
+
+namespace net
+{
+
+namespace
+{
+
+const unsigned hashBits = 12;
+const std::size_t minMatch = 4; // Shorter matches wouldn't save anything
+const std::size_t lastLiterals = 5; // The end of the data is always literals, like in LZ4
+const std::size_t maxOffset = 65535;
+
+std::uint32_t read32(const char* data)
+{
+    std::uint32_t value = 0;
+    std::memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+std::uint32_t hash(std::uint32_t value)
+{
+    return (value * 2654435761u) >> (32 - hashBits);
+}
+
+// Lengths of 15 and over continue in the following bytes, which are added up until one isn't 255
+void writeLength(std::vector<char>& output, std::size_t length)
+{
+    while (length >= 255)
+    {
+        output.push_back(static_cast<char>(255));
+        length -= 255;
+    }
+    output.push_back(static_cast<char>(length));
+}
+
+bool readLength(const unsigned char* input, std::size_t size, std::size_t& position, std::size_t& length)
+{
+    bool status = true;
+    if (length == 15)
+    {
+        unsigned char byte = 255;
+        while (status && byte == 255)
+        {
+            status = (position < size);
+            if (status)
+            {
+                byte = input[position++];
+                length += byte;
+            }
+        }
+    }
+    return status;
+}
+
+// Writes a token, the literals, and then the match (the last sequence has no match, so its length is 0)
+void writeSequence(std::vector<char>& output, const char* literals, std::size_t literalCount, std::size_t offset, std::size_t matchLength)
+{
+    std::size_t matchCode = (matchLength > 0 ? matchLength - minMatch : 0);
+    auto token = (std::min<std::size_t>(literalCount, 15) << 4) | std::min<std::size_t>(matchCode, 15);
+    output.push_back(static_cast<char>(token));
+    if (literalCount >= 15)
+        writeLength(output, literalCount - 15);
+    output.insert(output.end(), literals, literals + literalCount);
+    if (matchLength > 0)
+    {
+        output.push_back(static_cast<char>(offset & 0xFF));
+        output.push_back(static_cast<char>(offset >> 8));
+        if (matchCode >= 15)
+            writeLength(output, matchCode - 15);
+    }
+}
+
+// The hash table of a thread, which is reset by moving on to a new stamp instead of clearing it
+// Entries with an older stamp count as empty, so they are looked up in the dictionary's table instead
+struct ThreadTable
+{
+    struct Entry
+    {
+        std::uint32_t position;
+        std::uint32_t stamp;
+    };
+
+    std::vector<Entry> entries;
+    std::uint32_t stamp = 0;
+};
+
+void writeBigEndian(char* data, std::uint32_t value)
+{
+    for (unsigned i = 0; i < 4; ++i)
+        data[i] = static_cast<char>((value >> (8 * (3 - i))) & 0xFF);
+}
+
+}
+
+Compressor::Compressor():
+    dictionaryId(0),
+    threshold(defaultThreshold)
+{
+}
+
+void Compressor::setDictionary(const void* data, std::size_t size)
+{
+    dictionary.reset();
+    dictionaryTable.reset();
+    dictionaryId = 0;
+    if (size > 0)
+    {
+        // Matches can't reach back further than the maximum offset anyway
+        auto bytes = static_cast<const char*>(data);
+        if (size > maxDictionarySize)
+        {
+            bytes += size - maxDictionarySize;
+            size = maxDictionarySize;
+        }
+        auto newDictionary = std::make_shared<std::vector<char> >(bytes, bytes + size);
+
+        // Hash the dictionary once here, compressing only looks things up in it
+        auto table = std::make_shared<HashTable>(std::size_t(1) << hashBits, 0);
+        for (std::size_t i = 0; i + minMatch <= size; ++i)
+            (*table)[hash(read32(bytes + i))] = static_cast<std::uint32_t>(i);
+
+        // FNV-1a, which is never 0 here so the ID can't be mistaken for no dictionary
+        std::uint32_t id = 2166136261u;
+        for (std::size_t i = 0; i < size; ++i)
+            id = (id ^ static_cast<unsigned char>(bytes[i])) * 16777619u;
+        dictionary = newDictionary;
+        dictionaryTable = table;
+        dictionaryId = (id != 0 ? id : 1);
+    }
+}
+
+sf::Uint32 Compressor::getDictionaryId() const
+{
+    return dictionaryId;
+}
+
+void Compressor::setThreshold(std::size_t bytes)
+{
+    threshold = bytes;
+}
+
+std::size_t Compressor::getThreshold() const
+{
+    return threshold;
+}
+
+bool Compressor::compress(const void* data, std::size_t size, std::vector<char>& output) const
+{
+    // The dictionary works as if it was right in front of the data, but both are read where they are
+    // Positions count from the start of the dictionary, so a match can point into either one
+    auto input = static_cast<const char*>(data);
+    const char* dictionaryData = (dictionary ? dictionary->data() : nullptr);
+    std::size_t dictionarySize = (dictionary ? dictionary->size() : 0);
+    auto byteAt = [&](std::size_t position)
+    {
+        return (position < dictionarySize ? dictionaryData[position] : input[position - dictionarySize]);
+    };
+    auto readAt = [&](std::size_t position)
+    {
+        std::uint32_t value = 0;
+        if (position >= dictionarySize)
+            value = read32(input + position - dictionarySize);
+        else if (position + sizeof(value) <= dictionarySize)
+            value = read32(dictionaryData + position);
+        else
+        {
+            char bytes[sizeof(value)];
+            for (std::size_t i = 0; i < sizeof(value); ++i)
+                bytes[i] = byteAt(position + i);
+            value = read32(bytes);
+        }
+        return value;
+    };
+
+    // Each thread keeps its own table, which doesn't need to be cleared or allocated for each packet
+    static thread_local ThreadTable table;
+    if (table.entries.empty() || ++table.stamp == 0)
+    {
+        table.entries.assign(std::size_t(1) << hashBits, ThreadTable::Entry{0, 0});
+        table.stamp = 1;
+    }
+
+    // Give up as soon as the output isn't smaller than the input
+    auto start = output.size();
+    auto limit = start + size;
+    output.reserve(limit);
+    std::size_t end = dictionarySize + size;
+    std::size_t position = dictionarySize;
+    std::size_t anchor = position; // Start of the literals that haven't been written yet
+    bool status = true;
+    if (size > minMatch + lastLiterals)
+    {
+        std::size_t matchLimit = end - lastLiterals;
+        while (status && position + minMatch <= matchLimit)
+        {
+            auto value = readAt(position);
+            auto index = hash(value);
+            auto& entry = table.entries[index];
+            std::size_t candidate = (entry.stamp == table.stamp ? entry.position :
+                (dictionaryTable ? (*dictionaryTable)[index] : 0));
+            entry.position = static_cast<std::uint32_t>(position);
+            entry.stamp = table.stamp;
+            if (candidate < position && position - candidate <= maxOffset && readAt(candidate) == value)
+            {
+                // The match is extended through the rest of the dictionary first, and then the data
+                std::size_t length = minMatch;
+                while (candidate + length < dictionarySize && position + length < matchLimit &&
+                    dictionaryData[candidate + length] == input[position + length - dictionarySize])
+                    ++length;
+                if (candidate + length >= dictionarySize)
+                {
+                    while (position + length < matchLimit &&
+                        input[candidate + length - dictionarySize] == input[position + length - dictionarySize])
+                        ++length;
+                }
+                writeSequence(output, input + anchor - dictionarySize, position - anchor, position - candidate, length);
+                position += length;
+                anchor = position;
+                status = (output.size() < limit);
+            }
+            else
+                position += 1 + ((position - anchor) >> 6); // Skip ahead faster through data that doesn't compress
+        }
+    }
+    if (status)
+    {
+        writeSequence(output, input + anchor - dictionarySize, end - anchor, 0, 0);
+        status = (output.size() < limit);
+    }
+    if (!status)
+        output.resize(start);
+    return status;
+}
+
+bool Compressor::decompress(const void* data, std::size_t size, std::size_t originalSize, std::vector<char>& output) const
+{
+    auto input = static_cast<const unsigned char*>(data);
+    std::size_t dictionarySize = (dictionary ? dictionary->size() : 0);
+    auto start = output.size();
+
+    // A byte of input can't turn into more than 255 bytes of output, so anything bigger is invalid
+    // The output is allocated up front, so the size is checked before trusting it
+    bool status = (originalSize <= maxOriginalSize && originalSize <= size * 255);
+    if (status)
+        output.resize(start + originalSize);
+    std::size_t in = 0;
+    std::size_t out = 0;
+    while (status && in < size)
+    {
+        // Copy the literals
+        unsigned token = input[in++];
+        std::size_t literals = token >> 4;
+        status = (readLength(input, size, in, literals) && literals <= size - in && literals <= originalSize - out);
+        if (status && literals > 0)
+        {
+            std::memcpy(&output[start + out], input + in, literals);
+            in += literals;
+            out += literals;
+        }
+
+        // Copy the match, unless this was the last sequence
+        if (status && in < size)
+        {
+            status = (size - in >= 2);
+            std::size_t offset = 0;
+            std::size_t length = token & 15;
+            if (status)
+            {
+                offset = input[in] | (static_cast<std::size_t>(input[in + 1]) << 8);
+                in += 2;
+                status = readLength(input, size, in, length);
+                length += minMatch;
+            }
+            status = (status && offset > 0 && offset <= out + dictionarySize && length <= originalSize - out);
+            for (std::size_t i = 0; status && i < length; ++i)
+            {
+                // The match can overlap itself, so it is copied one byte at a time
+                if (offset <= out)
+                    output[start + out] = output[start + out - offset];
+                else
+                    output[start + out] = (*dictionary)[dictionarySize - (offset - out)];
+                ++out;
+            }
+        }
+    }
+    status = (status && out == originalSize);
+    if (!status)
+        output.resize(start);
+    return status;
+}
+
+bool Compressor::appendCompressedFrame(const void* data, std::size_t size, std::vector<char>& buffer) const
+{
+    bool status = (size > 0 && size >= threshold && size <= maxOriginalSize);
+    if (status)
+    {
+        // The headers are filled in once the compressed size is known
+        auto start = buffer.size();
+        buffer.resize(start + frameHeaderSize + packetHeaderSize);
+        status = compress(data, size, buffer);
+        std::size_t packetSize = buffer.size() - start - frameHeaderSize;
+        status = (status && packetSize < size);
+        if (status)
+        {
+            writeBigEndian(&buffer[start], static_cast<std::uint32_t>(packetSize));
+            writeBigEndian(&buffer[start + frameHeaderSize], static_cast<std::uint32_t>(Compressed));
+            writeBigEndian(&buffer[start + frameHeaderSize + 4], static_cast<std::uint32_t>(size));
+        }
+        else
+            buffer.resize(start);
+    }
+    return status;
+}
+
+bool Compressor::decompressPacket(const void* data, std::size_t size, std::vector<char>& output, std::size_t maxSize) const
+{
+    sf::Int32 type = 0;
+    bool status = (readPacketType(data, size, type) && type == Compressed && size >= packetHeaderSize);
+    if (status)
+    {
+        // The original size comes right after the type
+        auto bytes = static_cast<const char*>(data);
+        sf::Int32 originalSize = 0;
+        readPacketType(bytes + 4, size - 4, originalSize);
+        status = (maxSize == 0 || static_cast<sf::Uint32>(originalSize) <= maxSize);
+        if (status)
+        {
+            status = decompress(bytes + packetHeaderSize, size - packetHeaderSize,
+                static_cast<sf::Uint32>(originalSize), output);
+        }
+    }
+    return status;
+}
+
+}
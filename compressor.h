@@ -0,0 +1,64 @@
+// See the file COPYRIGHT.txt for authors and copyright information.
+// See the file LICENSE.txt for copying conditions.
+
+#ifndef COMPRESSOR_H
+#define COMPRESSOR_H
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <SFML/Network.hpp>
+
+namespace net
+{
+
+/*
+A fast compressor for packets, with a block format like the one LZ4 uses.
+The data is turned into a sequence of literals and back references, where each back reference
+    copies earlier data from up to 64 KB back. Finding the matches only uses a small hash table,
+    so compressing is cheap enough to do for every packet, and decompressing is even cheaper.
+A dictionary can be set, which works as if it was sent right before every packet. Small packets
+    don't repeat much within themselves, but they usually have a lot in common with a dictionary
+    made from typical packets. Both sides need to use the same dictionary, which is checked with
+    its ID when the connection agrees to use compression.
+Packets smaller than the threshold are never compressed, since there is little to gain from them.
+Compressed packets start with the Compressed control type and the original size (see protocol.h),
+    so they can be told apart from the normal packets.
+Copies are cheap, since the dictionary is shared between them. Compressing and decompressing can
+    be done from any number of threads at the same time.
+*/
+class Compressor
+{
+    public:
+        static const std::size_t defaultThreshold = 128; // Bytes
+        static const std::size_t maxDictionarySize = 64 * 1024; // Only the end of a bigger dictionary is used
+        static const std::size_t packetHeaderSize = 8; // Type and original size, in front of the compressed data
+        static const std::size_t maxOriginalSize = 64 * 1024 * 1024; // Bigger data is never compressed or decompressed
+
+        Compressor();
+        void setDictionary(const void* data, std::size_t size); // Use a size of 0 to remove the dictionary
+        sf::Uint32 getDictionaryId() const; // A hash of the dictionary, 0 if there is none
+        void setThreshold(std::size_t bytes = defaultThreshold);
+        std::size_t getThreshold() const;
+
+        // Blocks of data, these append to the output, and leave it unchanged if they fail
+        bool compress(const void* data, std::size_t size, std::vector<char>& output) const; // Fails if it wouldn't be smaller
+        bool decompress(const void* data, std::size_t size, std::size_t originalSize, std::vector<char>& output) const;
+
+        // Packets, these fail if the packet is below the threshold or wouldn't get smaller
+        bool appendCompressedFrame(const void* data, std::size_t size, std::vector<char>& buffer) const;
+        // Takes a Compressed packet, and fails before decompressing it if it would be bigger than maxSize (0 is unlimited)
+        bool decompressPacket(const void* data, std::size_t size, std::vector<char>& output, std::size_t maxSize = 0) const;
+
+    private:
+        using HashTable = std::vector<std::uint32_t>; // Positions of earlier data, by the hash of their first 4 bytes
+
+        std::shared_ptr<const std::vector<char> > dictionary;
+        std::shared_ptr<const HashTable> dictionaryTable; // Hash table with the dictionary already in it
+        sf::Uint32 dictionaryId;
+        std::size_t threshold;
+};
+
+}
+
+#endif
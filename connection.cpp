@@ -0,0 +1,389 @@
+// See the file COPYRIGHT.txt for authors and copyright information.
+// See the file LICENSE.txt for copying conditions.
+
+#include "connection.h"
+#include "frame.h"
+#include "protocol.h"
+#include <algorithm>
+#include <cmath>
+
+namespace net
+{
+
+namespace
+{
+
+// Everything is big-endian, the same as sf::Packet
+void write(std::vector<char>& buffer, std::uint32_t value, std::size_t bytes)
+{
+    for (std::size_t i = 0; i < bytes; ++i)
+        buffer.push_back(static_cast<char>((value >> (8 * (bytes - 1 - i))) & 0xFF));
+}
+
+std::uint32_t read(const char* data, std::size_t bytes)
+{
+    std::uint32_t value = 0;
+    for (std::size_t i = 0; i < bytes; ++i)
+        value = (value << 8) | static_cast<unsigned char>(data[i]);
+    return value;
+}
+
+const std::uint8_t acksValid = 1; // Set in the flags once something was received from the other side
+
+}
+
+Connection::SentPacket::SentPacket():
+    sequence(0),
+    valid(false),
+    sentTime(0)
+{
+}
+
+Connection::OutgoingChannel::OutgoingChannel():
+    nextId(0)
+{
+}
+
+Connection::OrderedMessage::OrderedMessage():
+    present(false)
+{
+}
+
+Connection::Connection():
+    sentPackets(sentPacketCount),
+    nextSequence(0),
+    remoteSequence(0),
+    remoteAckBits(0),
+    receivedAny(false),
+    ackPending(false),
+    lastSequencedId(0),
+    receivedSequenced(false),
+    unorderedIds(receiveWindow, 0),
+    orderedMessages(receiveWindow),
+    nextOrderedId(0),
+    smoothedRtt(0.0),
+    rttVariance(0.0),
+    hasRtt(false),
+    rto(initialRto)
+{
+}
+
+bool Connection::send(Channel channel, const void* data, std::size_t size)
+{
+    bool reliable = (channel == ReliableUnordered || channel == ReliableOrdered);
+    bool status = (channel >= 0 && channel < ChannelCount && size <= maxMessageSize
+        && (!reliable || channels[channel].messages.size() < maxUnackedMessages));
+    if (status)
+    {
+        auto& outgoing = channels[channel];
+        OutgoingMessage message;
+        message.id = outgoing.nextId++;
+        auto bytes = static_cast<const char*>(data);
+        message.data.assign(bytes, bytes + size);
+        message.lastSent = 0;
+        message.sent = false;
+        message.acked = false;
+        outgoing.messages.push_back(std::move(message));
+    }
+    return status;
+}
+
+bool Connection::send(Channel channel, sf::Packet& packet)
+{
+    std::size_t size = 0;
+    const void* data = getPacketData(packet, size);
+    return send(channel, data, size);
+}
+
+void Connection::update(std::uint64_t now, UdpBatch& batch, const Address& address)
+{
+    startDatagram();
+    for (unsigned channel = 0; channel < ChannelCount; ++channel)
+    {
+        auto& messages = channels[channel].messages;
+        if (channel == ReliableUnordered || channel == ReliableOrdered)
+        {
+            // Send the new messages, and resend the ones that weren't acked in time
+            for (auto& message: messages)
+            {
+                if (!message.acked && (!message.sent || now - message.lastSent >= rto))
+                {
+                    addMessage(channel, message, batch, address, now);
+                    currentMessages.push_back(SentMessage{static_cast<std::uint8_t>(channel), message.id});
+                    message.sent = true;
+                    message.lastSent = now;
+                }
+            }
+        }
+        else
+        {
+            // The unreliable messages are only sent once
+            for (auto& message: messages)
+                addMessage(channel, message, batch, address, now);
+            messages.clear();
+        }
+    }
+
+    // If there were no messages to carry the acks, they are sent by themselves
+    if (datagram.size() > datagramHeaderSize || ackPending)
+        finishDatagram(batch, address, now);
+}
+
+bool Connection::isIdle() const
+{
+    bool status = !ackPending;
+    for (auto& channel: channels)
+        status = (status && channel.messages.empty());
+    return status;
+}
+
+bool Connection::receive(std::uint64_t now, const void* data, std::size_t size)
+{
+    receiveBuffer.clear();
+    received.clear();
+    auto bytes = static_cast<const char*>(data);
+    sf::Int32 type = 0;
+    bool status = (readPacketType(data, size, type) && type == ChannelData && size >= datagramHeaderSize);
+    if (status)
+    {
+        // Read the header, and mark everything the other side got as acked
+        auto sequence = static_cast<Sequence>(read(bytes + 4, 2));
+        auto flags = static_cast<std::uint8_t>(read(bytes + 6, 1));
+        auto ack = static_cast<Sequence>(read(bytes + 7, 2));
+        auto ackBits = read(bytes + 9, 4);
+        if (flags & acksValid)
+        {
+            ackSequence(ack, now);
+            for (unsigned i = 0; i < 32; ++i)
+            {
+                if (ackBits & (std::uint32_t(1) << i))
+                    ackSequence(static_cast<Sequence>(ack - 1 - i), now);
+            }
+            for (unsigned channel = ReliableUnordered; channel <= ReliableOrdered; ++channel)
+            {
+                auto& messages = channels[channel].messages;
+                while (!messages.empty() && messages.front().acked)
+                    messages.pop_front();
+            }
+        }
+        receiveSequence(sequence);
+
+        // Read the messages
+        std::size_t offset = datagramHeaderSize;
+        while (status && offset < size)
+        {
+            status = (size - offset >= messageHeaderSize);
+            if (status)
+            {
+                auto channel = static_cast<std::uint8_t>(read(bytes + offset, 1));
+                auto id = static_cast<Sequence>(read(bytes + offset + 1, 2));
+                std::size_t messageSize = read(bytes + offset + 3, 2);
+                offset += messageHeaderSize;
+                status = (channel < ChannelCount && size - offset >= messageSize);
+                if (status)
+                {
+                    receiveMessage(channel, id, bytes + offset, messageSize);
+                    offset += messageSize;
+                    ackPending = true;
+                }
+            }
+        }
+    }
+    return status;
+}
+
+std::size_t Connection::getMessageCount() const
+{
+    return received.size();
+}
+
+const char* Connection::getMessageData(std::size_t index) const
+{
+    return receiveBuffer.data() + received[index].offset;
+}
+
+std::size_t Connection::getMessageSize(std::size_t index) const
+{
+    return received[index].size;
+}
+
+std::uint64_t Connection::getRtt() const
+{
+    return static_cast<std::uint64_t>(smoothedRtt + 0.5);
+}
+
+std::uint64_t Connection::getRetransmitTimeout() const
+{
+    return rto;
+}
+
+bool Connection::isNewer(Sequence a, Sequence b)
+{
+    // Anything less than half way around ahead of b is newer
+    return (a != b && static_cast<Sequence>(a - b) < 0x8000);
+}
+
+void Connection::startDatagram()
+{
+    datagram.clear();
+    write(datagram, static_cast<std::uint32_t>(ChannelData), 4);
+    write(datagram, nextSequence, 2);
+    write(datagram, (receivedAny ? acksValid : 0), 1);
+    write(datagram, remoteSequence, 2);
+    write(datagram, remoteAckBits, 4);
+}
+
+void Connection::addMessage(std::uint8_t channel, const OutgoingMessage& message, UdpBatch& batch, const Address& address, std::uint64_t now)
+{
+    // Start another datagram if this one is full
+    if (datagram.size() + messageHeaderSize + message.data.size() > maxDatagramSize)
+    {
+        finishDatagram(batch, address, now);
+        startDatagram();
+    }
+    write(datagram, channel, 1);
+    write(datagram, message.id, 2);
+    write(datagram, static_cast<std::uint32_t>(message.data.size()), 2);
+    datagram.insert(datagram.end(), message.data.begin(), message.data.end());
+}
+
+void Connection::finishDatagram(UdpBatch& batch, const Address& address, std::uint64_t now)
+{
+    // Remember what was in it, so the messages can be marked as acked later
+    auto& sent = sentPackets[nextSequence % sentPacketCount];
+    sent.sequence = nextSequence;
+    sent.valid = true;
+    sent.sentTime = now;
+    sent.messages.assign(currentMessages.begin(), currentMessages.end());
+    currentMessages.clear();
+    ++nextSequence;
+    batch.queue(datagram.data(), datagram.size(), address);
+    ackPending = false;
+}
+
+void Connection::ackSequence(Sequence sequence, std::uint64_t now)
+{
+    auto& sent = sentPackets[sequence % sentPacketCount];
+    if (sent.valid && sent.sequence == sequence)
+    {
+        sent.valid = false;
+        for (auto& message: sent.messages)
+            ackMessage(message.channel, message.id);
+
+        // Every datagram has its own sequence number, so resends never make the sample ambiguous
+        double sample = static_cast<double>(now - sent.sentTime);
+        if (hasRtt)
+        {
+            rttVariance = 0.75 * rttVariance + 0.25 * std::fabs(smoothedRtt - sample);
+            smoothedRtt = 0.875 * smoothedRtt + 0.125 * sample;
+        }
+        else
+        {
+            smoothedRtt = sample;
+            rttVariance = sample / 2.0;
+            hasRtt = true;
+        }
+        auto timeout = static_cast<std::uint64_t>(smoothedRtt + std::max(1.0, 4.0 * rttVariance));
+        rto = std::min(std::max(timeout, minRto), maxRto);
+    }
+}
+
+void Connection::ackMessage(std::uint8_t channel, Sequence id)
+{
+    // The unacked messages have consecutive IDs, so the message is found by its distance from the first one
+    auto& messages = channels[channel].messages;
+    if (!messages.empty())
+    {
+        auto index = static_cast<Sequence>(id - messages.front().id);
+        if (index < messages.size())
+            messages[index].acked = true;
+    }
+}
+
+void Connection::receiveSequence(Sequence sequence)
+{
+    if (!receivedAny)
+    {
+        remoteSequence = sequence;
+        remoteAckBits = 0;
+        receivedAny = true;
+    }
+    else if (isNewer(sequence, remoteSequence))
+    {
+        // Shift the older ones over, and add the previous newest one
+        unsigned distance = static_cast<Sequence>(sequence - remoteSequence);
+        if (distance < 32)
+            remoteAckBits = (remoteAckBits << distance) | (std::uint32_t(1) << (distance - 1));
+        else if (distance == 32)
+            remoteAckBits = (std::uint32_t(1) << 31);
+        else
+            remoteAckBits = 0;
+        remoteSequence = sequence;
+    }
+    else
+    {
+        unsigned distance = static_cast<Sequence>(remoteSequence - sequence);
+        if (distance >= 1 && distance <= 32)
+            remoteAckBits |= (std::uint32_t(1) << (distance - 1));
+    }
+}
+
+void Connection::receiveMessage(std::uint8_t channel, Sequence id, const char* data, std::size_t size)
+{
+    if (channel == Unreliable)
+        deliver(data, size);
+    else if (channel == UnreliableSequenced)
+    {
+        if (!receivedSequenced || isNewer(id, lastSequencedId))
+        {
+            lastSequencedId = id;
+            receivedSequenced = true;
+            deliver(data, size);
+        }
+    }
+    else if (channel == ReliableUnordered)
+    {
+        // The message might be a resend of one that was already received
+        auto& slot = unorderedIds[id % receiveWindow];
+        if (slot != std::uint32_t(id) + 1)
+        {
+            slot = std::uint32_t(id) + 1;
+            deliver(data, size);
+        }
+    }
+    else if (id == nextOrderedId)
+    {
+        // Deliver this one, and any that were waiting on it
+        deliver(data, size);
+        ++nextOrderedId;
+        auto* next = &orderedMessages[nextOrderedId % receiveWindow];
+        while (next->present)
+        {
+            deliver(next->data.data(), next->data.size());
+            next->present = false;
+            ++nextOrderedId;
+            next = &orderedMessages[nextOrderedId % receiveWindow];
+        }
+    }
+    else if (isNewer(id, nextOrderedId) && static_cast<Sequence>(id - nextOrderedId) < receiveWindow)
+    {
+        // Hold on to it until the earlier ones arrive
+        auto& slot = orderedMessages[id % receiveWindow];
+        if (!slot.present)
+        {
+            slot.present = true;
+            slot.data.assign(data, data + size);
+        }
+    }
+}
+
+void Connection::deliver(const char* data, std::size_t size)
+{
+    ReceivedMessage message;
+    message.offset = receiveBuffer.size();
+    message.size = size;
+    receiveBuffer.insert(receiveBuffer.end(), data, data + size);
+    received.push_back(message);
+}
+
+}
@@ -0,0 +1,169 @@
+// See the file COPYRIGHT.txt for authors and copyright information.
+// See the file LICENSE.txt for copying conditions.
+
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <vector>
+#include <deque>
+#include <cstdint>
+#include <SFML/Network.hpp>
+#include "address.h"
+#include "udpbatch.h"
+
+namespace net
+{
+
+/*
+Channels on top of UDP, for one remote address.
+Every datagram has a sequence number, and carries acks for the last 33 datagrams received from
+    the other side (the latest sequence number, and a bitfield for the 32 before it). The acks
+    ride along with the messages, and an ack-only datagram is only sent if there is nothing else.
+Each datagram can hold many messages, from any of the channels:
+    Unreliable - Sent once, may be lost, duplicated or reordered
+    UnreliableSequenced - Sent once, older messages that arrive after newer ones are dropped
+    ReliableUnordered - Resent until acked, handled as soon as they arrive
+    ReliableOrdered - Resent until acked, held back until all of the earlier ones arrive
+Only the messages in lost datagrams are resent, and each channel has its own ordering, so a lost
+    unreliable message never holds up the reliable ones, and the two reliable channels don't hold
+    each other up either.
+The round trip time is estimated from the acks (like TCP, with a smoothed average and variance),
+    and reliable messages are resent after the retransmit timeout that comes from it.
+Messages have to fit into a single datagram, so they can be at most maxMessageSize bytes.
+All of the times are in milliseconds, from whatever clock the owner uses.
+*/
+class Connection
+{
+    public:
+        enum Channel
+        {
+            Unreliable = 0,
+            UnreliableSequenced,
+            ReliableUnordered,
+            ReliableOrdered,
+            ChannelCount
+        };
+
+        static const std::size_t maxDatagramSize = 1200; // Stays under the usual MTU
+        static const std::size_t datagramHeaderSize = 13; // Type, sequence, flags, ack, and ack bits
+        static const std::size_t messageHeaderSize = 5; // Channel, message ID, and size
+        static const std::size_t maxMessageSize = maxDatagramSize - datagramHeaderSize - messageHeaderSize;
+        static const std::size_t maxUnackedMessages = 512; // For each reliable channel
+
+        Connection();
+
+        // Sending
+        bool send(Channel channel, const void* data, std::size_t size); // Returns false if it's too big, or too much is unacked
+        bool send(Channel channel, sf::Packet& packet);
+        void update(std::uint64_t now, UdpBatch& batch, const Address& address); // Queues the messages, resends, and acks
+        bool isIdle() const; // True if nothing needs to be sent or acked
+
+        // Receiving
+        bool receive(std::uint64_t now, const void* data, std::size_t size); // Reads a datagram, returns false if it's invalid
+        std::size_t getMessageCount() const; // Messages that can be handled after the last receive()
+        const char* getMessageData(std::size_t index) const;
+        std::size_t getMessageSize(std::size_t index) const;
+
+        // Round trip time
+        std::uint64_t getRtt() const; // Smoothed round trip time
+        std::uint64_t getRetransmitTimeout() const;
+
+    private:
+        using Sequence = sf::Uint16;
+
+        static const std::size_t sentPacketCount = 1024; // Datagrams that can still be acked
+        static const std::size_t receiveWindow = 1024; // Reliable message IDs remembered by the receiver
+        static const std::uint64_t initialRto = 100;
+        static const std::uint64_t minRto = 20;
+        static const std::uint64_t maxRto = 1000;
+
+        struct OutgoingMessage
+        {
+            Sequence id;
+            std::vector<char> data;
+            std::uint64_t lastSent;
+            bool sent;
+            bool acked;
+        };
+
+        // Which message was in a datagram, so it can be marked as acked
+        struct SentMessage
+        {
+            std::uint8_t channel;
+            Sequence id;
+        };
+
+        struct SentPacket
+        {
+            SentPacket();
+
+            Sequence sequence;
+            bool valid; // False once the datagram is acked, or if nothing was sent in this slot yet
+            std::uint64_t sentTime;
+            std::vector<SentMessage> messages; // Only the reliable ones
+        };
+
+        struct OutgoingChannel
+        {
+            OutgoingChannel();
+
+            std::deque<OutgoingMessage> messages; // For the reliable channels, the first one is the oldest unacked
+            Sequence nextId;
+        };
+
+        struct OrderedMessage
+        {
+            OrderedMessage();
+
+            bool present;
+            std::vector<char> data;
+        };
+
+        struct ReceivedMessage
+        {
+            std::size_t offset; // In the receive buffer
+            std::size_t size;
+        };
+
+        static bool isNewer(Sequence a, Sequence b); // Handles wrapping around
+        void startDatagram();
+        void addMessage(std::uint8_t channel, const OutgoingMessage& message, UdpBatch& batch, const Address& address, std::uint64_t now);
+        void finishDatagram(UdpBatch& batch, const Address& address, std::uint64_t now);
+        void ackSequence(Sequence sequence, std::uint64_t now);
+        void ackMessage(std::uint8_t channel, Sequence id);
+        void receiveSequence(Sequence sequence);
+        void receiveMessage(std::uint8_t channel, Sequence id, const char* data, std::size_t size);
+        void deliver(const char* data, std::size_t size);
+
+        // Sending
+        OutgoingChannel channels[ChannelCount];
+        std::vector<SentPacket> sentPackets; // Indexed by sequence number
+        std::vector<SentMessage> currentMessages; // The reliable messages in the datagram being built
+        std::vector<char> datagram; // Reused for building datagrams
+        Sequence nextSequence;
+
+        // Acks for the other side
+        Sequence remoteSequence; // Newest sequence number received
+        sf::Uint32 remoteAckBits; // Bit i is set if remoteSequence - 1 - i was received
+        bool receivedAny;
+        bool ackPending;
+
+        // Receiving
+        Sequence lastSequencedId; // Newest message on the unreliable sequenced channel
+        bool receivedSequenced;
+        std::vector<std::uint32_t> unorderedIds; // Received reliable unordered IDs (+ 1), indexed by ID
+        std::vector<OrderedMessage> orderedMessages; // Reliable ordered messages waiting for the earlier ones
+        Sequence nextOrderedId;
+        std::vector<char> receiveBuffer; // The delivered messages, reused for every receive()
+        std::vector<ReceivedMessage> received;
+
+        // Round trip time, in milliseconds
+        double smoothedRtt;
+        double rttVariance;
+        bool hasRtt;
+        std::uint64_t rto;
+};
+
+}
+
+#endif
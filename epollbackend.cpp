@@ -0,0 +1,125 @@
+// See the file COPYRIGHT.txt for authors and copyright information.
+// See the file LICENSE.txt for copying conditions.
+
+#include "epollbackend.h"
+#include "nativesocket.h"
+#include <limits>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+namespace net
+{
+
+EpollBackend::EpollBackend():
+    epollFd(epoll_create1(EPOLL_CLOEXEC)),
+    wakeFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+    events(maxEventsPerWait)
+{
+    if (epollFd != -1 && wakeFd != -1)
+        addWakeEvent();
+}
+
+EpollBackend::~EpollBackend()
+{
+    if (epollFd != -1)
+        close(epollFd);
+    if (wakeFd != -1)
+        close(wakeFd);
+}
+
+bool EpollBackend::isValid() const
+{
+    return (epollFd != -1 && wakeFd != -1);
+}
+
+EventBackend::Type EpollBackend::getType() const
+{
+    return Epoll;
+}
+
+unsigned EpollBackend::getMaxSockets() const
+{
+    return std::numeric_limits<unsigned>::max();
+}
+
+bool EpollBackend::hasWriteEvents() const
+{
+    return true;
+}
+
+bool EpollBackend::add(sf::Socket& socket, int id)
+{
+    bool status = false;
+    int fd = getNativeHandle(socket);
+    if (fd >= 0)
+    {
+        // Edge-triggered, so the socket is only reported again after new data arrives,
+        // or after it can be written to again after being full
+        epoll_event event = {};
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.u64 = static_cast<uint32_t>(id);
+        status = (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) == 0);
+    }
+    return status;
+}
+
+void EpollBackend::remove(sf::Socket& socket)
+{
+    int fd = getNativeHandle(socket);
+    if (fd >= 0)
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+void EpollBackend::clear()
+{
+    // Starting over with a new epoll instance is cheaper than removing every socket
+    if (epollFd != -1)
+        close(epollFd);
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (isValid())
+        addWakeEvent();
+    ready.clear();
+}
+
+bool EpollBackend::wait(sf::Time timeout)
+{
+    ready.clear();
+    // A zero timeout means to wait forever, the same as sf::SocketSelector
+    int milliseconds = (timeout == sf::Time::Zero ? -1 : timeout.asMilliseconds());
+    int count = epoll_wait(epollFd, events.data(), events.size(), milliseconds);
+    // Interrupted waits (EINTR) are treated like a timeout
+    for (int i = 0; i < count; ++i)
+    {
+        if (events[i].data.u64 == wakeTag)
+        {
+            // Reset the counter so the eventfd isn't reported again
+            eventfd_t value;
+            eventfd_read(wakeFd, &value);
+        }
+        else
+        {
+            // Errors and hang ups are reported as readable, so the caller finds them when receiving
+            auto flags = events[i].events;
+            int id = static_cast<int>(static_cast<uint32_t>(events[i].data.u64));
+            bool readable = (flags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) != 0;
+            ready.push_back({id, readable, (flags & EPOLLOUT) != 0});
+        }
+    }
+    return !ready.empty();
+}
+
+void EpollBackend::wake()
+{
+    eventfd_write(wakeFd, 1);
+}
+
+bool EpollBackend::addWakeEvent()
+{
+    // This one is level-triggered, since it is always read after being reported
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.u64 = wakeTag;
+    return (epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event) == 0);
+}
+
+}
@@ -0,0 +1,53 @@
+// See the file COPYRIGHT.txt for authors and copyright information.
+// See the file LICENSE.txt for copying conditions.
+
+#ifndef EPOLLBACKEND_H
+#define EPOLLBACKEND_H
+
+#include <vector>
+#include <cstdint>
+#include <sys/epoll.h>
+#include "eventbackend.h"
+
+namespace net
+{
+
+/*
+Event backend that uses edge-triggered epoll (Linux only).
+The only limit on the number of sockets is the process's file descriptor limit (RLIMIT_NOFILE).
+The IDs are stored in the epoll events, so the ready list comes straight from the kernel.
+Waking is done with an eventfd, which is registered with a tag that no socket ID can have.
+*/
+class EpollBackend: public EventBackend
+{
+    public:
+        static const unsigned maxEventsPerWait = 1024; // Anything past this is returned on the next wait
+
+        EpollBackend();
+        ~EpollBackend();
+        bool isValid() const;
+
+        Type getType() const;
+        unsigned getMaxSockets() const;
+        bool hasWriteEvents() const;
+
+        bool add(sf::Socket& socket, int id);
+        void remove(sf::Socket& socket);
+        void clear();
+
+        bool wait(sf::Time timeout);
+        void wake();
+
+    private:
+        static const uint64_t wakeTag = (1ull << 32); // Socket IDs only use the lower 32 bits
+
+        bool addWakeEvent();
+
+        int epollFd;
+        int wakeFd;
+        std::vector<epoll_event> events; // Filled in by epoll_wait
+};
+
+}
+
+#endif
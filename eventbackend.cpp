@@ -0,0 +1,35 @@
+// See the file COPYRIGHT.txt for authors and copyright information.
+// See the file LICENSE.txt for copying conditions.
+
+#include "eventbackend.h"
+#include "selectorbackend.h"
+#ifdef __linux__
+    #include "epollbackend.h"
+#endif
+
+namespace net
+{
+
+std::unique_ptr<EventBackend> EventBackend::create(Type type)
+{
+    std::unique_ptr<EventBackend> backend;
+    #ifdef __linux__
+        if (type == Default || type == Epoll)
+        {
+            std::unique_ptr<EpollBackend> epoll(new EpollBackend());
+            if (epoll->isValid())
+                backend = std::move(epoll);
+        }
+    #endif
+    // Everything else uses the selector
+    if (!backend)
+        backend.reset(new SelectorBackend());
+    return backend;
+}
+
+const EventBackend::ReadyList& EventBackend::getReady() const
+{
+    return ready;
+}
+
+}
@@ -0,0 +1,72 @@
+// See the file COPYRIGHT.txt for authors and copyright information.
+// See the file LICENSE.txt for copying conditions.
+
+#ifndef EVENTBACKEND_H
+#define EVENTBACKEND_H
+
+#include <vector>
+#include <memory>
+#include <SFML/Network.hpp>
+
+namespace net
+{
+
+/*
+This is the interface used by the server to wait on many sockets at once.
+Sockets are registered along with an ID, and wait() blocks until at least one of them is ready.
+After waiting, getReady() returns the IDs of only the sockets that are ready, so the caller never
+    needs to look at the sockets that are idle.
+Sockets are reported as writable only if hasWriteEvents() is true. Otherwise, the caller needs to
+    retry any sends that couldn't finish on its own.
+Another thread can call wake() to make the current (or next) wait() return early.
+There are two implementations:
+    Selector - Uses sf::SocketSelector, which is select() underneath. Works everywhere,
+        but is limited to FD_SETSIZE sockets, and every wait costs O(N).
+    Epoll - Uses edge-triggered epoll, only available on Linux. Scales to a very large
+        number of sockets, and every wait only costs O(ready sockets).
+Because the epoll backend is edge-triggered, all registered sockets must be non-blocking,
+    and a socket that was reported as ready must be read until it returns sf::Socket::NotReady.
+*/
+class EventBackend
+{
+    public:
+        enum Type
+        {
+            Default = 0, // The best backend available on the current platform
+            Selector,
+            Epoll
+        };
+
+        struct Ready
+        {
+            int id;
+            bool readable;
+            bool writable; // Only set when the socket can be written to again after being full
+        };
+
+        using ReadyList = std::vector<Ready>;
+
+        // Creates a backend of the specified type, falls back to a selector if it isn't supported
+        static std::unique_ptr<EventBackend> create(Type type = Default);
+
+        virtual ~EventBackend() {}
+
+        virtual Type getType() const = 0;
+        virtual unsigned getMaxSockets() const = 0; // Maximum number of sockets that can be registered
+        virtual bool hasWriteEvents() const = 0;
+
+        virtual bool add(sf::Socket& socket, int id) = 0;
+        virtual void remove(sf::Socket& socket) = 0;
+        virtual void clear() = 0;
+
+        virtual bool wait(sf::Time timeout) = 0; // Returns true if any sockets are ready
+        virtual void wake() = 0; // Interrupts wait(), this is safe to call from any thread
+        const ReadyList& getReady() const; // The sockets that were ready after the last wait
+
+    protected:
+        ReadyList ready;
+};
+
+}
+
+#endif
@@ -0,0 +1,67 @@
+// See the file COPYRIGHT.txt for authors and copyright information.
+// See the file LICENSE.txt for copying conditions.
+
+#include "frame.h"
+#include <cstring>
+
+namespace net
+{
+
+namespace
+{
+
+// Only used to name the protected sf::Packet::onSend() from inside a derived class
+struct PacketAccess: public sf::Packet
+{
+    static const void* getSendData(sf::Packet& packet, std::size_t& size)
+    {
+        // This is still a virtual call, so derived packet types are handled
+        return (packet.*(&PacketAccess::onSend))(size);
+    }
+};
+
+}
+
+const void* getPacketData(sf::Packet& packet, std::size_t& size)
+{
+    return PacketAccess::getSendData(packet, size);
+}
+
+void appendFrame(sf::Packet& packet, std::vector<char>& buffer)
+{
+    std::size_t size = 0;
+    const void* data = getPacketData(packet, size);
+
+    // Write the size header, followed by the data
+    auto start = buffer.size();
+    buffer.resize(start + frameHeaderSize + size);
+    auto header = static_cast<sf::Uint32>(size);
+    for (std::size_t i = 0; i < frameHeaderSize; ++i)
+        buffer[start + i] = static_cast<char>((header >> (8 * (frameHeaderSize - 1 - i))) & 0xFF);
+    if (size > 0)
+        std::memcpy(&buffer[start + frameHeaderSize], data, size);
+}
+
+SharedFrame makeFrame(sf::Packet& packet)
+{
+    auto frame = std::make_shared<std::vector<char> >();
+    appendFrame(packet, *frame);
+    return frame;
+}
+
+bool findFrame(const char* data, std::size_t size, std::size_t& packetSize)
+{
+    bool status = false;
+    if (size >= frameHeaderSize)
+    {
+        // Read the big-endian size header
+        sf::Uint32 header = 0;
+        for (std::size_t i = 0; i < frameHeaderSize; ++i)
+            header = (header << 8) | static_cast<unsigned char>(data[i]);
+        packetSize = header;
+        status = (size - frameHeaderSize >= packetSize);
+    }
+    return status;
+}
+
+}
@@ -0,0 +1,37 @@
+// See the file COPYRIGHT.txt for authors and copyright information.
+// See the file LICENSE.txt for copying conditions.
+
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <vector>
+#include <memory>
+#include <SFML/Network.hpp>
+
+namespace net
+{
+
+// Size of the header in front of every packet sent through TCP (a big-endian sf::Uint32)
+const std::size_t frameHeaderSize = 4;
+
+// A framed packet that can't be modified, so it can be shared between any number of sends
+using SharedFrame = std::shared_ptr<const std::vector<char> >;
+
+// Gets the data that would be sent for a packet
+// The packet's onSend() is used, so packets with custom encoding still work
+const void* getPacketData(sf::Packet& packet, std::size_t& size);
+
+// Appends a packet to a buffer, in the same format as sf::TcpSocket::send(sf::Packet&)
+// The packet's onSend() is used, so packets with custom encoding still work
+void appendFrame(sf::Packet& packet, std::vector<char>& buffer);
+
+// Frames a packet into a new shared frame
+SharedFrame makeFrame(sf::Packet& packet);
+
+// Checks if a buffer starts with a complete frame, and gets the size of the packet data inside of it
+// The packet data starts right after the header, at data + frameHeaderSize
+bool findFrame(const char* data, std::size_t size, std::size_t& packetSize);
+
+}
+
+#endif
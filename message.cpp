@@ -0,0 +1,276 @@
+// See the file COPYRIGHT.txt for authors and copyright information.
+// See the file LICENSE.txt for copying conditions.
+
+#include "message.h"
+
+namespace net
+{
+
+BytesView::BytesView():
+    data(nullptr),
+    size(0)
+{
+}
+
+BytesView::BytesView(const char* data, std::size_t size):
+    data(data),
+    size(size)
+{
+}
+
+BytesView::BytesView(const std::string& str):
+    data(str.data()),
+    size(str.size())
+{
+}
+
+std::string BytesView::toString() const
+{
+    return (size > 0 ? std::string(data, size) : std::string());
+}
+
+MessageWriter::MessageWriter(std::vector<char>& buffer, sf::Uint8 version):
+    buffer(&buffer),
+    packet(nullptr),
+    version(version)
+{
+}
+
+MessageWriter::MessageWriter(sf::Packet& packet, sf::Uint8 version):
+    buffer(nullptr),
+    packet(&packet),
+    version(version)
+{
+}
+
+sf::Uint8 MessageWriter::getVersion() const
+{
+    return version;
+}
+
+void MessageWriter::writeVarint(std::uint64_t value)
+{
+    // 7 bits at a time, with the high bit set on every byte except the last
+    unsigned char bytes[10];
+    std::size_t size = 0;
+    while (value >= 0x80)
+    {
+        bytes[size++] = static_cast<unsigned char>(value | 0x80);
+        value >>= 7;
+    }
+    bytes[size++] = static_cast<unsigned char>(value);
+    writeRaw(bytes, size);
+}
+
+void MessageWriter::writeSignedVarint(std::int64_t value)
+{
+    // Zigzag encoding, so small negative numbers are small too
+    auto bits = static_cast<std::uint64_t>(value);
+    writeVarint((bits << 1) ^ (value < 0 ? ~std::uint64_t(0) : 0));
+}
+
+void MessageWriter::writeBytes(const void* data, std::size_t size)
+{
+    writeVarint(size);
+    writeRaw(data, size);
+}
+
+void MessageWriter::writeRaw(const void* data, std::size_t size)
+{
+    if (size > 0)
+    {
+        if (buffer)
+        {
+            auto bytes = static_cast<const char*>(data);
+            buffer->insert(buffer->end(), bytes, bytes + size);
+        }
+        else
+            packet->append(data, size);
+    }
+}
+
+void MessageWriter::writeValue(bool value)
+{
+    char byte = (value ? 1 : 0);
+    writeRaw(&byte, 1);
+}
+
+void MessageWriter::writeValue(float value)
+{
+    unsigned char bytes[sizeof(float)];
+    detail::storeLittleEndian(value, bytes);
+    writeRaw(bytes, sizeof(bytes));
+}
+
+void MessageWriter::writeValue(double value)
+{
+    unsigned char bytes[sizeof(double)];
+    detail::storeLittleEndian(value, bytes);
+    writeRaw(bytes, sizeof(bytes));
+}
+
+void MessageWriter::writeValue(const std::string& value)
+{
+    writeBytes(value.data(), value.size());
+}
+
+void MessageWriter::writeValue(const BytesView& value)
+{
+    writeBytes(value.data, value.size);
+}
+
+MessageReader::MessageReader(const void* data, std::size_t size, sf::Uint8 version):
+    data(static_cast<const char*>(data)),
+    size(size),
+    position(0),
+    version(version),
+    valid(true)
+{
+}
+
+sf::Uint8 MessageReader::getVersion() const
+{
+    return version;
+}
+
+bool MessageReader::isValid() const
+{
+    return valid;
+}
+
+bool MessageReader::readVarint(std::uint64_t& value)
+{
+    // Varints longer than 10 bytes can't fit into 64 bits
+    std::uint64_t result = 0;
+    bool done = false;
+    for (unsigned shift = 0; valid && !done && shift < 64; shift += 7)
+    {
+        auto byte = readRaw(1);
+        if (byte)
+        {
+            auto bits = static_cast<unsigned char>(*byte);
+            result |= static_cast<std::uint64_t>(bits & 0x7F) << shift;
+            done = ((bits & 0x80) == 0);
+        }
+    }
+    valid = (valid && done);
+    if (valid)
+        value = result;
+    return valid;
+}
+
+bool MessageReader::readSignedVarint(std::int64_t& value)
+{
+    std::uint64_t bits = 0;
+    if (readVarint(bits))
+        value = static_cast<std::int64_t>((bits >> 1) ^ (~(bits & 1) + 1));
+    return valid;
+}
+
+bool MessageReader::readBytes(BytesView& value)
+{
+    std::uint64_t length = 0;
+    valid = (readVarint(length) && length <= size - position);
+    auto bytes = (valid ? readRaw(static_cast<std::size_t>(length)) : nullptr);
+    if (valid)
+        value = BytesView(bytes, static_cast<std::size_t>(length));
+    return valid;
+}
+
+const char* MessageReader::readRaw(std::size_t count)
+{
+    const char* bytes = nullptr;
+    valid = (valid && count <= size - position);
+    if (valid)
+    {
+        bytes = data + position;
+        position += count;
+    }
+    return bytes;
+}
+
+void MessageReader::readValue(bool& value)
+{
+    auto byte = readRaw(1);
+    if (byte)
+        value = (*byte != 0);
+}
+
+void MessageReader::readValue(float& value)
+{
+    auto bytes = readRaw(sizeof(float));
+    if (bytes)
+        value = detail::loadLittleEndian<float>(reinterpret_cast<const unsigned char*>(bytes));
+}
+
+void MessageReader::readValue(double& value)
+{
+    auto bytes = readRaw(sizeof(double));
+    if (bytes)
+        value = detail::loadLittleEndian<double>(reinterpret_cast<const unsigned char*>(bytes));
+}
+
+void MessageReader::readValue(std::string& value)
+{
+    BytesView view;
+    if (readBytes(view))
+        value.assign(view.data, view.size);
+}
+
+void MessageReader::readValue(BytesView& value)
+{
+    readBytes(value);
+}
+
+void MessageDispatcher::remove(sf::Int32 type)
+{
+    setHandler(type, nullptr);
+}
+
+bool MessageDispatcher::dispatch(const PacketView& view, int id) const
+{
+    // The type header picks the handler, which decodes the rest of the message in place
+    bool status = false;
+    sf::Int32 type = 0;
+    auto data = static_cast<const char*>(view.getData());
+    if (readPacketType(data, view.getDataSize(), type))
+    {
+        const HandlerType* handler = nullptr;
+        if (type >= 0 && type < denseTypeCount)
+            handler = &denseHandlers[type];
+        else
+        {
+            auto found = handlers.find(type);
+            if (found != handlers.end())
+                handler = &found->second;
+        }
+        if (handler && *handler)
+            status = (*handler)(data + sizeof(sf::Int32), view.getDataSize() - sizeof(sf::Int32), id);
+    }
+    return status;
+}
+
+void MessageDispatcher::setHandler(sf::Int32 type, HandlerType handler)
+{
+    if (type >= 0 && type < denseTypeCount)
+        denseHandlers[type] = handler;
+    else if (handler)
+        handlers[type] = handler;
+    else
+        handlers.erase(type);
+}
+
+namespace detail
+{
+
+void appendTypeHeader(sf::Int32 type, sf::Uint8 version, std::vector<char>& buffer)
+{
+    auto bits = static_cast<sf::Uint32>(type);
+    for (std::size_t i = 0; i < sizeof(sf::Int32); ++i)
+        buffer.push_back(static_cast<char>((bits >> (8 * (sizeof(sf::Int32) - 1 - i))) & 0xFF));
+    buffer.push_back(static_cast<char>(version));
+}
+
+}
+
+}
@@ -0,0 +1,480 @@
+// See the file COPYRIGHT.txt for authors and copyright information.
+// See the file LICENSE.txt for copying conditions.
+
+#ifndef MESSAGE_H
+#define MESSAGE_H
+
+#include <array>
+#include <map>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <limits>
+#include <functional>
+#include <type_traits>
+#include <SFML/Network.hpp>
+#include "frame.h"
+#include "packetview.h"
+#include "protocol.h"
+
+namespace net
+{
+
+/*
+A compact message format, with the codec of each message put together from a template.
+A message starts with the same sf::Int32 type header as a normal sf::Packet, so it can be sent and
+    dispatched like any other packet, and old sf::Packet senders and receivers can be mixed with it.
+    The header is followed by the message's version (an sf::Uint8), and then the fields:
+        Integers and enums are varints (signed ones are zigzag encoded), so small values take 1 byte
+        Floats and doubles take 4 and 8 bytes, and bools take 1 byte
+        Strings and byte views are a varint length followed by the bytes
+        Vectors are a varint count followed by the elements
+        Fixed layouts (structs made of FixedFields) are copied as they are
+Fixed layouts and byte views are read in place, as pointers into the received data, so they aren't
+    copied at all. They are only valid for as long as the data is, which is usually until the
+    callback returns.
+A message type has a type and a version, and a fields() function that is used both for encoding and
+    decoding. Fields can be added at the end in newer versions, by checking the version first. Older
+    receivers ignore the extra fields, and newer receivers leave the missing ones as they are:
+        struct Chat
+        {
+            static const sf::Int32 type = 5;
+            static const sf::Uint8 version = 2;
+
+            std::uint32_t from;
+            net::BytesView text; // Points into the packet, std::string would copy it instead
+            const Position* position; // A fixed layout, also read in place
+            std::uint16_t channel; // Added in version 2
+
+            template <typename Codec>
+            void fields(Codec& codec)
+            {
+                codec(from)(text)(position);
+                if (codec.getVersion() >= 2)
+                    codec(channel);
+            }
+        };
+*/
+
+// An arithmetic value stored as little-endian bytes, so structs of these have no padding or alignment
+// Structs made only of these (and arrays of them) can be read right where they are in a buffer
+template <typename T>
+struct FixedField
+{
+    static_assert(std::is_arithmetic<T>::value, "FixedField only holds arithmetic types");
+
+    T get() const;
+    void set(T value);
+    operator T() const;
+    FixedField& operator=(T value);
+
+    unsigned char bytes[sizeof(T)];
+};
+
+// Bytes that are somewhere else, like in a received packet
+struct BytesView
+{
+    BytesView();
+    BytesView(const char* data, std::size_t size);
+    BytesView(const std::string& str); // The string has to outlive the view
+    std::string toString() const;
+
+    const char* data;
+    std::size_t size;
+};
+
+// Writes the fields of a message, into a buffer or an sf::Packet
+class MessageWriter
+{
+    public:
+        MessageWriter(std::vector<char>& buffer, sf::Uint8 version);
+        MessageWriter(sf::Packet& packet, sf::Uint8 version);
+        sf::Uint8 getVersion() const;
+
+        void writeVarint(std::uint64_t value);
+        void writeSignedVarint(std::int64_t value);
+        void writeBytes(const void* data, std::size_t size); // Writes the length first
+        void writeRaw(const void* data, std::size_t size);
+
+        // Any supported field type, returns itself so the fields can be chained
+        template <typename T>
+        MessageWriter& operator()(const T& value);
+
+    private:
+        template <typename T>
+        void write(const T& value, std::true_type); // Integers and enums
+        template <typename T>
+        void write(const T& value, std::false_type); // Everything else
+        void writeValue(bool value);
+        void writeValue(float value);
+        void writeValue(double value);
+        void writeValue(const std::string& value);
+        void writeValue(const BytesView& value);
+        template <typename T>
+        void writeValue(const FixedField<T>& value);
+        template <typename T>
+        void writeValue(const T* const& value); // Fixed layouts
+        template <typename T>
+        void writeValue(const std::vector<T>& values);
+
+        std::vector<char>* buffer;
+        sf::Packet* packet;
+        sf::Uint8 version;
+};
+
+// Reads the fields of a message from a buffer, without copying anything that can be read in place
+// After a read fails, every other read fails too, so the fields only need to be checked at the end
+class MessageReader
+{
+    public:
+        MessageReader(const void* data, std::size_t size, sf::Uint8 version);
+        sf::Uint8 getVersion() const;
+        bool isValid() const;
+
+        bool readVarint(std::uint64_t& value);
+        bool readSignedVarint(std::int64_t& value);
+        bool readBytes(BytesView& value);
+        const char* readRaw(std::size_t size); // Returns null if there isn't enough data
+
+        // Any supported field type, returns itself so the fields can be chained
+        template <typename T>
+        MessageReader& operator()(T& value);
+
+    private:
+        template <typename T>
+        void read(T& value, std::true_type); // Integers and enums
+        template <typename T>
+        void read(T& value, std::false_type); // Everything else
+        void readValue(bool& value);
+        void readValue(float& value);
+        void readValue(double& value);
+        void readValue(std::string& value);
+        void readValue(BytesView& value);
+        template <typename T>
+        void readValue(FixedField<T>& value);
+        template <typename T>
+        void readValue(const T*& value); // Fixed layouts
+        template <typename T>
+        void readValue(std::vector<T>& values);
+
+        const char* data;
+        std::size_t size;
+        std::size_t position;
+        sf::Uint8 version;
+        bool valid;
+};
+
+// The whole message, including the type header and version
+template <typename Message>
+void encodeMessage(const Message& message, std::vector<char>& buffer); // Appends to the buffer
+template <typename Message>
+void encodeMessage(const Message& message, sf::Packet& packet); // Appends to the packet, so it can be sent as usual
+template <typename Message>
+SharedFrame makeMessageFrame(const Message& message); // Can be sent by TcpServer to any number of clients
+template <typename Message>
+bool decodeMessage(const void* data, std::size_t size, Message& message); // Fails if it's another type
+
+// Only the version and the fields, for when the type was already read
+template <typename Message>
+bool decodeMessageBody(const void* data, std::size_t size, Message& message);
+
+// Calls a callback for each message type, which works as a packet view callback of TcpServer:
+//     server.setPacketViewCallback([&](const net::PacketView& view, int id){ dispatcher.dispatch(view, id); });
+// Types 0 to 255 are looked up in a flat array, like in Client
+class MessageDispatcher
+{
+    public:
+        static const sf::Int32 denseTypeCount = 256;
+
+        template <typename Message>
+        void add(std::function<void(const Message&, int)> callback);
+        void remove(sf::Int32 type);
+        bool dispatch(const PacketView& view, int id) const; // Returns false if it wasn't handled, or couldn't be decoded
+
+    private:
+        // Decodes the body and calls the callback
+        using HandlerType = std::function<bool(const char*, std::size_t, int)>;
+
+        void setHandler(sf::Int32 type, HandlerType handler);
+
+        std::array<HandlerType, denseTypeCount> denseHandlers;
+        std::map<sf::Int32, HandlerType> handlers;
+};
+
+namespace detail
+{
+
+// The unsigned integer with the same size as T, for converting to and from bytes
+template <std::size_t Size>
+struct UnsignedOfSize;
+
+template <>
+struct UnsignedOfSize<1> { using Type = std::uint8_t; };
+
+template <>
+struct UnsignedOfSize<2> { using Type = std::uint16_t; };
+
+template <>
+struct UnsignedOfSize<4> { using Type = std::uint32_t; };
+
+template <>
+struct UnsignedOfSize<8> { using Type = std::uint64_t; };
+
+template <typename T>
+void storeLittleEndian(T value, unsigned char* bytes)
+{
+    typename UnsignedOfSize<sizeof(T)>::Type bits;
+    std::memcpy(&bits, &value, sizeof(T));
+    for (std::size_t i = 0; i < sizeof(T); ++i)
+        bytes[i] = static_cast<unsigned char>((bits >> (8 * i)) & 0xFF);
+}
+
+template <typename T>
+T loadLittleEndian(const unsigned char* bytes)
+{
+    typename UnsignedOfSize<sizeof(T)>::Type bits = 0;
+    for (std::size_t i = 0; i < sizeof(T); ++i)
+        bits |= static_cast<typename UnsignedOfSize<sizeof(T)>::Type>(bytes[i]) << (8 * i);
+    T value;
+    std::memcpy(&value, &bits, sizeof(T));
+    return value;
+}
+
+// Integers and enums are varints, but bools aren't
+template <typename T>
+struct IsVarint: std::integral_constant<bool, (std::is_integral<T>::value || std::is_enum<T>::value) &&
+    !std::is_same<T, bool>::value> {};
+
+template <typename T, bool IsEnum = std::is_enum<T>::value>
+struct IntegerOf
+{
+    using Type = T;
+};
+
+template <typename T>
+struct IntegerOf<T, true>
+{
+    using Type = typename std::underlying_type<T>::type;
+};
+
+// Fixed layouts have to be readable from any address
+template <typename T>
+struct IsFixedLayout: std::integral_constant<bool, std::is_trivially_copyable<T>::value && alignof(T) == 1> {};
+
+// Writes the type header the same way sf::Packet does (big-endian)
+void appendTypeHeader(sf::Int32 type, sf::Uint8 version, std::vector<char>& buffer);
+
+}
+
+template <typename T>
+T FixedField<T>::get() const
+{
+    return detail::loadLittleEndian<T>(bytes);
+}
+
+template <typename T>
+void FixedField<T>::set(T value)
+{
+    detail::storeLittleEndian(value, bytes);
+}
+
+template <typename T>
+FixedField<T>::operator T() const
+{
+    return get();
+}
+
+template <typename T>
+FixedField<T>& FixedField<T>::operator=(T value)
+{
+    set(value);
+    return *this;
+}
+
+template <typename T>
+MessageWriter& MessageWriter::operator()(const T& value)
+{
+    write(value, detail::IsVarint<T>());
+    return *this;
+}
+
+template <typename T>
+void MessageWriter::write(const T& value, std::true_type)
+{
+    using Integer = typename detail::IntegerOf<T>::Type;
+    auto integer = static_cast<Integer>(value);
+    if (std::is_signed<Integer>::value)
+        writeSignedVarint(static_cast<std::int64_t>(integer));
+    else
+        writeVarint(static_cast<std::uint64_t>(integer));
+}
+
+template <typename T>
+void MessageWriter::write(const T& value, std::false_type)
+{
+    writeValue(value);
+}
+
+template <typename T>
+void MessageWriter::writeValue(const FixedField<T>& value)
+{
+    writeRaw(value.bytes, sizeof(value.bytes));
+}
+
+template <typename T>
+void MessageWriter::writeValue(const T* const& value)
+{
+    // A missing layout is written as zeros, so the message keeps its size
+    static_assert(detail::IsFixedLayout<T>::value, "Pointers in messages must be to fixed layouts (structs of FixedFields)");
+    if (value)
+        writeRaw(value, sizeof(T));
+    else
+    {
+        char zeros[sizeof(T)] = {};
+        writeRaw(zeros, sizeof(T));
+    }
+}
+
+template <typename T>
+void MessageWriter::writeValue(const std::vector<T>& values)
+{
+    writeVarint(values.size());
+    for (auto& value: values)
+        (*this)(value);
+}
+
+template <typename T>
+MessageReader& MessageReader::operator()(T& value)
+{
+    if (valid)
+        read(value, detail::IsVarint<T>());
+    return *this;
+}
+
+template <typename T>
+void MessageReader::read(T& value, std::true_type)
+{
+    // Values that don't fit into the field are invalid, instead of being cut off
+    using Integer = typename detail::IntegerOf<T>::Type;
+    if (std::is_signed<Integer>::value)
+    {
+        std::int64_t integer = 0;
+        valid = (readSignedVarint(integer) && integer >= static_cast<std::int64_t>(std::numeric_limits<Integer>::min()) &&
+            integer <= static_cast<std::int64_t>(std::numeric_limits<Integer>::max()));
+        if (valid)
+            value = static_cast<T>(integer);
+    }
+    else
+    {
+        std::uint64_t integer = 0;
+        valid = (readVarint(integer) && integer <= static_cast<std::uint64_t>(std::numeric_limits<Integer>::max()));
+        if (valid)
+            value = static_cast<T>(integer);
+    }
+}
+
+template <typename T>
+void MessageReader::read(T& value, std::false_type)
+{
+    readValue(value);
+}
+
+template <typename T>
+void MessageReader::readValue(FixedField<T>& value)
+{
+    auto bytes = readRaw(sizeof(value.bytes));
+    if (bytes)
+        std::memcpy(value.bytes, bytes, sizeof(value.bytes));
+}
+
+template <typename T>
+void MessageReader::readValue(const T*& value)
+{
+    static_assert(detail::IsFixedLayout<T>::value, "Pointers in messages must be to fixed layouts (structs of FixedFields)");
+    auto bytes = readRaw(sizeof(T));
+    if (bytes)
+        value = reinterpret_cast<const T*>(bytes);
+}
+
+template <typename T>
+void MessageReader::readValue(std::vector<T>& values)
+{
+    // Every element takes at least a byte, so a bad count can't make this allocate too much
+    std::uint64_t count = 0;
+    valid = (readVarint(count) && count <= size - position);
+    values.clear();
+    if (valid)
+        values.resize(static_cast<std::size_t>(count));
+    for (auto& value: values)
+        (*this)(value);
+}
+
+template <typename Message>
+void encodeMessage(const Message& message, std::vector<char>& buffer)
+{
+    // fields() is shared with decoding, so it can't be const, but the writer only reads the fields
+    detail::appendTypeHeader(Message::type, Message::version, buffer);
+    MessageWriter writer(buffer, Message::version);
+    const_cast<Message&>(message).fields(writer);
+}
+
+template <typename Message>
+void encodeMessage(const Message& message, sf::Packet& packet)
+{
+    packet << static_cast<sf::Int32>(Message::type) << static_cast<sf::Uint8>(Message::version);
+    MessageWriter writer(packet, Message::version);
+    const_cast<Message&>(message).fields(writer);
+}
+
+template <typename Message>
+SharedFrame makeMessageFrame(const Message& message)
+{
+    // The message is written right after the frame header, which is filled in once the size is known
+    auto frame = std::make_shared<std::vector<char> >(frameHeaderSize);
+    encodeMessage(message, *frame);
+    auto size = static_cast<sf::Uint32>(frame->size() - frameHeaderSize);
+    for (std::size_t i = 0; i < frameHeaderSize; ++i)
+        (*frame)[i] = static_cast<char>((size >> (8 * (frameHeaderSize - 1 - i))) & 0xFF);
+    return frame;
+}
+
+template <typename Message>
+bool decodeMessage(const void* data, std::size_t size, Message& message)
+{
+    sf::Int32 type = 0;
+    return (readPacketType(data, size, type) && type == Message::type &&
+        decodeMessageBody(static_cast<const char*>(data) + sizeof(sf::Int32), size - sizeof(sf::Int32), message));
+}
+
+template <typename Message>
+bool decodeMessageBody(const void* data, std::size_t size, Message& message)
+{
+    bool status = (size >= 1);
+    if (status)
+    {
+        auto bytes = static_cast<const char*>(data);
+        MessageReader reader(bytes + 1, size - 1, static_cast<sf::Uint8>(bytes[0]));
+        message.fields(reader);
+        status = reader.isValid();
+    }
+    return status;
+}
+
+template <typename Message>
+void MessageDispatcher::add(std::function<void(const Message&, int)> callback)
+{
+    // The message is decoded on the stack, so dispatching doesn't allocate unless its fields do
+    setHandler(Message::type, [callback](const char* data, std::size_t size, int id)
+    {
+        Message message = Message();
+        bool status = decodeMessageBody(data, size, message);
+        if (status)
+            callback(message, id);
+        return status;
+    });
+}
+
+}
+
+#endif
@@ -0,0 +1,103 @@
+// See the file COPYRIGHT.txt for authors and copyright information.
+// See the file LICENSE.txt for copying conditions.
+
+#include "metrics.h"
+#include <algorithm>
+
+namespace net
+{
+
+HistogramSnapshot::HistogramSnapshot():
+    count(0),
+    sum(0)
+{
+    std::fill(buckets, buckets + bucketCount, 0);
+}
+
+void HistogramSnapshot::merge(const HistogramSnapshot& other)
+{
+    for (unsigned i = 0; i < bucketCount; ++i)
+        buckets[i] += other.buckets[i];
+    count += other.count;
+    sum += other.sum;
+}
+
+std::uint64_t HistogramSnapshot::getPercentile(double percentile) const
+{
+    // Find the bucket that the value at this percentile falls into
+    std::uint64_t limit = 0;
+    if (count > 0)
+    {
+        auto target = static_cast<std::uint64_t>(percentile / 100.0 * count);
+        std::uint64_t total = 0;
+        unsigned bucket = 0;
+        while (bucket + 1 < bucketCount && total + buckets[bucket] <= target)
+            total += buckets[bucket++];
+        limit = getBucketLimit(bucket);
+    }
+    return limit;
+}
+
+std::uint64_t HistogramSnapshot::getBucketLimit(unsigned bucket)
+{
+    return (std::uint64_t(1) << bucket);
+}
+
+ClientMetrics::ClientMetrics():
+    packetsReceived(0),
+    bytesReceived(0),
+    packetsSent(0),
+    bytesSent(0),
+    sendFailures(0)
+{
+}
+
+ServerMetrics::ServerMetrics():
+    packetsReceived(0),
+    bytesReceived(0),
+    packetsSent(0),
+    bytesSent(0),
+    sendFailures(0),
+    clientsAccepted(0),
+    clientsRejected(0),
+    clientsDisconnected(0),
+    packetsLimited(0),
+    lockWaits(0),
+    lockWaitTime(0)
+{
+}
+
+#ifndef NETLIB_NO_METRICS
+
+Counter::Counter():
+    value(0)
+{
+}
+
+std::uint64_t Counter::get() const
+{
+    return value.load(std::memory_order_relaxed);
+}
+
+void Histogram::add(std::uint64_t value)
+{
+    // The bucket is the number of bits needed for the value
+    unsigned bucket = 0;
+    while (value >> bucket && bucket + 1 < HistogramSnapshot::bucketCount)
+        ++bucket;
+    buckets[bucket].add();
+    count.add();
+    sum.add(value);
+}
+
+void Histogram::addTo(HistogramSnapshot& snapshot) const
+{
+    for (unsigned i = 0; i < HistogramSnapshot::bucketCount; ++i)
+        snapshot.buckets[i] += buckets[i].get();
+    snapshot.count += count.get();
+    snapshot.sum += sum.get();
+}
+
+#endif
+
+}
@@ -0,0 +1,145 @@
+// See the file COPYRIGHT.txt for authors and copyright information.
+// See the file LICENSE.txt for copying conditions.
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace net
+{
+
+/*
+Simple metrics, which are cheap enough to be updated on every packet.
+Every counter only has one writer at a time (a server thread, or whoever holds its shard's lock),
+    so updating one is just a relaxed load and store, without any atomic read-modify-write.
+    Other threads can read them at any time, and add them up when a snapshot is taken.
+Define NETLIB_NO_METRICS to compile all of this out. The classes are still there, but they are empty,
+    and everything that updates them gets optimized away.
+*/
+
+#ifdef NETLIB_NO_METRICS
+    static const bool metricsEnabled = false;
+#else
+    static const bool metricsEnabled = true;
+#endif
+
+// A snapshot of a histogram, which has a bucket for each power of two
+struct HistogramSnapshot
+{
+    static const unsigned bucketCount = 32;
+
+    HistogramSnapshot();
+    void merge(const HistogramSnapshot& other);
+    std::uint64_t getPercentile(double percentile) const; // Returns the upper limit of the bucket
+    static std::uint64_t getBucketLimit(unsigned bucket); // Values in a bucket are below this
+
+    std::uint64_t buckets[bucketCount]; // Bucket 0 is for 0, bucket i is for [2^(i-1), 2^i)
+    std::uint64_t count;
+    std::uint64_t sum;
+};
+
+// Per-client counters, these are only accessed with the client's shard locked
+struct ClientMetrics
+{
+    ClientMetrics();
+
+    std::uint64_t packetsReceived;
+    std::uint64_t bytesReceived;
+    std::uint64_t packetsSent;
+    std::uint64_t bytesSent; // Includes the frame headers
+    std::uint64_t sendFailures; // Packets that were dropped, or couldn't be sent
+};
+
+// A snapshot of all of the server's metrics
+struct ServerMetrics
+{
+    ServerMetrics();
+
+    std::uint64_t packetsReceived;
+    std::uint64_t bytesReceived; // Everything read from the sockets
+    std::uint64_t packetsSent;
+    std::uint64_t bytesSent; // Includes the frame headers
+    std::uint64_t sendFailures;
+    std::uint64_t clientsAccepted;
+    std::uint64_t clientsRejected; // Connections closed because of the connection limit or the connection rate limit
+    std::uint64_t clientsDisconnected;
+    std::uint64_t packetsLimited; // Packets received while over the rate limits
+    std::uint64_t lockWaits; // How many times a shard's lock was already taken
+    std::uint64_t lockWaitTime; // Microseconds spent waiting for the shard locks
+    HistogramSnapshot callbackTime; // Microseconds spent in each callback
+    HistogramSnapshot sendQueueSize; // Bytes in a client's send queue after each send
+};
+
+#ifndef NETLIB_NO_METRICS
+
+class Counter
+{
+    public:
+        Counter();
+        void add(std::uint64_t amount = 1)
+        {
+            value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+        }
+        std::uint64_t get() const;
+
+    private:
+        std::atomic<std::uint64_t> value;
+};
+
+class Histogram
+{
+    public:
+        void add(std::uint64_t value);
+        void addTo(HistogramSnapshot& snapshot) const;
+
+    private:
+        Counter buckets[HistogramSnapshot::bucketCount];
+        Counter count;
+        Counter sum;
+};
+
+// Measures how much time has passed since it was created
+class MetricTimer
+{
+    public:
+        MetricTimer(): start(std::chrono::steady_clock::now()) {}
+        std::uint64_t getMicroseconds() const
+        {
+            auto elapsed = std::chrono::steady_clock::now() - start;
+            return std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+        }
+
+    private:
+        std::chrono::steady_clock::time_point start;
+};
+
+#else
+
+class Counter
+{
+    public:
+        void add(std::uint64_t = 1) {}
+        std::uint64_t get() const { return 0; }
+};
+
+class Histogram
+{
+    public:
+        void add(std::uint64_t) {}
+        void addTo(HistogramSnapshot&) const {}
+};
+
+class MetricTimer
+{
+    public:
+        std::uint64_t getMicroseconds() const { return 0; }
+};
+
+#endif
+
+}
+
+#endif
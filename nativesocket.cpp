@@ -0,0 +1,272 @@
+// See the file COPYRIGHT.txt for authors and copyright information.
+// See the file LICENSE.txt for copying conditions.
+
+#include "nativesocket.h"
+#include <cstring>
+#include <algorithm>
+#ifdef _WIN32
+    #include <winsock2.h>
+#else
+    #include <cerrno>
+    #include <unistd.h>
+    #include <poll.h>
+    #include <fcntl.h>
+    #include <sys/socket.h>
+    #include <sys/stat.h>
+    #include <sys/un.h>
+#endif
+
+namespace net
+{
+
+namespace
+{
+
+// Only used to name the protected sf::Socket::getHandle() from inside a derived class
+struct HandleAccess: public sf::Socket
+{
+    static sf::SocketHandle get(const sf::Socket& socket)
+    {
+        // The member pointer is formed through the derived class, but can be applied to any socket
+        return (socket.*(&HandleAccess::getHandle))();
+    }
+
+    static void createHandle(sf::Socket& socket)
+    {
+        // create() is overloaded, so the one without arguments needs to be picked out
+        auto create = static_cast<void (sf::Socket::*)()>(&HandleAccess::create);
+        (socket.*create)();
+    }
+
+    static void adoptHandle(sf::Socket& socket, sf::SocketHandle handle)
+    {
+        auto create = static_cast<void (sf::Socket::*)(sf::SocketHandle)>(&HandleAccess::create);
+        (socket.*create)(handle);
+    }
+};
+
+#ifndef _WIN32
+
+bool makeUnixAddress(const std::string& path, sockaddr_un& address)
+{
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    bool status = (!path.empty() && path.size() < sizeof(address.sun_path));
+    if (status)
+        std::memcpy(address.sun_path, path.data(), path.size());
+    return status;
+}
+
+// Removes a Unix socket left at the path, but nothing else, returns false if something else is there
+bool removeUnixSocket(const std::string& path)
+{
+    struct stat info;
+    bool status = true;
+    if (lstat(path.c_str(), &info) == 0)
+        status = (S_ISSOCK(info.st_mode) && unlink(path.c_str()) == 0);
+    else
+        status = (errno == ENOENT);
+    return status;
+}
+
+// Room for the control data of one handle, the header member makes it aligned the way the CMSG macros expect
+union HandleControl
+{
+    char data[CMSG_SPACE(sizeof(int))];
+    cmsghdr header;
+};
+
+#endif
+
+}
+
+sf::SocketHandle getNativeHandle(const sf::Socket& socket)
+{
+    return HandleAccess::get(socket);
+}
+
+void createNativeHandle(sf::Socket& socket)
+{
+    HandleAccess::createHandle(socket);
+}
+
+void adoptNativeHandle(sf::Socket& socket, sf::SocketHandle handle)
+{
+    HandleAccess::adoptHandle(socket, handle);
+}
+
+bool shutdownSend(sf::Socket& socket)
+{
+    #ifdef _WIN32
+        return (shutdown(getNativeHandle(socket), SD_SEND) == 0);
+    #else
+        return (shutdown(getNativeHandle(socket), SHUT_WR) == 0);
+    #endif
+}
+
+sf::Socket::Status getConnectStatus(const sf::Socket& socket)
+{
+    // The socket becomes writable when connecting is done, and the socket's error says whether it worked
+    auto handle = getNativeHandle(socket);
+    auto status = sf::Socket::NotReady;
+    int error = 0;
+    #ifdef _WIN32
+        WSAPOLLFD ready = {handle, POLLWRNORM, 0};
+        int result = WSAPoll(&ready, 1, 0);
+        int size = sizeof(error);
+        if (result > 0)
+        {
+            bool valid = (getsockopt(handle, SOL_SOCKET, SO_ERROR, reinterpret_cast<char*>(&error), &size) == 0);
+            status = (valid && error == 0 && !(ready.revents & (POLLERR | POLLHUP)) ? sf::Socket::Done : sf::Socket::Error);
+        }
+        else if (result < 0)
+            status = sf::Socket::Error;
+    #else
+        pollfd ready = {handle, POLLOUT, 0};
+        int result = poll(&ready, 1, 0);
+        socklen_t size = sizeof(error);
+        if (result > 0)
+        {
+            bool valid = (getsockopt(handle, SOL_SOCKET, SO_ERROR, &error, &size) == 0);
+            status = (valid && error == 0 ? sf::Socket::Done : sf::Socket::Error);
+        }
+        else if (result < 0 && errno != EINTR)
+            status = sf::Socket::Error;
+    #endif
+    return status;
+}
+
+bool waitUntilWritable(sf::SocketHandle handle, sf::Time timeout)
+{
+    // Errors count as writable too, since the send that follows will report them
+    int milliseconds = std::max(timeout.asMilliseconds(), 0);
+    #ifdef _WIN32
+        WSAPOLLFD ready = {handle, POLLWRNORM, 0};
+        return (WSAPoll(&ready, 1, milliseconds) != 0);
+    #else
+        pollfd ready = {handle, POLLOUT, 0};
+        return (poll(&ready, 1, milliseconds) > 0);
+    #endif
+}
+
+#ifdef _WIN32
+
+bool sendHandle(const std::string&, sf::SocketHandle)
+{
+    return false;
+}
+
+bool receiveHandle(const std::string&, sf::Time, sf::SocketHandle&)
+{
+    return false;
+}
+
+#else
+
+bool sendHandle(const std::string& path, sf::SocketHandle handle)
+{
+    sockaddr_un address;
+    bool status = makeUnixAddress(path, address);
+    int unixSocket = (status ? socket(AF_UNIX, SOCK_STREAM, 0) : -1);
+    status = (unixSocket != -1 && connect(unixSocket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0);
+    if (status)
+    {
+        // The handle goes in the control data, and the kernel gives the receiver its own copy of it
+        char byte = 0;
+        iovec vector = {&byte, 1};
+        HandleControl control;
+        std::memset(&control, 0, sizeof(control));
+        msghdr message;
+        std::memset(&message, 0, sizeof(message));
+        message.msg_iov = &vector;
+        message.msg_iovlen = 1;
+        message.msg_control = control.data;
+        message.msg_controllen = sizeof(control.data);
+        auto header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(sizeof(int));
+        int fd = handle;
+        std::memcpy(CMSG_DATA(header), &fd, sizeof(fd));
+        ssize_t result = -1;
+        do
+            result = sendmsg(unixSocket, &message, 0);
+        while (result < 0 && errno == EINTR);
+        status = (result == 1);
+    }
+    if (unixSocket != -1)
+        close(unixSocket);
+    return status;
+}
+
+bool receiveHandle(const std::string& path, sf::Time timeout, sf::SocketHandle& handle)
+{
+    // A socket left over at the path from before is replaced, but anything else there is left alone
+    sockaddr_un address;
+    bool status = (makeUnixAddress(path, address) && removeUnixSocket(path));
+    int listener = (status ? socket(AF_UNIX, SOCK_STREAM, 0) : -1);
+    bool bound = (listener != -1 && bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0);
+    status = (bound && ::listen(listener, 1) == 0);
+
+    // Wait for the sender to connect
+    int connection = -1;
+    if (status)
+    {
+        pollfd ready = {listener, POLLIN, 0};
+        int result = -1;
+        do
+            result = poll(&ready, 1, timeout.asMilliseconds());
+        while (result < 0 && errno == EINTR);
+        if (result > 0)
+            connection = accept(listener, nullptr, nullptr);
+        status = (connection != -1);
+    }
+
+    if (status)
+    {
+        // Sending is done as soon as the sender connects, so this doesn't need a timeout of its own
+        // The handle is closed on exec, like the ones SFML creates, so it doesn't leak into child processes
+        char byte = 0;
+        iovec vector = {&byte, 1};
+        HandleControl control;
+        msghdr message;
+        std::memset(&message, 0, sizeof(message));
+        message.msg_iov = &vector;
+        message.msg_iovlen = 1;
+        message.msg_control = control.data;
+        message.msg_controllen = sizeof(control.data);
+        #ifdef MSG_CMSG_CLOEXEC
+            int flags = MSG_CMSG_CLOEXEC;
+        #else
+            int flags = 0;
+        #endif
+        ssize_t result = -1;
+        do
+            result = recvmsg(connection, &message, flags);
+        while (result < 0 && errno == EINTR);
+        auto header = (result == 1 ? CMSG_FIRSTHDR(&message) : nullptr);
+        status = (header && header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS &&
+            header->cmsg_len == CMSG_LEN(sizeof(int)));
+        if (status)
+        {
+            int fd = -1;
+            std::memcpy(&fd, CMSG_DATA(header), sizeof(fd));
+            #ifndef MSG_CMSG_CLOEXEC
+                fcntl(fd, F_SETFD, FD_CLOEXEC);
+            #endif
+            handle = fd;
+        }
+    }
+
+    if (connection != -1)
+        close(connection);
+    if (listener != -1)
+        close(listener);
+    if (bound)
+        removeUnixSocket(path);
+    return status;
+}
+
+#endif
+
+}
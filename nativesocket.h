@@ -0,0 +1,44 @@
+// See the file COPYRIGHT.txt for authors and copyright information.
+// See the file LICENSE.txt for copying conditions.
+
+#ifndef NATIVESOCKET_H
+#define NATIVESOCKET_H
+
+#include <string>
+#include <SFML/Network.hpp>
+
+namespace net
+{
+
+// Returns the OS-level handle underneath an SFML socket
+// SFML keeps this protected, but things like epoll need to work with the raw handles
+sf::SocketHandle getNativeHandle(const sf::Socket& socket);
+
+// Makes sure the socket has an OS-level handle
+// SFML only creates UDP handles when binding or sending, so this is needed before using the handle directly
+void createNativeHandle(sf::Socket& socket);
+
+// Gives an OS-level handle to a socket that doesn't have one, which then owns and closes it
+// This is for sockets that need options SFML doesn't have, like SO_REUSEPORT
+void adoptNativeHandle(sf::Socket& socket, sf::SocketHandle handle);
+
+// Closes the sending side of a TCP connection, so the other side reads the end of the stream after the data
+// The socket can still receive, so a graceful close can wait for the other side to close too
+bool shutdownSend(sf::Socket& socket);
+
+// Checks on a non-blocking connect: Done once it is connected, NotReady while it is still connecting, or Error
+// SFML starts a new connection every time connect() is called, so it can't tell this by itself
+sf::Socket::Status getConnectStatus(const sf::Socket& socket);
+
+// Waits until a socket can be written to, returns false if the timeout passed first
+// This takes the handle, so it can be called without holding on to the socket (an invalid handle just returns right away)
+bool waitUntilWritable(sf::SocketHandle handle, sf::Time timeout);
+
+// Passes a handle to another process on the same machine, through a Unix domain socket at path (not on Windows)
+// The receiver creates the Unix socket and waits for the sender, then gets its own handle to the same socket
+bool sendHandle(const std::string& path, sf::SocketHandle handle);
+bool receiveHandle(const std::string& path, sf::Time timeout, sf::SocketHandle& handle);
+
+}
+
+#endif
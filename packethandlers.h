@@ -0,0 +1,65 @@
+// See the file COPYRIGHT.txt for authors and copyright information.
+// See the file LICENSE.txt for copying conditions.
+
+#ifndef PACKETHANDLERS_H
+#define PACKETHANDLERS_H
+
+#include <SFML/Network.hpp>
+
+namespace net
+{
+
+/*
+A list of packet handlers that is put together at compile time.
+Each handler is a type with a packet type and a static handle() function, so finding and calling
+    the handler for a packet is just a chain of comparisons that the compiler can inline, without
+    any std::function in between.
+Example:
+    using Handlers = net::PacketHandlers<
+        net::PacketHandler<Message, &handleMessage>,
+        net::PacketHandler<AddNumbers, &handleAddNumbers>>;
+    client.setStaticHandlers<Handlers>();
+*/
+
+// Calls a function for a packet type
+template <sf::Int32 Type, void (*Function)(sf::Packet&)>
+struct PacketHandler
+{
+    static const sf::Int32 type = Type;
+
+    static void handle(sf::Packet& packet)
+    {
+        Function(packet);
+    }
+};
+
+template <typename... Handlers>
+struct PacketHandlers;
+
+template <>
+struct PacketHandlers<>
+{
+    static bool handle(sf::Packet&, sf::Int32)
+    {
+        return false;
+    }
+};
+
+template <typename First, typename... Rest>
+struct PacketHandlers<First, Rest...>
+{
+    // Returns false if none of the handlers are for this packet type
+    static bool handle(sf::Packet& packet, sf::Int32 type)
+    {
+        bool handled = (type == First::type);
+        if (handled)
+            First::handle(packet);
+        else
+            handled = PacketHandlers<Rest...>::handle(packet, type);
+        return handled;
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,36 @@
+// See the file COPYRIGHT.txt for authors and copyright information.
+// See the file LICENSE.txt for copying conditions.
+
+#include "packetpool.h"
+
+namespace net
+{
+
+PacketPool::PacketPtr PacketPool::acquire()
+{
+    PacketPtr packet;
+    if (packets.empty())
+        packet.reset(new sf::Packet());
+    else
+    {
+        packet = std::move(packets.back());
+        packets.pop_back();
+    }
+    return packet;
+}
+
+void PacketPool::release(PacketPtr packet)
+{
+    if (packet)
+    {
+        packet->clear();
+        packets.push_back(std::move(packet));
+    }
+}
+
+void PacketPool::clear()
+{
+    packets.clear();
+}
+
+}
@@ -0,0 +1,31 @@
+// See the file COPYRIGHT.txt for authors and copyright information.
+// See the file LICENSE.txt for copying conditions.
+
+#ifndef PACKETPOOL_H
+#define PACKETPOOL_H
+
+#include <vector>
+#include <memory>
+#include <SFML/Network.hpp>
+
+namespace net
+{
+
+// Keeps packets around after they are used, so that their memory can be reused
+// Once enough packets have been created, acquiring and releasing them doesn't allocate anything
+class PacketPool
+{
+    public:
+        using PacketPtr = std::unique_ptr<sf::Packet>;
+
+        PacketPtr acquire(); // Returns an empty packet
+        void release(PacketPtr packet); // Clears the packet and keeps it for later
+        void clear(); // Frees all of the unused packets
+
+    private:
+        std::vector<PacketPtr> packets;
+};
+
+}
+
+#endif
@@ -0,0 +1,79 @@
+// See the file COPYRIGHT.txt for authors and copyright information.
+// See the file LICENSE.txt for copying conditions.
+
+#include "packetstore.h"
+
+namespace net
+{
+
+PacketStore::Queue::Queue():
+    limit(0)
+{
+}
+
+bool PacketStore::Front::operator<(const Front& other) const
+{
+    // The heap keeps the largest element on top, so this is reversed to put the oldest packet there
+    return (sequence > other.sequence);
+}
+
+PacketStore::PacketStore(PacketPool& pool):
+    pool(pool),
+    nextSequence(0),
+    count(0)
+{
+}
+
+void PacketStore::push(PacketType type, PacketPtr packet)
+{
+    auto& queue = queues[type];
+    StoredPacket stored;
+    stored.sequence = nextSequence++;
+    stored.packet = std::move(packet);
+    queue.packets.push_back(std::move(stored));
+    ++count;
+    trim(queue);
+}
+
+void PacketStore::setLimit(PacketType type, std::size_t limit)
+{
+    auto& queue = queues[type];
+    queue.limit = limit;
+    trim(queue);
+}
+
+bool PacketStore::empty() const
+{
+    return (count == 0);
+}
+
+std::size_t PacketStore::size() const
+{
+    return count;
+}
+
+void PacketStore::clear()
+{
+    for (auto& queue: queues)
+        releaseAll(queue.second);
+}
+
+void PacketStore::trim(Queue& queue)
+{
+    while (queue.limit > 0 && queue.packets.size() > queue.limit)
+    {
+        pool.release(std::move(queue.packets.front().packet));
+        queue.packets.pop_front();
+        --count;
+    }
+}
+
+void PacketStore::releaseAll(Queue& queue)
+{
+    for (auto& stored: queue.packets)
+        pool.release(std::move(stored.packet));
+    count -= queue.packets.size();
+    queue.packets.clear();
+}
+
+}
@@ -0,0 +1,142 @@
+// See the file COPYRIGHT.txt for authors and copyright information.
+// See the file LICENSE.txt for copying conditions.
+
+#ifndef PACKETSTORE_H
+#define PACKETSTORE_H
+
+#include <deque>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdint>
+#include <SFML/Network.hpp>
+#include "packetpool.h"
+
+namespace net
+{
+
+/*
+Stores packets that can't be handled yet, in a separate queue for each packet type.
+Every packet gets a sequence number, so packets of different types can still be handled in the order
+    they arrived. Handling some of the types only looks at the queues of those types, and merges them
+    by sequence number, so it doesn't cost anything for the packets of the other types.
+Each type can have a limit, after which the oldest packets of that type are dropped.
+Removed packets are put back into the pool.
+*/
+class PacketStore
+{
+    public:
+        using PacketType = sf::Int32;
+        using PacketPtr = PacketPool::PacketPtr;
+
+        PacketStore(PacketPool& pool);
+
+        void push(PacketType type, PacketPtr packet);
+        void setLimit(PacketType type, std::size_t limit); // 0 means no limit
+        bool empty() const;
+        std::size_t size() const;
+
+        // Calls handler(sf::Packet&, PacketType) for the packets whose types pass the filter, in the
+        //     order they were received, and removes them. Returns false if nothing was handled.
+        //     Packets stored while handling are left for next time.
+        template <typename Filter, typename Handler>
+        bool handle(Filter filter, Handler handler);
+
+        // Removes the packets whose types don't pass the filter
+        template <typename Filter>
+        void keepOnly(Filter filter);
+
+        void clear();
+
+    private:
+        struct StoredPacket
+        {
+            std::uint64_t sequence;
+            PacketPtr packet;
+        };
+
+        struct Queue
+        {
+            Queue();
+
+            std::deque<StoredPacket> packets;
+            std::size_t limit;
+        };
+
+        // The oldest packet of a queue, these are kept in a heap while merging the queues
+        struct Front
+        {
+            std::uint64_t sequence;
+            Queue* queue;
+            PacketType type;
+            bool operator<(const Front& other) const;
+        };
+
+        void trim(Queue& queue); // Drops the oldest packets that are over the limit
+        void releaseAll(Queue& queue);
+
+        PacketPool& pool;
+        std::unordered_map<PacketType, Queue> queues;
+        std::vector<Front> fronts; // Reused when handling packets
+        std::uint64_t nextSequence;
+        std::size_t count;
+};
+
+template <typename Filter, typename Handler>
+bool PacketStore::handle(Filter filter, Handler handler)
+{
+    // Start with the oldest packet of each queue in the filter
+    fronts.clear();
+    for (auto& queue: queues)
+    {
+        if (!queue.second.packets.empty() && filter(queue.first))
+        {
+            Front front = {queue.second.packets.front().sequence, &queue.second, queue.first};
+            fronts.push_back(front);
+        }
+    }
+    std::make_heap(fronts.begin(), fronts.end());
+
+    // Always handle the oldest packet out of all of the queues
+    bool handled = false;
+    auto lastSequence = nextSequence;
+    while (!fronts.empty())
+    {
+        std::pop_heap(fronts.begin(), fronts.end());
+        auto front = fronts.back();
+        fronts.pop_back();
+        auto& packets = front.queue->packets;
+
+        // The handler could have removed packets, so make sure it is still the same one
+        if (!packets.empty() && packets.front().sequence == front.sequence)
+        {
+            auto packet = std::move(packets.front().packet);
+            packets.pop_front();
+            --count;
+            if (!packets.empty() && packets.front().sequence < lastSequence)
+            {
+                front.sequence = packets.front().sequence;
+                fronts.push_back(front);
+                std::push_heap(fronts.begin(), fronts.end());
+            }
+            handler(*packet, front.type);
+            pool.release(std::move(packet));
+            handled = true;
+        }
+    }
+    return handled;
+}
+
+template <typename Filter>
+void PacketStore::keepOnly(Filter filter)
+{
+    for (auto& queue: queues)
+    {
+        if (!filter(queue.first))
+            releaseAll(queue.second);
+    }
+}
+
+}
+
+#endif
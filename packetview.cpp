@@ -0,0 +1,42 @@
+// See the file COPYRIGHT.txt for authors and copyright information.
+// See the file LICENSE.txt for copying conditions.
+
+#include "packetview.h"
+
+namespace net
+{
+
+PacketView::PacketView():
+    data(nullptr),
+    size(0)
+{
+}
+
+PacketView::PacketView(const void* data, std::size_t size):
+    data(data),
+    size(size)
+{
+}
+
+const void* PacketView::getData() const
+{
+    return data;
+}
+
+std::size_t PacketView::getDataSize() const
+{
+    return size;
+}
+
+bool PacketView::empty() const
+{
+    return (size == 0);
+}
+
+void PacketView::copyTo(sf::Packet& packet) const
+{
+    packet.clear();
+    packet.append(data, size);
+}
+
+}
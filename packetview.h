@@ -0,0 +1,35 @@
+// See the file COPYRIGHT.txt for authors and copyright information.
+// See the file LICENSE.txt for copying conditions.
+
+#ifndef PACKETVIEW_H
+#define PACKETVIEW_H
+
+#include <cstddef>
+#include <SFML/Network.hpp>
+
+namespace net
+{
+
+// A read-only view of a received packet's data, which doesn't own any memory
+// It points into a receive buffer, so it is only valid until the callback it was passed to returns
+class PacketView
+{
+    public:
+        PacketView();
+        PacketView(const void* data, std::size_t size);
+
+        const void* getData() const;
+        std::size_t getDataSize() const;
+        bool empty() const;
+
+        // Replaces the contents of a packet with this data (doesn't allocate if the packet has enough capacity)
+        void copyTo(sf::Packet& packet) const;
+
+    private:
+        const void* data;
+        std::size_t size;
+};
+
+}
+
+#endif
@@ -0,0 +1,37 @@
+// See the file COPYRIGHT.txt for authors and copyright information.
+// See the file LICENSE.txt for copying conditions.
+
+#include "protocol.h"
+
+namespace net
+{
+
+bool isControlType(sf::Int32 type)
+{
+    return (type >= firstControlType && type < 0);
+}
+
+void makeControlPacket(sf::Packet& packet, ControlType type)
+{
+    packet.clear();
+    packet << static_cast<sf::Int32>(type);
+    if (type == ConnectRequest)
+        packet << protocolVersion;
+}
+
+bool readPacketType(const void* data, std::size_t size, sf::Int32& type)
+{
+    bool status = (size >= sizeof(sf::Int32));
+    if (status)
+    {
+        // sf::Packet stores integers in big-endian order
+        auto bytes = static_cast<const unsigned char*>(data);
+        sf::Uint32 value = 0;
+        for (std::size_t i = 0; i < sizeof(sf::Int32); ++i)
+            value = (value << 8) | bytes[i];
+        type = static_cast<sf::Int32>(value);
+    }
+    return status;
+}
+
+}
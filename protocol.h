@@ -0,0 +1,62 @@
+// See the file COPYRIGHT.txt for authors and copyright information.
+// See the file LICENSE.txt for copying conditions.
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <SFML/Network.hpp>
+
+namespace net
+{
+
+/*
+Packet types that are reserved for the library's own control packets.
+These are negative, so any other packet type can be used by applications.
+The TCP control packets are only intercepted while the feature that uses them is on, so applications
+    that don't use a feature still get packets of its types.
+A UDP session with UdpServer starts with a ConnectRequest from the peer, which the server answers
+    with a ConnectAccept (or a Disconnect if it is full). Sending the request again is safe, so it
+    can be repeated until the accept arrives. Either side can end the session with a Disconnect,
+    and the server ends it if nothing is received for too long, which KeepAlive can prevent.
+TCP connections can agree to use compression (see compressor.h). The client sends a CompressionRequest
+    with its dictionary ID, and a server with compression on and the same dictionary answers with a
+    CompressionAccept. Only after that does either side send Compressed packets to the other.
+A TcpServer with a heartbeat sends each client a Ping with a timestamp, which the client answers with a
+    Pong holding the same timestamp, so the server can measure the round trip time. The Ping also
+    carries the server's latest estimate, so the client knows it too.
+Snapshots from TcpServer::sendSnapshot() are sent as deltas (see snapshot.h), and the client answers
+    each one it could rebuild with a SnapshotAck. An ack for snapshot 0 asks for a whole snapshot.
+*/
+
+const sf::Uint32 protocolVersion = 1; // Sent with ConnectRequest, peers with another version are rejected
+
+enum ControlType: sf::Int32
+{
+    ConnectRequest = -1, // Peer -> server, followed by the protocol version
+    ConnectAccept = -2, // Server -> peer
+    Disconnect = -3, // Either way
+    KeepAlive = -4, // Peer -> server, only keeps the session from timing out
+    ChannelData = -5, // Either way, messages and acks of the channels (see connection.h)
+    CompressionRequest = -6, // Client -> server, followed by the dictionary ID
+    CompressionAccept = -7, // Server -> client, followed by the dictionary ID
+    Compressed = -8, // Either way, followed by the original size and the compressed packet
+    Ping = -9, // Server -> client, followed by a timestamp, and the smoothed RTT and jitter in microseconds
+    Pong = -10, // Client -> server, followed by the timestamp of the ping
+    Snapshot = -11, // Server -> client, followed by the snapshot ID, the baseline ID (0 for none), and the delta
+    SnapshotAck = -12 // Client -> server, followed by the snapshot ID
+};
+
+const sf::Int32 firstControlType = -1024; // Types from here to -1 are reserved for control packets
+
+bool isControlType(sf::Int32 type);
+
+// Replaces the contents of a packet with a control packet (the connect request also gets the version)
+// Anything else that follows the type, like the dictionary ID, is added by the caller
+void makeControlPacket(sf::Packet& packet, ControlType type);
+
+// Reads the packet type from the start of a packet's data, without needing an sf::Packet
+bool readPacketType(const void* data, std::size_t size, sf::Int32& type);
+
+}
+
+#endif
@@ -0,0 +1,58 @@
+// See the file COPYRIGHT.txt for authors and copyright information.
+// See the file LICENSE.txt for copying conditions.
+
+#include "ratelimit.h"
+#include <algorithm>
+#include <cmath>
+
+namespace net
+{
+
+TokenBucket::TokenBucket():
+    rate(0.0),
+    burst(0.0),
+    tokens(0.0),
+    lastRefill(0)
+{
+}
+
+void TokenBucket::reset(double rate, double burst, std::uint64_t now)
+{
+    this->rate = std::max(rate, 0.0) / 1000.0;
+    this->burst = std::max(burst, 1.0);
+    tokens = this->burst;
+    lastRefill = now;
+}
+
+void TokenBucket::refill(std::uint64_t now)
+{
+    if (now > lastRefill)
+    {
+        tokens = std::min(tokens + (now - lastRefill) * rate, burst);
+        lastRefill = now;
+    }
+}
+
+void TokenBucket::take(double amount)
+{
+    if (rate > 0.0)
+        tokens -= amount;
+}
+
+bool TokenBucket::hasTokens() const
+{
+    return (rate <= 0.0 || tokens > 0.0);
+}
+
+bool TokenBucket::isFull() const
+{
+    return (rate <= 0.0 || tokens >= burst);
+}
+
+std::uint64_t TokenBucket::getTimeUntilTokens() const
+{
+    // Rounded up, so the bucket isn't still empty when the time is up
+    return (hasTokens() ? 0 : static_cast<std::uint64_t>(std::floor(-tokens / rate)) + 1);
+}
+
+}
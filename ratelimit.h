@@ -0,0 +1,40 @@
+// See the file COPYRIGHT.txt for authors and copyright information.
+// See the file LICENSE.txt for copying conditions.
+
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <cstdint>
+
+namespace net
+{
+
+/*
+A token bucket, which allows a steady rate with bursts of up to a limit.
+Tokens are added back as time passes, and anything that costs tokens is only allowed while there are some left.
+    The whole cost is taken even if that leaves the bucket below zero, so a big packet doesn't have to
+    fit in the burst, it just has to be paid off before the next one is allowed.
+The time is passed in by the caller (in milliseconds), so the clock is only read once for many buckets.
+Checking a bucket is only a few arithmetic operations, so it is cheap enough to do for every packet.
+*/
+class TokenBucket
+{
+    public:
+        TokenBucket();
+        void reset(double rate, double burst, std::uint64_t now); // Per second, starts full (a rate of 0 never limits)
+        void refill(std::uint64_t now); // Adds the tokens for the time that passed since the last refill
+        void take(double amount);
+        bool hasTokens() const; // Whether anything can be taken
+        bool isFull() const; // Whether it's the same as a new bucket
+        std::uint64_t getTimeUntilTokens() const; // Milliseconds until hasTokens() is true
+
+    private:
+        double rate; // Tokens per millisecond
+        double burst; // Maximum tokens
+        double tokens; // Can go below zero
+        std::uint64_t lastRefill;
+};
+
+}
+
+#endif
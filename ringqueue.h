@@ -0,0 +1,154 @@
+// See the file COPYRIGHT.txt for authors and copyright information.
+// See the file LICENSE.txt for copying conditions.
+
+#ifndef RINGQUEUE_H
+#define RINGQUEUE_H
+
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <cstddef>
+
+namespace net
+{
+
+/*
+A bounded lock-free queue that any number of threads can push to and pop from.
+It is based on Dmitry Vyukov's bounded MPMC queue: each slot has a sequence number that says
+    whether it is ready to be written or read, so a push or pop is just one compare-and-swap.
+Items are never moved in or out. Instead, push() and pop() call a function on the slot itself,
+    so the items (and any memory they own) are reused every time the queue wraps around.
+*/
+template <typename T>
+class RingQueue
+{
+    public:
+        explicit RingQueue(std::size_t capacity); // Rounded up to a power of two
+
+        // Calls fill(T&) on a free slot, returns false if the queue is full
+        template <typename Func>
+        bool push(Func fill);
+
+        // Calls consume(T&) on the oldest item, returns false if the queue is empty
+        template <typename Func>
+        bool pop(Func consume);
+
+        // Only a hint when other threads are pushing or popping
+        bool empty() const;
+
+        std::size_t capacity() const;
+
+    private:
+        struct Cell
+        {
+            std::atomic<std::size_t> sequence;
+            T data;
+        };
+
+        std::unique_ptr<Cell[]> cells;
+        std::size_t mask;
+
+        // These are kept on separate cache lines, so the producers and consumers don't fight over them
+        static const std::size_t cacheLineSize = 64;
+        char padding1[cacheLineSize];
+        std::atomic<std::size_t> pushPosition;
+        char padding2[cacheLineSize - sizeof(std::atomic<std::size_t>)];
+        std::atomic<std::size_t> popPosition;
+};
+
+template <typename T>
+RingQueue<T>::RingQueue(std::size_t capacity):
+    pushPosition(0),
+    popPosition(0)
+{
+    std::size_t size = 2;
+    while (size < capacity)
+        size *= 2;
+    cells.reset(new Cell[size]);
+    mask = size - 1;
+    for (std::size_t i = 0; i < size; ++i)
+        cells[i].sequence.store(i, std::memory_order_relaxed);
+}
+
+template <typename T>
+template <typename Func>
+bool RingQueue<T>::push(Func fill)
+{
+    bool status = false;
+    bool done = false;
+    Cell* cell = nullptr;
+    auto position = pushPosition.load(std::memory_order_relaxed);
+    while (!done)
+    {
+        cell = &cells[position & mask];
+        auto sequence = cell->sequence.load(std::memory_order_acquire);
+        auto difference = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(position);
+        if (difference == 0)
+        {
+            // The slot is free, so try to claim it
+            status = pushPosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed);
+            done = status;
+        }
+        else if (difference < 0)
+            done = true; // The queue is full
+        else
+            position = pushPosition.load(std::memory_order_relaxed); // Another thread claimed it first
+    }
+    if (status)
+    {
+        fill(cell->data);
+        cell->sequence.store(position + 1, std::memory_order_release);
+    }
+    return status;
+}
+
+template <typename T>
+template <typename Func>
+bool RingQueue<T>::pop(Func consume)
+{
+    bool status = false;
+    bool done = false;
+    Cell* cell = nullptr;
+    auto position = popPosition.load(std::memory_order_relaxed);
+    while (!done)
+    {
+        cell = &cells[position & mask];
+        auto sequence = cell->sequence.load(std::memory_order_acquire);
+        auto difference = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(position + 1);
+        if (difference == 0)
+        {
+            // The slot has an item, so try to claim it
+            status = popPosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed);
+            done = status;
+        }
+        else if (difference < 0)
+            done = true; // The queue is empty
+        else
+            position = popPosition.load(std::memory_order_relaxed); // Another thread claimed it first
+    }
+    if (status)
+    {
+        consume(cell->data);
+        // Mark the slot as free for the next time around
+        cell->sequence.store(position + mask + 1, std::memory_order_release);
+    }
+    return status;
+}
+
+template <typename T>
+bool RingQueue<T>::empty() const
+{
+    // The oldest slot only has the next sequence number once something was pushed to it
+    auto position = popPosition.load(std::memory_order_relaxed);
+    return (cells[position & mask].sequence.load(std::memory_order_acquire) != position + 1);
+}
+
+template <typename T>
+std::size_t RingQueue<T>::capacity() const
+{
+    return mask + 1;
+}
+
+}
+
+#endif
@@ -0,0 +1,93 @@
+// See the file COPYRIGHT.txt for authors and copyright information.
+// See the file LICENSE.txt for copying conditions.
+
+#include "selectorbackend.h"
+#include "nativesocket.h"
+
+namespace net
+{
+
+SelectorBackend::SelectorBackend()
+{
+    wakeReceiver.setBlocking(false);
+    wakeReceiver.bind(sf::Socket::AnyPort, sf::IpAddress::LocalHost);
+    selector.add(wakeReceiver);
+}
+
+EventBackend::Type SelectorBackend::getType() const
+{
+    return Selector;
+}
+
+unsigned SelectorBackend::getMaxSockets() const
+{
+    return maxSockets;
+}
+
+bool SelectorBackend::hasWriteEvents() const
+{
+    // sf::SocketSelector can only wait for sockets to be readable
+    return false;
+}
+
+bool SelectorBackend::add(sf::Socket& socket, int id)
+{
+    // sf::SocketSelector only prints an error for sockets it can't hold, so they are refused here
+    #ifdef _WIN32
+        bool status = (sockets.count(&socket) > 0 || sockets.size() + 1 < maxSockets); // The wake socket takes one
+    #else
+        bool status = (static_cast<unsigned>(getNativeHandle(socket)) < maxSockets);
+    #endif
+    if (status)
+    {
+        selector.add(socket);
+        sockets[&socket] = id;
+    }
+    return status;
+}
+
+void SelectorBackend::remove(sf::Socket& socket)
+{
+    selector.remove(socket);
+    sockets.erase(&socket);
+}
+
+void SelectorBackend::clear()
+{
+    selector.clear();
+    selector.add(wakeReceiver);
+    sockets.clear();
+    ready.clear();
+}
+
+bool SelectorBackend::wait(sf::Time timeout)
+{
+    ready.clear();
+    if (selector.wait(timeout))
+    {
+        if (selector.isReady(wakeReceiver))
+        {
+            // Throw away all of the wake datagrams
+            char data;
+            std::size_t received = 0;
+            sf::IpAddress address;
+            unsigned short port = 0;
+            while (wakeReceiver.receive(&data, sizeof(data), received, address, port) == sf::Socket::Done);
+        }
+        for (auto& socket: sockets)
+        {
+            if (selector.isReady(*socket.first))
+                ready.push_back({socket.second, true, false});
+        }
+    }
+    return !ready.empty();
+}
+
+void SelectorBackend::wake()
+{
+    std::lock_guard<std::mutex> lock(wakeMutex);
+    char data = 0;
+    wakeSender.send(&data, sizeof(data), sf::IpAddress::LocalHost, wakeReceiver.getLocalPort());
+}
+
+}
@@ -0,0 +1,49 @@
+// See the file COPYRIGHT.txt for authors and copyright information.
+// See the file LICENSE.txt for copying conditions.
+
+#ifndef SELECTORBACKEND_H
+#define SELECTORBACKEND_H
+
+#include <map>
+#include <mutex>
+#include "eventbackend.h"
+
+namespace net
+{
+
+// Event backend that uses an sf::SocketSelector, this is the portable fallback
+// The selector can only tell if a specific socket is ready, so building the ready list is O(N)
+// Waking is done by sending an empty datagram to a UDP socket bound to localhost
+class SelectorBackend: public EventBackend
+{
+    public:
+        #ifdef _WIN32
+            static const unsigned maxSockets = 64;
+        #else
+            static const unsigned maxSockets = 1024;
+        #endif
+
+        SelectorBackend();
+
+        Type getType() const;
+        unsigned getMaxSockets() const;
+        bool hasWriteEvents() const;
+
+        bool add(sf::Socket& socket, int id);
+        void remove(sf::Socket& socket);
+        void clear();
+
+        bool wait(sf::Time timeout);
+        void wake();
+
+    private:
+        sf::SocketSelector selector;
+        std::map<sf::Socket*, int> sockets; // All of the registered sockets and their IDs
+        sf::UdpSocket wakeReceiver; // Always in the selector
+        sf::UdpSocket wakeSender;
+        std::mutex wakeMutex;
+};
+
+}
+
+#endif
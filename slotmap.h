@@ -0,0 +1,262 @@
+// See the file COPYRIGHT.txt for authors and copyright information.
+// See the file LICENSE.txt for copying conditions.
+
+#ifndef SLOTMAP_H
+#define SLOTMAP_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+namespace net
+{
+
+/*
+A container that gives each value a key, which can be used to find the value in constant time.
+The values are stored contiguously (in no particular order), so iterating over them is just an array walk.
+    Erasing a value moves the last value into its place.
+A key is made of a slot index and that slot's generation, which changes every time the slot is reused.
+    This way, the key of an erased value won't find a newer value, until the generation wraps around.
+    Freed slots are reused in the order they were freed, so it takes as long as possible for that to happen.
+    When the keys are limited, fewer bits are used for the index, so there are always at least
+    2^minGenerationBits generations. A map with very limited keys can't hold anything (see getMaxSize()).
+*/
+template <typename T>
+class SlotMap
+{
+    public:
+        using Key = std::uint32_t;
+        using iterator = typename std::vector<T>::iterator;
+        using const_iterator = typename std::vector<T>::const_iterator;
+
+        static const Key invalidKey = 0xFFFFFFFF;
+        static const unsigned maxIndexBits = 20;
+        static const unsigned minGenerationBits = 8;
+        static const std::size_t maxSize = (std::size_t(1) << maxIndexBits) - 1; // The most any map can hold
+
+        explicit SlotMap(Key maxKey = invalidKey - 1); // Keys will never be higher than this
+        std::size_t getMaxSize() const; // The most this map can hold, which is less when the keys are limited
+
+        // Adds a value, returns invalidKey if the map is full
+        Key insert(T value);
+
+        // Returns null if the key is invalid, or its value was erased
+        T* find(Key key);
+        const T* find(Key key) const;
+
+        // Returns false if the key is invalid, or its value was already erased
+        bool erase(Key key);
+
+        void clear();
+        std::size_t size() const;
+        bool empty() const;
+
+        // Access to the values by their position in the contiguous storage
+        T& operator[](std::size_t position);
+        const T& operator[](std::size_t position) const;
+        Key getKey(std::size_t position) const;
+        iterator begin();
+        iterator end();
+        const_iterator begin() const;
+        const_iterator end() const;
+
+    private:
+        static const std::uint32_t none = 0xFFFFFFFF;
+
+        struct Slot
+        {
+            std::uint32_t position; // Where the value is stored, or none if the slot is free
+            std::uint32_t generation;
+            std::uint32_t nextFree;
+        };
+
+        const Slot* findSlot(Key key) const;
+
+        std::vector<T> values;
+        std::vector<Key> keys; // The key of each value
+        std::vector<Slot> slots;
+        std::uint32_t firstFree; // Freed slots are reused from the front, and added to the back
+        std::uint32_t lastFree;
+        unsigned indexBits;
+        Key indexMask;
+        std::uint32_t generations; // How many generations fit in a key
+};
+
+template <typename T>
+SlotMap<T>::SlotMap(Key maxKey):
+    firstFree(none),
+    lastFree(none),
+    indexBits(0)
+{
+    // The index gets whatever is left after the generation bits, up to its maximum
+    unsigned keyBits = 0;
+    while ((std::uint64_t(1) << (keyBits + 1)) <= static_cast<std::uint64_t>(maxKey) + 1)
+        ++keyBits;
+    if (keyBits > minGenerationBits)
+        indexBits = (keyBits - minGenerationBits < maxIndexBits ? keyBits - minGenerationBits : maxIndexBits);
+    indexMask = (Key(1) << indexBits) - 1;
+    generations = static_cast<std::uint32_t>((static_cast<std::uint64_t>(maxKey) + 1) >> indexBits);
+}
+
+template <typename T>
+std::size_t SlotMap<T>::getMaxSize() const
+{
+    // The last index isn't used, so a key can never be invalidKey
+    return (std::size_t(1) << indexBits) - 1;
+}
+
+template <typename T>
+typename SlotMap<T>::Key SlotMap<T>::insert(T value)
+{
+    Key key = invalidKey;
+    std::uint32_t index = none;
+    if (firstFree != none)
+    {
+        index = firstFree;
+        firstFree = slots[index].nextFree;
+        if (firstFree == none)
+            lastFree = none;
+    }
+    else if (slots.size() < getMaxSize())
+    {
+        index = static_cast<std::uint32_t>(slots.size());
+        Slot slot;
+        slot.generation = 0;
+        slots.push_back(slot);
+    }
+    if (index != none)
+    {
+        auto& slot = slots[index];
+        slot.position = static_cast<std::uint32_t>(values.size());
+        slot.nextFree = none;
+        key = (slot.generation << indexBits) | index;
+        values.push_back(std::move(value));
+        keys.push_back(key);
+    }
+    return key;
+}
+
+template <typename T>
+T* SlotMap<T>::find(Key key)
+{
+    auto slot = findSlot(key);
+    return (slot ? &values[slot->position] : nullptr);
+}
+
+template <typename T>
+const T* SlotMap<T>::find(Key key) const
+{
+    auto slot = findSlot(key);
+    return (slot ? &values[slot->position] : nullptr);
+}
+
+template <typename T>
+bool SlotMap<T>::erase(Key key)
+{
+    bool status = (findSlot(key) != nullptr);
+    if (status)
+    {
+        // Move the last value into the erased one's place
+        std::uint32_t index = key & indexMask;
+        auto& slot = slots[index];
+        if (slot.position + 1 != values.size())
+        {
+            values[slot.position] = std::move(values.back());
+            keys[slot.position] = keys.back();
+            slots[keys.back() & indexMask].position = slot.position;
+        }
+        values.pop_back();
+        keys.pop_back();
+
+        // Free the slot, and move on to its next generation
+        slot.position = none;
+        slot.generation = (slot.generation + 1) % generations;
+        slot.nextFree = none;
+        if (lastFree != none)
+            slots[lastFree].nextFree = index;
+        else
+            firstFree = index;
+        lastFree = index;
+    }
+    return status;
+}
+
+template <typename T>
+void SlotMap<T>::clear()
+{
+    // The generations are kept, so old keys stay invalid
+    while (!keys.empty())
+        erase(keys.back());
+}
+
+template <typename T>
+std::size_t SlotMap<T>::size() const
+{
+    return values.size();
+}
+
+template <typename T>
+bool SlotMap<T>::empty() const
+{
+    return values.empty();
+}
+
+template <typename T>
+T& SlotMap<T>::operator[](std::size_t position)
+{
+    return values[position];
+}
+
+template <typename T>
+const T& SlotMap<T>::operator[](std::size_t position) const
+{
+    return values[position];
+}
+
+template <typename T>
+typename SlotMap<T>::Key SlotMap<T>::getKey(std::size_t position) const
+{
+    return keys[position];
+}
+
+template <typename T>
+typename SlotMap<T>::iterator SlotMap<T>::begin()
+{
+    return values.begin();
+}
+
+template <typename T>
+typename SlotMap<T>::iterator SlotMap<T>::end()
+{
+    return values.end();
+}
+
+template <typename T>
+typename SlotMap<T>::const_iterator SlotMap<T>::begin() const
+{
+    return values.begin();
+}
+
+template <typename T>
+typename SlotMap<T>::const_iterator SlotMap<T>::end() const
+{
+    return values.end();
+}
+
+template <typename T>
+const typename SlotMap<T>::Slot* SlotMap<T>::findSlot(Key key) const
+{
+    const Slot* slot = nullptr;
+    std::uint32_t index = key & indexMask;
+    if (key != invalidKey && index < slots.size())
+    {
+        slot = &slots[index];
+        if (slot->position == none || slot->generation != (key >> indexBits))
+            slot = nullptr;
+    }
+    return slot;
+}
+
+}
+
+#endif
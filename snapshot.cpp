@@ -0,0 +1,172 @@
+// See the file COPYRIGHT.txt for authors and copyright information.
+// See the file LICENSE.txt for copying conditions.
+
+#include "snapshot.h"
+#include "message.h"
+#include "protocol.h"
+#include <algorithm>
+#include <cstring>
+
+namespace net
+{
+
+namespace
+{
+
+// Unchanged runs shorter than this are sent along with the changed bytes, since a new run would cost more
+const std::size_t minUnchangedRun = 4;
+
+// Deltas can't make snapshots bigger than this, since the zeros past the baseline cost nothing to send
+const std::uint64_t maxSnapshotSize = 64 * 1024 * 1024;
+
+// Big-endian, the same as sf::Packet
+void appendUint32(sf::Uint32 value, std::vector<char>& buffer)
+{
+    for (std::size_t i = 0; i < sizeof(value); ++i)
+        buffer.push_back(static_cast<char>((value >> (8 * (sizeof(value) - 1 - i))) & 0xFF));
+}
+
+// Copies bytes from the baseline, with zeros past its end
+void copyBaseline(const char* baseline, std::size_t baselineSize, std::size_t position, std::size_t count, char* output)
+{
+    std::size_t copied = (position < baselineSize ? std::min(count, baselineSize - position) : 0);
+    if (copied > 0)
+        std::memcpy(output, baseline + position, copied);
+    if (count > copied)
+        std::memset(output + copied, 0, count - copied);
+}
+
+}
+
+void encodeDelta(const char* baseline, std::size_t baselineSize, const char* target, std::size_t targetSize,
+    std::vector<char>& output)
+{
+    auto unchanged = [&](std::size_t i)
+    {
+        return (target[i] == (i < baselineSize ? baseline[i] : 0));
+    };
+
+    // The unchanged bytes at the end aren't written, they are copied from the baseline anyway
+    MessageWriter writer(output, 0);
+    writer.writeVarint(targetSize);
+    std::size_t i = 0;
+    while (i < targetSize)
+    {
+        auto start = i;
+        while (i < targetSize && unchanged(i))
+            ++i;
+        if (i < targetSize)
+        {
+            // Find the end of the changed bytes, going over any short unchanged runs in between
+            auto changedStart = i;
+            auto changedEnd = i;
+            while (i < targetSize)
+            {
+                if (!unchanged(i))
+                    changedEnd = ++i;
+                else
+                {
+                    auto gapEnd = i;
+                    while (gapEnd < targetSize && gapEnd - i < minUnchangedRun && unchanged(gapEnd))
+                        ++gapEnd;
+                    if (gapEnd == targetSize || gapEnd - i >= minUnchangedRun)
+                        break;
+                    i = gapEnd;
+                }
+            }
+            writer.writeVarint(changedStart - start);
+            writer.writeBytes(target + changedStart, changedEnd - changedStart);
+            i = changedEnd;
+        }
+    }
+}
+
+bool applyDelta(const char* baseline, std::size_t baselineSize, const char* delta, std::size_t deltaSize,
+    std::vector<char>& output)
+{
+    MessageReader reader(delta, deltaSize, 0);
+    std::uint64_t size = 0;
+    bool status = (reader.readVarint(size) && size <= maxSnapshotSize);
+    output.resize(status ? static_cast<std::size_t>(size) : 0);
+    std::size_t position = 0;
+    while (status && reader.readVarint(size))
+    {
+        // Each run is the unchanged bytes, and then the changed ones
+        BytesView changed;
+        status = (size <= output.size() - position && reader.readBytes(changed) &&
+            changed.size <= output.size() - position - size);
+        if (status)
+        {
+            copyBaseline(baseline, baselineSize, position, static_cast<std::size_t>(size), output.data() + position);
+            position += static_cast<std::size_t>(size);
+            if (changed.size > 0)
+                std::memcpy(output.data() + position, changed.data, changed.size);
+            position += changed.size;
+        }
+    }
+    if (status)
+        copyBaseline(baseline, baselineSize, position, output.size() - position, output.data() + position);
+    return status;
+}
+
+SharedFrame makeSnapshotFrame(SnapshotId id, SnapshotId baselineId, const std::vector<char>* baseline,
+    const std::vector<char>& target)
+{
+    // The frame header is filled in once the size is known
+    auto frame = std::make_shared<std::vector<char> >(frameHeaderSize);
+    appendUint32(static_cast<sf::Uint32>(Snapshot), *frame);
+    appendUint32(id, *frame);
+    appendUint32(baseline ? baselineId : 0, *frame);
+    encodeDelta((baseline ? baseline->data() : nullptr), (baseline ? baseline->size() : 0), target.data(), target.size(), *frame);
+    auto size = static_cast<sf::Uint32>(frame->size() - frameHeaderSize);
+    for (std::size_t i = 0; i < frameHeaderSize; ++i)
+        (*frame)[i] = static_cast<char>((size >> (8 * (frameHeaderSize - 1 - i))) & 0xFF);
+    return frame;
+}
+
+SnapshotHistory::SnapshotHistory(std::size_t capacity):
+    capacity(std::max<std::size_t>(capacity, 1))
+{
+}
+
+void SnapshotHistory::setCapacity(std::size_t capacity)
+{
+    this->capacity = std::max<std::size_t>(capacity, 1);
+    while (snapshots.size() > this->capacity)
+        snapshots.pop_front();
+}
+
+std::vector<char>& SnapshotHistory::add(SnapshotId id)
+{
+    // The oldest snapshot's buffer keeps its memory for the new one
+    std::vector<char> data;
+    if (snapshots.size() >= capacity)
+    {
+        data.swap(snapshots.front().data);
+        snapshots.pop_front();
+    }
+    data.clear();
+    snapshots.emplace_back();
+    snapshots.back().id = id;
+    snapshots.back().data.swap(data);
+    return snapshots.back().data;
+}
+
+const std::vector<char>* SnapshotHistory::find(SnapshotId id) const
+{
+    // There are only a few, and the newest ones are the most likely to be asked for
+    const std::vector<char>* data = nullptr;
+    for (auto it = snapshots.rbegin(); it != snapshots.rend() && !data && id != 0; ++it)
+    {
+        if (it->id == id)
+            data = &it->data;
+    }
+    return data;
+}
+
+void SnapshotHistory::clear()
+{
+    snapshots.clear();
+}
+
+}
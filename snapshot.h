@@ -0,0 +1,69 @@
+// See the file COPYRIGHT.txt for authors and copyright information.
+// See the file LICENSE.txt for copying conditions.
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <deque>
+#include <vector>
+#include <SFML/Network.hpp>
+#include "frame.h"
+
+namespace net
+{
+
+/*
+Snapshots are packets of state (like the whole game world) that are sent over and over, where most of
+    the data doesn't change from one to the next.
+TcpServer::sendSnapshot() keeps the last few snapshots, and each client acks the snapshots it gets.
+    A client is then sent a delta against the last snapshot it acked, instead of the whole thing.
+    Clients that acked the same snapshot share the same encoded delta, so a delta is only made once
+    for each baseline. Clients without a usable baseline get the whole snapshot, which is a delta
+    against nothing.
+net::Client rebuilds the snapshots, acks them, and handles them like any other packet, so they go to
+    the callbacks of their packet type.
+A delta is the new size, followed by runs of unchanged bytes that are copied from the baseline, and
+    the bytes that changed. Bytes past the end of the baseline count as zeros.
+*/
+
+using SnapshotId = sf::Uint32; // 0 is never a valid snapshot
+
+const std::size_t defaultSnapshotHistory = 32; // Snapshots kept by each side
+
+// Appends a delta that turns the baseline into the target
+void encodeDelta(const char* baseline, std::size_t baselineSize, const char* target, std::size_t targetSize,
+    std::vector<char>& output);
+
+// Replaces the output with the target made from a baseline and a delta, returns false if the delta is invalid
+bool applyDelta(const char* baseline, std::size_t baselineSize, const char* delta, std::size_t deltaSize,
+    std::vector<char>& output);
+
+// Frames a Snapshot control packet (see protocol.h), with the delta from the baseline to the target
+SharedFrame makeSnapshotFrame(SnapshotId id, SnapshotId baselineId, const std::vector<char>* baseline,
+    const std::vector<char>& target);
+
+// The most recent snapshots, the oldest ones are dropped when it's full
+// The memory of the dropped snapshots is reused, so once it's full adding doesn't allocate
+class SnapshotHistory
+{
+    public:
+        SnapshotHistory(std::size_t capacity = defaultSnapshotHistory);
+        void setCapacity(std::size_t capacity); // At least 1
+        std::vector<char>& add(SnapshotId id); // Returns an empty buffer to put the snapshot's data in
+        const std::vector<char>* find(SnapshotId id) const; // Returns null if it isn't kept anymore
+        void clear();
+
+    private:
+        struct Snapshot
+        {
+            SnapshotId id;
+            std::vector<char> data;
+        };
+
+        std::deque<Snapshot> snapshots; // From oldest to newest
+        std::size_t capacity;
+};
+
+}
+
+#endif
@@ -2,17 +2,87 @@
 // See the file LICENSE.txt for copying conditions.
 
 #include "tcpserver.h"
+#include "protocol.h"
+#include "nativesocket.h"
+#include <algorithm>
+#include <limits>
+#include <chrono>
+#include <cmath>
 
 namespace net
 {
 
+TcpServer::TimedClient::TimedClient():
+    id(-1),
+    idleTimer(0),
+    heartbeatTimer(0),
+    smoothedRtt(0.0),
+    rttVariance(0.0),
+    hasRtt(false),
+    sendOffset(0),
+    sendQueueSize(0),
+    bufferedPackets(0),
+    bufferedSince(0),
+    compressed(false),
+    closing(false),
+    ackedSnapshot(0),
+    throttled(false)
+{
+}
+
+TcpServer::Shard::Shard(unsigned index, unsigned count, EventBackend::Type type):
+    index(index),
+    backend(EventBackend::create(type)),
+    clients(getMaxKey(count)),
+    receiveSize(0)
+{
+}
+
+TcpServer::EventQueue::EventQueue(std::size_t size):
+    events(size),
+    sleeping(false)
+{
+}
+
 TcpServer::TcpServer():
-    lastId(0),
+    running(false),
+    callbackLocking(true),
+    dispatchMode(Inline),
+    workerCount(0),
+    workersRunning(false),
+    draining(false),
+    drainingShards(0),
+    drainDeadline(0),
+    backendType(EventBackend::Default),
+    nextShard(0),
+    clientCount(0),
     listenerAdded(false),
-    connectionLimit(maxConnections),
-    timeout(0.0f)
+    connectionLimit(0),
+    connectionLimitSet(false),
+    sendQueueLimit(defaultSendQueueLimit),
+    overflowPolicy(Block),
+    blockTimeout(defaultBlockTimeout),
+    batchSize(0),
+    batchDelay(defaultBatchDelay),
+    compressionEnabled(false),
+    packetRate(0.0f),
+    byteRate(0.0f),
+    connectionRate(0.0f),
+    rateBurst(defaultRateBurst / 1000.0f),
+    connectionBurst(defaultRateBurst / 1000.0f),
+    ratePolicy(Block),
+    maxPacketSize(0),
+    nextConnectionPrune(0),
+    snapshotsSent(false),
+    lastSnapshot(0),
+    timeout(0.0f),
+    heartbeatInterval(0),
+    heartbeatTimeout(defaultHeartbeatTimeout)
 {
-    listener.setBlocking(true);
+    // The listener needs to be non-blocking, since it is drained every time it is ready
+    listener.setBlocking(false);
+    createShards(1);
+    connectionLimit = getMaxConnections();
 }
 
 TcpServer::TcpServer(unsigned short port):
@@ -32,20 +102,52 @@ TcpServer::TcpServer(unsigned short port, CallbackType c1, CallbackType c2, Pack
 
 TcpServer::~TcpServer()
 {
-    // Wait for the thread to finish if it is running
+    // Wait for the threads to finish if they are running
     running = false;
     join();
 }
 
 void TcpServer::setListeningPort(unsigned short port)
 {
-    listener.listen(port);
+    // The listener is always handled by the first shard
+    auto& shard = *shards.front();
+    LockType lock(shard.mutex);
+    // Listening again replaces the socket, so the old one needs to be removed first
+    if (listenerAdded)
+        shard.backend->remove(listener);
     // Only add the listener after it starts listening on a port
-    if (!listenerAdded)
+    listenerAdded = (listener.listen(port) == sf::Socket::Done && shard.backend->add(listener, listenerId));
+}
+
+bool TcpServer::adoptListener(const std::string& path, sf::Time timeout)
+{
+    // The shard isn't locked while waiting, since the other server might take a while
+    sf::SocketHandle handle;
+    bool status = receiveHandle(path, timeout, handle);
+    if (status)
     {
-        selector.add(listener);
-        listenerAdded = true;
+        auto& shard = *shards.front();
+        LockType lock(shard.mutex);
+        if (listenerAdded)
+            shard.backend->remove(listener);
+        // SFML only takes a handle when the socket doesn't have one yet
+        listener.close();
+        adoptNativeHandle(listener, handle);
+        listenerAdded = shard.backend->add(listener, listenerId);
+        status = listenerAdded;
     }
+    return status;
+}
+
+bool TcpServer::handOffListener(const std::string& path)
+{
+    // The other server gets its own handle to the socket, so this one can be closed right after
+    auto& shard = *shards.front();
+    LockType lock(shard.mutex);
+    bool status = (listenerAdded && sendHandle(path, getNativeHandle(listener)));
+    if (status)
+        stopListening();
+    return status;
 }
 
 void TcpServer::setConnectedCallback(CallbackType callback)
@@ -63,20 +165,208 @@ void TcpServer::setPacketCallback(PacketCallbackType callback)
     packetCallback = callback;
 }
 
+void TcpServer::setPacketViewCallback(PacketViewCallbackType callback)
+{
+    packetViewCallback = callback;
+}
+
 bool TcpServer::setConnectionLimit(unsigned connections)
 {
     bool status = false;
-    if (connections <= maxConnections)
+    if (connections <= getMaxConnections())
     {
+        auto locks = lockShards();
         connectionLimit = connections;
+        connectionLimitSet = true;
         status = true;
     }
     return status;
 }
 
+void TcpServer::setConnectionLimit()
+{
+    auto locks = lockShards();
+    connectionLimit = getMaxConnections();
+    connectionLimitSet = false;
+}
+
 void TcpServer::setClientTimeout(float t)
 {
+    // Update the idle timers of the existing clients
+    auto locks = lockShards();
     timeout = t;
+    for (auto& shard: shards)
+    {
+        for (auto& client: shard->clients)
+            setIdleTimer(*shard, client);
+        shard->backend->wake();
+    }
+}
+
+void TcpServer::setHeartbeat(sf::Time interval, sf::Time timeout)
+{
+    // Start or stop pinging the existing clients
+    auto locks = lockShards();
+    heartbeatInterval = static_cast<std::uint64_t>(std::max(interval.asMilliseconds(), 0));
+    heartbeatTimeout = static_cast<std::uint64_t>(std::max(timeout.asMilliseconds(), 0));
+    for (auto& shard: shards)
+    {
+        for (auto& client: shard->clients)
+            setHeartbeatTimer(*shard, client);
+        shard->backend->wake();
+    }
+}
+
+void TcpServer::setRateLimit(float packetsPerSecond, float bytesPerSecond, OverflowPolicy policy, sf::Time burst)
+{
+    // Start the existing clients over with full buckets, the throttled ones are resumed by their threads
+    auto locks = lockShards();
+    packetRate = packetsPerSecond;
+    byteRate = bytesPerSecond;
+    ratePolicy = policy;
+    rateBurst = burst.asSeconds();
+    auto now = getTick();
+    for (auto& shard: shards)
+    {
+        for (auto& client: shard->clients)
+            resetRateLimits(client, now);
+        shard->backend->wake();
+    }
+}
+
+void TcpServer::setConnectionRateLimit(float connectionsPerSecond, sf::Time burst)
+{
+    // The buckets are only used while accepting, which is done by the first shard
+    LockType lock(shards.front()->mutex);
+    connectionRate = connectionsPerSecond;
+    connectionBurst = burst.asSeconds();
+    connectionTokens.clear();
+}
+
+void TcpServer::setMaxPacketSize(std::size_t bytes)
+{
+    auto locks = lockShards();
+    maxPacketSize = bytes;
+}
+
+bool TcpServer::setEventBackend(EventBackend::Type type)
+{
+    bool status = false;
+    if (!isRunning())
+    {
+        // Move the listener and any remaining clients over to the new backends
+        backendType = type;
+        for (auto& shard: shards)
+        {
+            LockType lock(shard->mutex);
+            shard->backend = EventBackend::create(type);
+            if (shard->index == 0 && listenerAdded)
+                shard->backend->add(listener, listenerId);
+            for (auto& client: shard->clients)
+                shard->backend->add(*client.socket, client.id);
+        }
+        connectionLimit = (connectionLimitSet ? std::min(connectionLimit, getMaxConnections()) : getMaxConnections());
+        status = (getEventBackend() == type || type == EventBackend::Default);
+    }
+    return status;
+}
+
+EventBackend::Type TcpServer::getEventBackend() const
+{
+    return shards.front()->backend->getType();
+}
+
+unsigned TcpServer::getMaxConnections() const
+{
+    // Every shard can hold the maximum number of sockets, but the listener takes up one of them
+    unsigned long long maxSockets = shards.front()->backend->getMaxSockets();
+    unsigned long long perShard = std::min<unsigned long long>(maxSockets, shards.front()->clients.getMaxSize());
+    unsigned long long total = perShard * shards.size();
+    if (getEventBackend() == EventBackend::Selector)
+    {
+        #ifdef _WIN32
+            // The limit is for each selector, which also holds the wake socket of its shard
+            total = std::min(perShard, maxSockets - 1) * shards.size();
+        #else
+            // FD_SETSIZE limits the socket handles of the whole process, and every shard has two wake sockets
+            total = std::min(perShard, maxSockets - std::min<unsigned long long>(maxSockets, 2 * shards.size()));
+        #endif
+    }
+    total = (total > 0 ? total - 1 : 0);
+    return static_cast<unsigned>(std::min<unsigned long long>(total, std::numeric_limits<unsigned>::max()));
+}
+
+bool TcpServer::setThreadCount(unsigned count)
+{
+    bool status = false;
+    // Every shard needs to be able to hold clients, which stops working with a huge number of them
+    if (count > 0 && ClientMap(getMaxKey(count)).getMaxSize() > 0 && !isRunning() && clientCount == 0)
+    {
+        createShards(count);
+        connectionLimit = (connectionLimitSet ? std::min(connectionLimit, getMaxConnections()) : getMaxConnections());
+        status = true;
+    }
+    return status;
+}
+
+unsigned TcpServer::getThreadCount() const
+{
+    return shards.size();
+}
+
+void TcpServer::setSendQueueLimit(std::size_t bytes, OverflowPolicy policy, sf::Time blockTimeout)
+{
+    auto locks = lockShards();
+    sendQueueLimit = bytes;
+    overflowPolicy = policy;
+    this->blockTimeout = static_cast<std::uint64_t>(std::max(blockTimeout.asMilliseconds(), 0));
+}
+
+void TcpServer::setSendBatching(std::size_t bytes, sf::Time delay)
+{
+    {
+        // The shards are unlocked before flushing, since that can call the disconnected callback
+        auto locks = lockShards();
+        batchSize = bytes;
+        batchDelay = static_cast<std::uint64_t>(std::max(delay.asMilliseconds(), 0));
+    }
+    if (bytes == 0)
+        flush();
+}
+
+bool TcpServer::setCompression(bool enabled, const Compressor& compressor)
+{
+    bool status = (!isRunning() && clientCount == 0);
+    if (status)
+    {
+        compressionEnabled = enabled;
+        this->compressor = compressor;
+    }
+    return status;
+}
+
+bool TcpServer::setDispatchMode(DispatchMode mode, unsigned workers, std::size_t queueSize)
+{
+    bool status = false;
+    if (!isRunning() && queueSize > 0)
+    {
+        dispatchMode = mode;
+        workerCount = workers;
+        eventQueues.clear();
+        if (mode == Queued)
+        {
+            // poll() uses a single queue
+            for (unsigned i = 0; i < std::max(workers, 1u); ++i)
+                eventQueues.emplace_back(new EventQueue(queueSize));
+        }
+        status = true;
+    }
+    return status;
+}
+
+TcpServer::DispatchMode TcpServer::getDispatchMode() const
+{
+    return dispatchMode;
 }
 
 TcpServer::LockType TcpServer::getLock()
@@ -84,216 +374,1555 @@ TcpServer::LockType TcpServer::getLock()
     return LockType(callbackMutex);
 }
 
+void TcpServer::setCallbackLocking(bool enabled)
+{
+    callbackLocking = enabled;
+}
+
+unsigned TcpServer::poll()
+{
+    unsigned count = 0;
+    if (dispatchMode == Queued && workerCount == 0)
+    {
+        // Only handle what fits in the queue, so this still returns if the events keep coming
+        auto& queue = *eventQueues.front();
+        while (count < queue.events.capacity() && handleQueuedEvent(queue))
+            ++count;
+    }
+    return count;
+}
+
 bool TcpServer::send(sf::Packet& packet, int id)
 {
-    bool status = false;
-    LockType lock(internalMutex);
-    auto found = clients.find(id);
-    if (clientIsConnected(found))
-        status = (found->second.socket->send(packet) == sf::Socket::Done);
-    return status;
+    return send(makeFrame(packet), id);
+}
+
+bool TcpServer::send(sf::Packet& packet, const std::vector<int>& ids)
+{
+    return send(makeFrame(packet), ids);
 }
 
 bool TcpServer::sendToAll(sf::Packet& packet, int id)
 {
+    return sendToAll(makeFrame(packet), id);
+}
+
+bool TcpServer::send(const SharedFrame& frame, int id)
+{
+    return send(frame, std::vector<int>(1, id));
+}
+
+bool TcpServer::send(const SharedFrame& frame, const std::vector<int>& ids)
+{
+    bool status = !ids.empty();
+    std::vector<int> kicked;
+    auto compressed = compressFrame(frame);
+    for (int id: ids)
+    {
+        auto shard = findShard(id);
+        bool sent = (shard && sendWhenReady(*shard, id, frame, compressed, kicked));
+        status = (status && sent);
+    }
+    dispatchDisconnected(kicked);
+    return status;
+}
+
+bool TcpServer::sendToAll(const SharedFrame& frame, int id)
+{
+    bool status = true;
+    std::vector<int> kicked;
+    std::vector<int> blocked; // Clients without room in their queues, these are waited for after the shard is unlocked
+    auto compressed = compressFrame(frame);
+    // Only one shard is locked at a time
+    for (auto& shard: shards)
+    {
+        {
+            auto lock = lockShard(*shard);
+            auto& clients = shard->clients;
+            std::size_t i = 0;
+            while (i < clients.size())
+            {
+                // Don't send anything to the excluded client
+                auto& client = clients[i];
+                auto count = clients.size();
+                if (id != client.id && client.socket)
+                {
+                    if (overflowPolicy == Block && !hasQueueRoom(client, frame->size()))
+                        blocked.push_back(client.id);
+                    else if (!send(*shard, client, (client.compressed && compressed ? compressed : frame), kicked))
+                        status = false;
+                }
+                // If the client was kicked, the last client was moved into its place
+                if (clients.size() == count)
+                    ++i;
+            }
+        }
+        for (int blockedId: blocked)
+        {
+            if (!sendWhenReady(*shard, blockedId, frame, compressed, kicked))
+                status = false;
+        }
+        blocked.clear();
+    }
+    dispatchDisconnected(kicked);
+    return status;
+}
+
+bool TcpServer::sendSnapshot(sf::Packet& packet)
+{
+    std::lock_guard<std::mutex> snapshotLock(snapshotMutex);
+    snapshotsSent = true; // The acks are only handled from now on
+    if (++lastSnapshot == 0)
+        lastSnapshot = 1;
+    std::size_t size = 0;
+    auto data = static_cast<const char*>(net::getPacketData(packet, size));
+    auto& target = snapshots.add(lastSnapshot);
+    target.assign(data, data + size);
+
+    // Clients that acked the same snapshot get the same frame, so each delta is only made once
     bool status = true;
-    LockType lock(internalMutex);
-    for (auto& client: clients)
+    std::vector<int> kicked;
+    std::vector<std::pair<int, SharedFrame> > blocked; // Sent after the shard is unlocked, like in sendToAll()
+    snapshotFrames.clear();
+    for (auto& shard: shards)
     {
-        // Don't send anything to the excluded client
-        if (id != client.first && client.second.socket)
         {
-            if (client.second.socket->send(packet) != sf::Socket::Done)
+            auto lock = lockShard(*shard);
+            auto& clients = shard->clients;
+            std::size_t i = 0;
+            while (i < clients.size())
+            {
+                auto& client = clients[i];
+                auto count = clients.size();
+                auto baseline = snapshots.find(client.ackedSnapshot);
+                auto baselineId = (baseline ? client.ackedSnapshot : 0);
+                auto found = std::find_if(snapshotFrames.begin(), snapshotFrames.end(),
+                    [&](const std::pair<SnapshotId, SharedFrame>& frame){ return frame.first == baselineId; });
+                if (found == snapshotFrames.end())
+                {
+                    snapshotFrames.emplace_back(baselineId, makeSnapshotFrame(lastSnapshot, baselineId, baseline, target));
+                    found = snapshotFrames.end() - 1;
+                }
+                if (client.socket && overflowPolicy == Block && !hasQueueRoom(client, found->second->size()))
+                    blocked.emplace_back(client.id, found->second);
+                else if (client.socket && !send(*shard, client, found->second, kicked))
+                    status = false;
+                // If the client was kicked, the last client was moved into its place
+                if (clients.size() == count)
+                    ++i;
+            }
+        }
+        for (auto& frame: blocked)
+        {
+            if (!sendWhenReady(*shard, frame.first, frame.second, nullptr, kicked))
                 status = false;
         }
+        blocked.clear();
+    }
+    snapshotFrames.clear();
+    dispatchDisconnected(kicked);
+    return status;
+}
+
+void TcpServer::setSnapshotHistory(std::size_t count)
+{
+    std::lock_guard<std::mutex> snapshotLock(snapshotMutex);
+    snapshots.setCapacity(count);
+}
+
+bool TcpServer::flush()
+{
+    bool status = true;
+    std::vector<int> kicked;
+    for (auto& shard: shards)
+    {
+        auto lock = lockShard(*shard);
+        if (!flushBuffers(*shard, true, kicked))
+            status = false;
+    }
+    dispatchDisconnected(kicked);
+    return status;
+}
+
+bool TcpServer::flush(int id)
+{
+    bool status = false;
+    std::vector<int> kicked;
+    auto shard = findShard(id);
+    if (shard)
+    {
+        // The client stays in the list of buffered clients, it is just skipped if the buffer is empty
+        auto lock = lockForSending(*shard, id, 0, kicked);
+        auto client = findClient(*shard, id);
+        status = (client && flushBuffer(*shard, *client, kicked));
     }
+    dispatchDisconnected(kicked);
     return status;
 }
 
 void TcpServer::start()
 {
-    if (!serverThread.joinable())
-        serverThread = std::thread(&TcpServer::serverLoop, this);
+    if (!isRunning())
+    {
+        running = true;
+        draining = false;
+        for (auto& shard: shards)
+            shard->thread = std::thread(&TcpServer::serverLoop, this, std::ref(*shard));
+        if (dispatchMode == Queued && workerCount > 0)
+        {
+            workersRunning = true;
+            for (auto& queue: eventQueues)
+                queue->thread = std::thread(&TcpServer::workerLoop, this, std::ref(*queue));
+        }
+    }
 }
 
 void TcpServer::stop()
 {
     running = false;
     join();
-    LockType lock(internalMutex);
-    selector.clear();
-    selector.add(listener);
-    clients.clear();
+    for (auto& shard: shards)
+    {
+        LockType lock(shard->mutex);
+        shard->backend->clear();
+        if (shard->index == 0 && listenerAdded)
+            shard->backend->add(listener, listenerId);
+        shard->clients.clear();
+        shard->timers.clear();
+        shard->pendingClients.clear();
+        shard->unflushedClients.clear();
+        shard->bufferedClients.clear();
+        shard->compressionAccepts.clear();
+        shard->kickedClients.clear();
+    }
+    clientCount = 0;
 }
 
 void TcpServer::join()
 {
-    if (serverThread.joinable())
-        serverThread.join();
+    for (auto& shard: shards)
+    {
+        // Wake the thread up so it notices sooner if the server was stopped
+        if (!running)
+            shard->backend->wake();
+        if (shard->thread.joinable())
+            shard->thread.join();
+    }
+    // The workers are stopped last, so they still get the events from when the server threads stopped
+    stopWorkers();
+}
+
+void TcpServer::drain(sf::Time timeout)
+{
+    if (isRunning() && !draining)
+    {
+        {
+            auto& shard = *shards.front();
+            LockType lock(shard.mutex);
+            stopListening();
+        }
+        // The shard threads do the rest, and the last one to run out of clients stops the server
+        drainDeadline = getTick() + static_cast<std::uint64_t>(std::max(timeout.asMilliseconds(), 0));
+        drainingShards = shards.size();
+        draining = true;
+        for (auto& shard: shards)
+            shard->backend->wake();
+    }
+    else if (!isRunning())
+        stop();
+}
+
+bool TcpServer::isDraining() const
+{
+    return (draining && running);
 }
 
 sf::IpAddress TcpServer::getClientAddress(int id) const
 {
     sf::IpAddress ip;
-    LockType lock(internalMutex);
-    auto found = clients.find(id);
-    if (clientIsConnected(found))
-        ip = found->second.socket->getRemoteAddress();
+    auto shard = findShard(id);
+    if (shard)
+    {
+        auto lock = lockShard(*shard);
+        auto client = findClient(*shard, id);
+        if (clientIsConnected(client))
+            ip = client->socket->getRemoteAddress();
+    }
     return ip;
 }
 
 void TcpServer::kickClient(int id)
 {
-    // Remove the client (which also disconnects them)
-    LockType lock(internalMutex);
-    removeClient(clients.find(id));
+    auto shard = findShard(id);
+    if (shard)
+    {
+        // Remove the client (which also disconnects them)
+        std::vector<int> kicked;
+        {
+            auto lock = lockShard(*shard);
+            auto client = findClient(*shard, id);
+            if (client)
+            {
+                removeClient(*shard, *client);
+                addKickedClient(*shard, id, kicked);
+            }
+        }
+        // Call the callback after unlocking the shard, the same as the server threads do
+        dispatchDisconnected(kicked);
+    }
 }
 
 bool TcpServer::clientIsConnected(int id) const
 {
-    LockType lock(internalMutex);
-    return clientIsConnected(clients.find(id));
+    bool status = false;
+    auto shard = findShard(id);
+    if (shard)
+    {
+        auto lock = lockShard(*shard);
+        status = clientIsConnected(findClient(*shard, id));
+    }
+    return status;
 }
 
-void TcpServer::serverLoop()
+sf::Time TcpServer::getClientRtt(int id) const
 {
-    running = true;
-    while (running)
+    sf::Time rtt;
+    auto shard = findShard(id);
+    if (shard)
     {
-        // Don't wait forever on the selector, so that the loop can gracefully end
-        if (selector.wait(sf::milliseconds(500)))
-        {
-            LockType lock(internalMutex);
-            if (selector.isReady(listener))
-                acceptNewClient();
-            else
-                receive();
-        }
-        else
+        auto lock = lockShard(*shard);
+        auto client = findClient(*shard, id);
+        if (client)
+            rtt = sf::microseconds(static_cast<sf::Int64>(client->smoothedRtt + 0.5));
+    }
+    return rtt;
+}
+
+sf::Time TcpServer::getClientJitter(int id) const
+{
+    sf::Time jitter;
+    auto shard = findShard(id);
+    if (shard)
+    {
+        auto lock = lockShard(*shard);
+        auto client = findClient(*shard, id);
+        if (client)
+            jitter = sf::microseconds(static_cast<sf::Int64>(client->rttVariance + 0.5));
+    }
+    return jitter;
+}
+
+TcpServer::TimerId TcpServer::addTimer(int id, sf::Time delay, CallbackType callback)
+{
+    TimerId timer = 0;
+    auto shard = findShard(id);
+    if (shard && callback)
+    {
+        auto lock = lockShard(*shard);
+        if (findClient(*shard, id))
         {
-            LockType lock(internalMutex);
-            receive();
-            // Just to remove old connections
+            Timer newTimer;
+            newTimer.id = id;
+            newTimer.callback = callback;
+            newTimer.heartbeat = false;
+            auto delayTicks = static_cast<std::uint64_t>(std::max(delay.asMilliseconds(), 0));
+            timer = shard->timers.add(getTick() + delayTicks, newTimer);
+            // The shard might be waiting for longer than the delay
+            shard->backend->wake();
         }
     }
+    return timer;
+}
+
+ServerMetrics TcpServer::getMetrics() const
+{
+    // Add up the counters of every thread, they can be read without locking anything
+    ServerMetrics total;
+    for (auto& shard: shards)
+    {
+        auto& metrics = shard->metrics;
+        total.packetsReceived += metrics.packetsReceived.get();
+        total.bytesReceived += metrics.bytesReceived.get();
+        total.packetsSent += metrics.packetsSent.get();
+        total.bytesSent += metrics.bytesSent.get();
+        total.sendFailures += metrics.sendFailures.get();
+        total.clientsAccepted += metrics.clientsAccepted.get();
+        total.clientsRejected += metrics.clientsRejected.get();
+        total.clientsDisconnected += metrics.clientsDisconnected.get();
+        total.packetsLimited += metrics.packetsLimited.get();
+        total.lockWaits += metrics.lockWaits.get();
+        total.lockWaitTime += metrics.lockWaitTime.get();
+        metrics.callbackTime.addTo(total.callbackTime);
+        metrics.sendQueueSize.addTo(total.sendQueueSize);
+    }
+    for (auto& queue: eventQueues)
+        queue->callbackTime.addTo(total.callbackTime);
+    return total;
 }
 
-void TcpServer::receive()
+bool TcpServer::getClientMetrics(int id, ClientMetrics& metrics) const
 {
-    // Loop through all of the sockets, and receive any data
-    auto clientIter = clients.begin();
-    while (clientIter != clients.end())
+    bool status = false;
+    auto shard = findShard(id);
+    if (shard)
     {
-        bool shouldRemoveClient = false;
-        auto& timer = clientIter->second.timer;
-        if (clientIter->second.socket)
+        auto lock = lockShard(*shard);
+        auto client = findClient(*shard, id);
+        if (client)
         {
-            auto& client = *(clientIter->second.socket);
-            shouldRemoveClient = (client.getRemotePort() == 0);
-            if (!shouldRemoveClient && selector.isReady(client))
-            {
-                // Try to receive data from the socket
-                sf::Packet packet;
-                auto socketStatus = client.receive(packet);
-                if (socketStatus == sf::Socket::Done)
-                {
-                    timer.restart();
-                    // Handle the received data
-                    if (packetCallback)
-                    {
-                        LockType lock(callbackMutex);
-                        packetCallback(packet, clientIter->first);
-                    }
-                }
-                else if (socketStatus != sf::Socket::NotReady)
-                    shouldRemoveClient = true;
-            }
+            metrics = client->metrics;
+            status = true;
         }
+    }
+    return status;
+}
 
-        // Check if the client has been idle for longer than the timeout
-        if (!shouldRemoveClient && timeout > 0.0f && timer.getElapsedTime().asSeconds() >= timeout)
-            shouldRemoveClient = true;
-
-        // Increment iterator, remove client if it needs to be removed
-        if (shouldRemoveClient)
-            clientIter = removeClient(clientIter);
-        else
-            ++clientIter;
+bool TcpServer::cancelTimer(int id, TimerId timer)
+{
+    bool status = false;
+    auto shard = findShard(id);
+    if (shard)
+    {
+        // Only the client's own timers from addTimer() can be cancelled, not the idle timeout or the heartbeat
+        auto lock = lockShard(*shard);
+        auto data = shard->timers.find(timer);
+        status = (data && data->id == id && data->callback && shard->timers.remove(timer));
     }
+    return status;
 }
 
-void TcpServer::acceptNewClient()
+void TcpServer::serverLoop(Shard& shard)
 {
-    // Accept and add a new client
-    setupClient(tmpClient);
-    if (listener.accept(*tmpClient) == sf::Socket::Done)
+    auto waitTime = sf::milliseconds(idleWaitTime);
+    std::vector<int> kicked; // Clients kicked while sending the write buffers
+    bool drained = false;
+    while (running && !drained)
     {
-        // Gracefully close any new connections over the limit
-        if (clients.size() < connectionLimit)
-            addClient(std::move(tmpClient));
+        // Don't wait forever on the backend, so that the loop can gracefully end
+        bool ready = shard.backend->wait(waitTime);
+        {
+            auto lock = lockShard(shard);
+            for (int id: shard.kickedClients)
+                addEvent(shard, Event::Disconnected, id);
+            shard.kickedClients.clear();
+            addPendingClients(shard);
+            if (ready)
+                receive(shard);
+            sendCompressionAccepts(shard, kicked);
+            retrySends(shard);
+            handleTimers(shard, kicked);
+            flushBuffers(shard, false, kicked);
+            int maxWaitTime = (shard.unflushedClients.empty() && !draining ? idleWaitTime : retryWaitTime);
+            maxWaitTime = resumeThrottledClients(shard, maxWaitTime);
+            if (draining)
+            {
+                drainClients(shard, kicked);
+                drained = (shard.clients.empty() && shard.kickedClients.empty());
+            }
+            for (int id: kicked)
+                addEvent(shard, Event::Disconnected, id);
+            kicked.clear();
+            // Wake up in time for the next timer, to send the write buffers, or to read from the throttled clients
+            // Something that is already due still waits for 1 ms, since the backends wait forever on zero
+            maxWaitTime = std::max(getTimeUntilFlush(shard, maxWaitTime), 1);
+            waitTime = sf::milliseconds(static_cast<int>(shard.timers.getTimeUntilNext(maxWaitTime)));
+        }
+        // The callbacks are called without the shard being locked, so they can use any other shard
+        if (dispatchMode == Queued)
+            queueEvents(shard);
         else
-            tmpClient.reset();
+            dispatchEvents(shard);
     }
+    // The events of the last clients were already handled above, so the workers can be stopped by join()
+    if (drained && --drainingShards == 0)
+        running = false;
 }
 
-int TcpServer::addClient(TcpSocketPtr newClient)
+void TcpServer::receive(Shard& shard)
 {
-    // Generate new ID
-    int id = lastId++;
-
-    // Add to the selector and the map
-    selector.add(*newClient);
-    clients[id].socket = std::move(newClient);
-
-    // Call the client connected callback
-    if (connectedCallback)
+    // Only the sockets that were reported as ready are looked at
+    for (auto& ready: shard.backend->getReady())
     {
-        LockType lock(callbackMutex);
-        connectedCallback(id);
+        if (ready.id == listenerId)
+            acceptNewClients(shard);
+        else
+        {
+            auto client = findClient(shard, ready.id);
+            if (client && ready.writable && !flush(*client))
+            {
+                addEvent(shard, Event::Disconnected, ready.id);
+                removeClient(shard, *client);
+            }
+            else if (client && ready.readable && !client->throttled)
+                receive(shard, *client);
+        }
     }
-    return id;
 }
 
-TcpServer::ClientMap::iterator TcpServer::removeClient(ClientMap::iterator it)
+void TcpServer::receive(Shard& shard, TimedClient& client)
 {
-    if (it != clients.end())
+    if (client.socket)
     {
-        // Remove the socket from the selector, and disconnect it
-        if (it->second.socket)
+        auto& buffer = shard.receiveBuffer;
+
+        // Continue from the partial frame that was left over from last time
+        std::size_t start = shard.receiveSize;
+        std::size_t end = start + client.partialFrame.size();
+        if (buffer.size() < end)
+            buffer.resize(end);
+        std::copy(client.partialFrame.begin(), client.partialFrame.end(), buffer.begin() + start);
+        client.partialFrame.clear();
+
+        // Receive everything that is available on the socket, or until the client goes over its rate limits
+        if (packetRate > 0.0f || byteRate > 0.0f)
         {
-            selector.remove(*it->second.socket);
-            it->second.socket->disconnect();
+            auto now = getTick();
+            client.packetTokens.refill(now);
+            client.byteTokens.refill(now);
         }
+        bool received = false;
+        bool valid = true;
+        bool throttled = isThrottled(client);
+        auto socketStatus = sf::Socket::Done;
+        while (socketStatus == sf::Socket::Done && valid && !throttled)
+        {
+            if (buffer.size() < end + receiveChunkSize)
+                buffer.resize(end + receiveChunkSize);
+            std::size_t size = 0;
+            socketStatus = client.socket->receive(&buffer[end], receiveChunkSize, size);
+            end += size;
+            shard.metrics.bytesReceived.add(size);
+            if (metricsEnabled)
+                client.metrics.bytesReceived += size;
+
+            // Find all of the complete packets, these will be passed to the callbacks right where they are
+            std::size_t packetSize = 0;
+            while (valid && findFrame(&buffer[start], end - start, packetSize))
+            {
+                auto offset = start + frameHeaderSize;
+                start = offset + packetSize;
+                valid = (maxPacketSize == 0 || packetSize <= maxPacketSize);
+                if (valid && takeTokens(shard, client, packetSize, valid))
+                    valid = receiveFrame(shard, client, offset, packetSize);
+                received = true;
+                shard.metrics.packetsReceived.add();
+                if (metricsEnabled)
+                    ++client.metrics.packetsReceived;
+            }
 
-        // Save the ID
-        int id = it->first;
+            // A packet that is too big is found from its header, so the rest of it is never buffered
+            if (valid && maxPacketSize > 0 && end - start >= frameHeaderSize)
+                valid = (packetSize <= maxPacketSize);
+            throttled = isThrottled(client);
+        }
 
-        // Remove the smart pointer from the map
-        it = clients.erase(it);
+        // Save the incomplete frame for the next time
+        client.partialFrame.assign(buffer.begin() + start, buffer.begin() + end);
+        shard.receiveSize = start;
 
-        // Call the client disconnected callback
-        if (disconnectedCallback)
+        // Clients that send invalid compressed packets are disconnected too
+        if (!valid || (socketStatus != sf::Socket::NotReady && socketStatus != sf::Socket::Partial))
         {
-            LockType lock(callbackMutex);
-            disconnectedCallback(id);
+            addEvent(shard, Event::Disconnected, client.id);
+            removeClient(shard, client);
+        }
+        else
+        {
+            if (received)
+                client.lastActive = clock.getElapsedTime(); // The idle timer checks this when it expires
+            if (throttled)
+                throttleClient(shard, client);
         }
     }
-    return it;
 }
 
-void TcpServer::setupClient(TcpSocketPtr& client)
+bool TcpServer::receiveFrame(Shard& shard, TimedClient& client, std::size_t offset, std::size_t size)
 {
-    if (!client)
+    // Compression requests are answered by the server, and compressed packets are decompressed into their own buffer
+    bool status = true;
+    sf::Int32 type = 0;
+    auto data = shard.receiveBuffer.data() + offset;
+    readPacketType(data, size, type);
+    // Control packets of features that are off are passed to the callbacks like any other packet
+    if (type == CompressionRequest && compressionEnabled && size >= 2 * sizeof(sf::Int32))
     {
-        // Create a new TcpSocket in non-blocking mode
-        client.reset(new sf::TcpSocket());
-        client->setBlocking(true);
+        sf::Int32 dictionaryId = 0;
+        readPacketType(data + sizeof(sf::Int32), size - sizeof(sf::Int32), dictionaryId);
+        if (!client.compressed && static_cast<sf::Uint32>(dictionaryId) == compressor.getDictionaryId())
+        {
+            client.compressed = true;
+            shard.compressionAccepts.push_back(client.id);
+        }
+    }
+    else if (type == SnapshotAck && snapshotsSent && size >= 2 * sizeof(sf::Int32))
+    {
+        // Only newer acks are kept, and an ID the server doesn't have anymore just means a whole snapshot is sent
+        sf::Int32 id = 0;
+        readPacketType(data + sizeof(sf::Int32), size - sizeof(sf::Int32), id);
+        auto acked = static_cast<SnapshotId>(id);
+        if (acked == 0 || acked > client.ackedSnapshot)
+            client.ackedSnapshot = acked;
+    }
+    else if (type == Pong && heartbeatInterval > 0 && size >= 2 * sizeof(sf::Int32))
+    {
+        sf::Int32 timestamp = 0;
+        readPacketType(data + sizeof(sf::Int32), size - sizeof(sf::Int32), timestamp);
+        updateRtt(client, static_cast<sf::Uint32>(timestamp));
+    }
+    else if (type == Compressed && client.compressed)
+    {
+        auto start = shard.decompressBuffer.size();
+        // The size limit applies to the decompressed packet too, so a small packet can't make it allocate a lot
+        status = compressor.decompressPacket(data, size, shard.decompressBuffer, maxPacketSize);
+        if (status)
+        {
+            auto& event = addEvent(shard, Event::Received, client.id);
+            event.offset = start;
+            event.size = shard.decompressBuffer.size() - start;
+            event.decompressed = true;
+        }
+    }
+    else
+    {
+        auto& event = addEvent(shard, Event::Received, client.id);
+        event.offset = offset;
+        event.size = size;
+    }
+    return status;
+}
+
+bool TcpServer::takeTokens(Shard& shard, TimedClient& client, std::size_t size, bool& valid)
+{
+    // A packet is allowed while there are any tokens left, and then costs all of them
+    // With the Block policy, the packets that were already read are always allowed, since the client is throttled after
+    bool available = (client.packetTokens.hasTokens() && client.byteTokens.hasTokens());
+    bool allowed = (available || ratePolicy == Block);
+    if (allowed)
+    {
+        client.packetTokens.take(1.0);
+        client.byteTokens.take(static_cast<double>(size + frameHeaderSize));
+    }
+    if (!available)
+    {
+        valid = (ratePolicy != Kick);
+        shard.metrics.packetsLimited.add();
+    }
+    return (allowed && valid);
+}
+
+bool TcpServer::isThrottled(TimedClient& client) const
+{
+    return (ratePolicy == Block && (!client.packetTokens.hasTokens() || !client.byteTokens.hasTokens()));
+}
+
+void TcpServer::throttleClient(Shard& shard, TimedClient& client)
+{
+    if (!client.throttled)
+    {
+        client.throttled = true;
+        shard.throttledClients.push_back(client.id);
+        // The selector would keep reporting the unread data, but the edge-triggered backend only reports new data
+        if (!shard.backend->hasWriteEvents())
+            shard.backend->remove(*client.socket);
+    }
+}
+
+int TcpServer::resumeThrottledClients(Shard& shard, int maxWaitTime)
+{
+    // Reading can throttle the clients again, so they are moved to another list first
+    auto now = getTick();
+    std::uint64_t waitTime = static_cast<std::uint64_t>(maxWaitTime);
+    shard.resumingClients.swap(shard.throttledClients);
+    for (int id: shard.resumingClients)
+    {
+        auto client = findClient(shard, id);
+        if (client && client->throttled)
+        {
+            client->packetTokens.refill(now);
+            client->byteTokens.refill(now);
+            if (isThrottled(*client))
+            {
+                shard.throttledClients.push_back(id);
+                waitTime = std::min(waitTime, std::max(client->packetTokens.getTimeUntilTokens(),
+                    client->byteTokens.getTimeUntilTokens()));
+            }
+            else
+            {
+                client->throttled = false;
+                if (!shard.backend->hasWriteEvents())
+                    shard.backend->add(*client->socket, id);
+                receive(shard, *client);
+            }
+        }
+    }
+    shard.resumingClients.clear();
+    return static_cast<int>(waitTime);
+}
+
+void TcpServer::resetRateLimits(TimedClient& client, std::uint64_t now)
+{
+    client.packetTokens.reset(packetRate, packetRate * rateBurst, now);
+    client.byteTokens.reset(byteRate, byteRate * rateBurst, now);
+}
+
+bool TcpServer::allowConnection(const sf::TcpSocket& socket)
+{
+    bool allowed = true;
+    if (connectionRate > 0.0f)
+    {
+        // The buckets that filled back up are the same as new ones, so they are removed once in a while
+        auto now = getTick();
+        if (now >= nextConnectionPrune)
+        {
+            for (auto it = connectionTokens.begin(); it != connectionTokens.end(); )
+            {
+                it->second.refill(now);
+                if (it->second.isFull())
+                    it = connectionTokens.erase(it);
+                else
+                    ++it;
+            }
+            nextConnectionPrune = now + idleWaitTime;
+        }
+        auto inserted = connectionTokens.emplace(socket.getRemoteAddress().toInteger(), TokenBucket());
+        auto& bucket = inserted.first->second;
+        if (inserted.second)
+            bucket.reset(connectionRate, connectionRate * connectionBurst, now);
+        else
+            bucket.refill(now);
+        allowed = bucket.hasTokens();
+        if (allowed)
+            bucket.take(1.0);
+    }
+    return allowed;
+}
+
+void TcpServer::handleTimers(Shard& shard, std::vector<int>& kicked)
+{
+    auto& expired = shard.expiredTimers;
+    shard.timers.advance(getTick(), expired);
+    for (auto& timer: expired)
+    {
+        auto client = findClient(shard, timer.id);
+        if (client)
+        {
+            if (timer.callback)
+            {
+                // The callback is called later with the other events
+                auto& event = addEvent(shard, Event::TimerExpired, timer.id);
+                event.offset = shard.timerCallbacks.size();
+                shard.timerCallbacks.push_back(std::move(timer.callback));
+            }
+            else if (timer.heartbeat)
+                handleHeartbeat(shard, *client, kicked);
+            else
+            {
+                // The idle timer isn't moved every time data is received, so the client may have been active since
+                client->idleTimer = 0;
+                auto expiry = client->lastActive + sf::seconds(timeout);
+                if (timeout > 0.0f && expiry <= clock.getElapsedTime())
+                {
+                    addEvent(shard, Event::Disconnected, timer.id);
+                    removeClient(shard, *client);
+                }
+                else
+                    setIdleTimer(shard, *client);
+            }
+        }
+    }
+    expired.clear();
+}
+
+void TcpServer::setIdleTimer(Shard& shard, TimedClient& client)
+{
+    if (client.idleTimer)
+        shard.timers.remove(client.idleTimer);
+    client.idleTimer = 0;
+    if (timeout > 0.0f)
+    {
+        // If the client has already been idle for too long, this expires right away
+        Timer timer;
+        timer.id = client.id;
+        timer.heartbeat = false;
+        auto expiry = (client.lastActive + sf::seconds(timeout)).asMilliseconds();
+        client.idleTimer = shard.timers.add(static_cast<std::uint64_t>(expiry), timer);
+    }
+}
+
+void TcpServer::handleHeartbeat(Shard& shard, TimedClient& client, std::vector<int>& kicked)
+{
+    // Anything received counts, so only clients that have gone completely silent are kicked
+    int id = client.id;
+    client.heartbeatTimer = 0;
+    auto silence = getTick() - static_cast<std::uint64_t>(client.lastActive.asMilliseconds());
+    if (heartbeatTimeout > 0 && silence >= heartbeatTimeout)
+    {
+        addEvent(shard, Event::Disconnected, client.id);
+        removeClient(shard, client);
+    }
+    else
+    {
+        if (!client.closing)
+        {
+            sf::Packet packet;
+            makeControlPacket(packet, Ping);
+            packet << getTimestamp() << static_cast<sf::Uint32>(client.smoothedRtt + 0.5)
+                << static_cast<sf::Uint32>(client.rttVariance + 0.5);
+            // The ping skips the write buffer, so the time it waits there isn't measured
+            if (flushBuffer(shard, client, kicked) && findClient(shard, id))
+                sendFrame(shard, client, makeFrame(packet), 1, kicked);
+        }
+        // Sending can kick the client, which moves another client into its place
+        auto found = findClient(shard, id);
+        if (found)
+            setHeartbeatTimer(shard, *found);
+    }
+}
+
+void TcpServer::setHeartbeatTimer(Shard& shard, TimedClient& client)
+{
+    if (client.heartbeatTimer)
+        shard.timers.remove(client.heartbeatTimer);
+    client.heartbeatTimer = 0;
+    if (heartbeatInterval > 0)
+    {
+        Timer timer;
+        timer.id = client.id;
+        timer.heartbeat = true;
+        client.heartbeatTimer = shard.timers.add(getTick() + heartbeatInterval, timer);
+    }
+}
+
+void TcpServer::updateRtt(TimedClient& client, sf::Uint32 timestamp)
+{
+    // Smoothed the same way as the UDP channels (see connection.cpp), the subtraction handles the wrap around
+    double sample = static_cast<sf::Uint32>(getTimestamp() - timestamp);
+    if (client.hasRtt)
+    {
+        client.rttVariance = 0.75 * client.rttVariance + 0.25 * std::fabs(client.smoothedRtt - sample);
+        client.smoothedRtt = 0.875 * client.smoothedRtt + 0.125 * sample;
+    }
+    else
+    {
+        client.smoothedRtt = sample;
+        client.rttVariance = sample / 2.0;
+        client.hasRtt = true;
+    }
+}
+
+sf::Uint32 TcpServer::getTimestamp() const
+{
+    return static_cast<sf::Uint32>(clock.getElapsedTime().asMicroseconds());
+}
+
+std::uint64_t TcpServer::getTick() const
+{
+    return static_cast<std::uint64_t>(clock.getElapsedTime().asMilliseconds());
+}
+
+bool TcpServer::send(Shard& shard, TimedClient& client, const SharedFrame& frame, std::vector<int>& kicked)
+{
+    bool status = !client.closing;
+    auto size = frame->size();
+    if (!status)
+    {
+        shard.metrics.sendFailures.add();
+        if (metricsEnabled)
+            ++client.metrics.sendFailures;
+    }
+    else if (size < batchSize)
+    {
+        // The frame is copied into the write buffer, and the shard's thread makes sure it gets sent in time
+        if (client.writeBuffer.empty())
+        {
+            // The client might already be in the list if it was flushed early, which is harmless
+            client.bufferedSince = getTick();
+            shard.bufferedClients.push_back(client.id);
+            if (shard.bufferedClients.size() == 1)
+                shard.backend->wake();
+        }
+        client.writeBuffer.insert(client.writeBuffer.end(), frame->begin(), frame->end());
+        ++client.bufferedPackets;
+        if (client.writeBuffer.size() >= batchSize)
+            status = flushBuffer(shard, client, kicked);
+    }
+    else
+    {
+        // Anything that was batched needs to go first, so the packets stay in order
+        if (!client.writeBuffer.empty())
+            status = flushBuffer(shard, client, kicked);
+        if (status)
+            status = sendFrame(shard, client, frame, 1, kicked);
+    }
+    return status;
+}
+
+bool TcpServer::sendFrame(Shard& shard, TimedClient& client, const SharedFrame& frame, std::size_t packets, std::vector<int>& kicked)
+{
+    auto size = frame->size();
+    bool status = true;
+
+    // Handle the queue being full, a frame bigger than the limit can still go into an empty queue
+    // Senders already waited for room with the Block policy, so here it only fails (like for the pings of the server threads)
+    if (!client.sendQueue.empty() && client.sendQueueSize + size > sendQueueLimit)
+    {
+        status = false;
+        shard.metrics.sendFailures.add();
+        if (metricsEnabled)
+            ++client.metrics.sendFailures;
+        if (overflowPolicy == Kick)
+        {
+            addKickedClient(shard, client.id, kicked);
+            removeClient(shard, client);
+        }
+    }
+
+    if (status)
+    {
+        // Try sending right away, but only if that wouldn't send things out of order
+        std::size_t sent = 0;
+        bool queueEmpty = client.sendQueue.empty();
+        if (queueEmpty)
+        {
+            auto socketStatus = client.socket->send(frame->data(), size, sent);
+            status = (socketStatus == sf::Socket::Done || socketStatus == sf::Socket::Partial ||
+                socketStatus == sf::Socket::NotReady);
+        }
+
+        // Queue the rest of it, which just references the shared frame
+        if (status && sent < size)
+        {
+            if (queueEmpty)
+            {
+                client.sendOffset = sent;
+                if (!shard.backend->hasWriteEvents())
+                {
+                    shard.unflushedClients.push_back(client.id);
+                    shard.backend->wake();
+                }
+            }
+            client.sendQueue.push_back(frame);
+            client.sendQueueSize += size - sent;
+        }
+
+        if (status)
+        {
+            shard.metrics.packetsSent.add(packets);
+            shard.metrics.bytesSent.add(size);
+            shard.metrics.sendQueueSize.add(client.sendQueueSize);
+            if (metricsEnabled)
+            {
+                client.metrics.packetsSent += packets;
+                client.metrics.bytesSent += size;
+            }
+        }
+        else
+        {
+            shard.metrics.sendFailures.add(packets);
+            if (metricsEnabled)
+                client.metrics.sendFailures += packets;
+        }
+    }
+    return status;
+}
+
+bool TcpServer::flushBuffers(Shard& shard, bool all, std::vector<int>& kicked)
+{
+    // Keep the clients whose buffers can still wait
+    bool status = true;
+    auto now = getTick();
+    auto& buffered = shard.bufferedClients;
+    std::size_t kept = 0;
+    for (int id: buffered)
+    {
+        auto client = findClient(shard, id);
+        if (client && !client->writeBuffer.empty())
+        {
+            if (all || now - client->bufferedSince >= batchDelay)
+                status = (flushBuffer(shard, *client, kicked) && status);
+            else
+                buffered[kept++] = id;
+        }
+    }
+    buffered.resize(kept);
+    return status;
+}
+
+bool TcpServer::flushBuffer(Shard& shard, TimedClient& client, std::vector<int>& kicked)
+{
+    // The buffer becomes a frame of its own, and the client starts a new one
+    bool status = true;
+    if (!client.writeBuffer.empty())
+    {
+        auto frame = std::make_shared<std::vector<char> >();
+        frame->swap(client.writeBuffer);
+        auto packets = client.bufferedPackets;
+        client.bufferedPackets = 0;
+        status = sendFrame(shard, client, frame, packets, kicked);
+    }
+    return status;
+}
+
+void TcpServer::drainClients(Shard& shard, std::vector<int>& kicked)
+{
+    // Once a client's data is all sent, it reads the end of the stream and closes the connection itself
+    bool expired = (getTick() >= drainDeadline);
+    auto& clients = shard.clients;
+    std::size_t i = 0;
+    while (i < clients.size())
+    {
+        auto& client = clients[i];
+        auto count = clients.size();
+        if (expired)
+        {
+            addEvent(shard, Event::Disconnected, client.id);
+            removeClient(shard, client);
+        }
+        else if (!client.closing && flushBuffer(shard, client, kicked) && clients.size() == count &&
+            client.sendQueue.empty())
+        {
+            client.closing = true;
+            if (!shutdownSend(*client.socket))
+            {
+                addEvent(shard, Event::Disconnected, client.id);
+                removeClient(shard, client);
+            }
+        }
+        // If the client was removed, the last client was moved into its place
+        if (clients.size() == count)
+            ++i;
+    }
+}
+
+void TcpServer::stopListening()
+{
+    // New connections are refused, instead of waiting in a queue that nothing accepts from
+    if (listenerAdded)
+        shards.front()->backend->remove(listener);
+    listener.close();
+    listenerAdded = false;
+}
+
+int TcpServer::getTimeUntilFlush(Shard& shard, int maxWaitTime) const
+{
+    auto now = getTick();
+    std::uint64_t waitTime = static_cast<std::uint64_t>(maxWaitTime);
+    for (int id: shard.bufferedClients)
+    {
+        auto client = findClient(shard, id);
+        if (client && !client->writeBuffer.empty())
+        {
+            auto expiry = client->bufferedSince + batchDelay;
+            waitTime = std::min(waitTime, (expiry > now ? expiry - now : 1));
+        }
+    }
+    return static_cast<int>(waitTime);
+}
+
+SharedFrame TcpServer::compressFrame(const SharedFrame& frame) const
+{
+    // Only the packet data is compressed, and the result is shared by all of the clients that use compression
+    SharedFrame compressed;
+    if (compressionEnabled && frame->size() >= frameHeaderSize + compressor.getThreshold())
+    {
+        auto buffer = std::make_shared<std::vector<char> >();
+        if (compressor.appendCompressedFrame(frame->data() + frameHeaderSize, frame->size() - frameHeaderSize, *buffer))
+            compressed = buffer;
+    }
+    return compressed;
+}
+
+void TcpServer::sendCompressionAccepts(Shard& shard, std::vector<int>& kicked)
+{
+    if (!shard.compressionAccepts.empty())
+    {
+        sf::Packet packet;
+        makeControlPacket(packet, CompressionAccept);
+        packet << compressor.getDictionaryId();
+        auto frame = makeFrame(packet);
+        for (int id: shard.compressionAccepts)
+        {
+            auto client = findClient(shard, id);
+            if (client)
+                send(shard, *client, frame, kicked);
+        }
+        shard.compressionAccepts.clear();
     }
 }
 
-bool TcpServer::clientIsConnected(ClientMap::const_iterator it) const
+bool TcpServer::flush(TimedClient& client)
 {
-    return (it != clients.end() && it->second.socket && it->second.socket->getRemotePort() != 0);
+    auto socketStatus = sf::Socket::Done;
+    while (!client.sendQueue.empty() && socketStatus == sf::Socket::Done)
+    {
+        // Send as much of the first frame as possible
+        auto& frame = *client.sendQueue.front();
+        std::size_t sent = 0;
+        socketStatus = client.socket->send(frame.data() + client.sendOffset, frame.size() - client.sendOffset, sent);
+        client.sendOffset += sent;
+        client.sendQueueSize -= sent;
+        if (client.sendOffset == frame.size())
+        {
+            client.sendQueue.pop_front();
+            client.sendOffset = 0;
+        }
+    }
+    return (socketStatus == sf::Socket::Done || socketStatus == sf::Socket::Partial ||
+        socketStatus == sf::Socket::NotReady);
+}
+
+TcpServer::LockType TcpServer::lockForSending(Shard& shard, int id, std::size_t size, std::vector<int>& kicked)
+{
+    auto lock = lockShard(shard);
+    auto client = findClient(shard, id);
+    if (overflowPolicy == Block && clientIsConnected(client) && !hasQueueRoom(*client, size))
+    {
+        // Only the handle is used while unlocked, and if the client is removed meanwhile, it isn't found after locking
+        auto deadline = getTick() + blockTimeout;
+        bool waiting = true;
+        while (waiting)
+        {
+            auto handle = getNativeHandle(*client->socket);
+            auto now = getTick();
+            auto waitTime = std::min<std::uint64_t>(deadline > now ? deadline - now : 0, retryWaitTime);
+            lock.unlock();
+            waitUntilWritable(handle, sf::milliseconds(static_cast<int>(waitTime)));
+            lock.lock();
+            client = findClient(shard, id);
+            if (client && !flush(*client))
+            {
+                // The shard's thread notices the broken connection too, but this sender shouldn't wait for it
+                addKickedClient(shard, id, kicked);
+                removeClient(shard, *client);
+                client = nullptr;
+            }
+            waiting = (clientIsConnected(client) && !hasQueueRoom(*client, size) && getTick() < deadline);
+        }
+
+        // A client that still hasn't made room is too slow to keep
+        if (clientIsConnected(client) && !hasQueueRoom(*client, size))
+        {
+            shard.metrics.sendFailures.add();
+            addKickedClient(shard, id, kicked);
+            removeClient(shard, *client);
+        }
+    }
+    return lock;
+}
+
+bool TcpServer::sendWhenReady(Shard& shard, int id, const SharedFrame& frame, const SharedFrame& compressed,
+    std::vector<int>& kicked)
+{
+    auto lock = lockForSending(shard, id, frame->size(), kicked);
+    auto client = findClient(shard, id);
+    return (clientIsConnected(client) && send(shard, *client, (client->compressed && compressed ? compressed : frame), kicked));
+}
+
+bool TcpServer::hasQueueRoom(const TimedClient& client, std::size_t size) const
+{
+    // Batched data counts too, since it goes into the queue when the buffer is sent
+    return (client.sendQueue.empty() || client.sendQueueSize + client.writeBuffer.size() + size <= sendQueueLimit);
+}
+
+void TcpServer::retrySends(Shard& shard)
+{
+    // Keep the clients that still have data left over in the list
+    auto& unflushed = shard.unflushedClients;
+    auto shouldRemove = [&](int id)
+    {
+        bool remove = true;
+        auto client = findClient(shard, id);
+        if (client)
+        {
+            if (flush(*client))
+                remove = client->sendQueue.empty();
+            else
+            {
+                addEvent(shard, Event::Disconnected, id);
+                removeClient(shard, *client);
+            }
+        }
+        return remove;
+    };
+    unflushed.erase(std::remove_if(unflushed.begin(), unflushed.end(), shouldRemove), unflushed.end());
+}
+
+void TcpServer::acceptNewClients(Shard& shard)
+{
+    // Accept and add new clients until there are none left
+    setupClient(tmpClient);
+    while (listener.accept(*tmpClient) == sf::Socket::Done)
+    {
+        // Gracefully close any new connections over the limits
+        if (clientCount < connectionLimit && allowConnection(*tmpClient))
+        {
+            ++clientCount;
+            shard.metrics.clientsAccepted.add();
+            // Hand the clients out to the shards in order
+            auto& target = *shards[nextShard];
+            nextShard = (nextShard + 1) % shards.size();
+            if (&target == &shard)
+                addClient(shard, std::move(tmpClient));
+            else
+            {
+                {
+                    std::lock_guard<std::mutex> lock(target.pendingMutex);
+                    target.pendingClients.push_back(std::move(tmpClient));
+                }
+                target.backend->wake();
+            }
+        }
+        else
+        {
+            tmpClient.reset();
+            shard.metrics.clientsRejected.add();
+        }
+        setupClient(tmpClient);
+    }
+}
+
+void TcpServer::addPendingClients(Shard& shard)
+{
+    std::lock_guard<std::mutex> lock(shard.pendingMutex);
+    for (auto& client: shard.pendingClients)
+        addClient(shard, std::move(client));
+    shard.pendingClients.clear();
+}
+
+void TcpServer::addClient(Shard& shard, TcpSocketPtr newClient)
+{
+    // Generate the ID from the key, so it always maps back to this shard and slot
+    auto key = shard.clients.insert(TimedClient());
+    int id = (key != ClientMap::invalidKey ? static_cast<int>(key * shards.size() + shard.index) : 0);
+    if (key != ClientMap::invalidKey && shard.backend->add(*newClient, id))
+    {
+        auto& client = *shard.clients.find(key);
+        client.id = id;
+        client.socket = std::move(newClient);
+        client.lastActive = clock.getElapsedTime();
+        resetRateLimits(client, getTick());
+        setIdleTimer(shard, client);
+        setHeartbeatTimer(shard, client);
+        addEvent(shard, Event::Connected, id);
+    }
+    else
+    {
+        // The shard or its backend is full, so the connection is closed
+        if (key != ClientMap::invalidKey)
+            shard.clients.erase(key);
+        --clientCount;
+        shard.metrics.clientsRejected.add();
+    }
+}
+
+void TcpServer::removeClient(Shard& shard, TimedClient& client)
+{
+    // Remove the socket from the backend, and disconnect it
+    if (client.socket)
+    {
+        shard.backend->remove(*client.socket);
+        client.socket->disconnect();
+    }
+
+    // Remove the client from the slot map
+    if (client.idleTimer)
+        shard.timers.remove(client.idleTimer);
+    if (client.heartbeatTimer)
+        shard.timers.remove(client.heartbeatTimer);
+    shard.clients.erase(static_cast<ClientMap::Key>(client.id / shards.size()));
+    --clientCount;
+    shard.metrics.clientsDisconnected.add();
+}
+
+void TcpServer::setupClient(TcpSocketPtr& client)
+{
+    if (!client)
+    {
+        // Create a new TcpSocket in non-blocking mode
+        client.reset(new sf::TcpSocket());
+        client->setBlocking(false);
+    }
+}
+
+bool TcpServer::clientIsConnected(const TimedClient* client) const
+{
+    return (client && client->socket && client->socket->getRemotePort() != 0);
+}
+
+TcpServer::TimedClient* TcpServer::findClient(Shard& shard, int id) const
+{
+    return (id >= 0 ? shard.clients.find(static_cast<ClientMap::Key>(id / shards.size())) : nullptr);
+}
+
+void TcpServer::createShards(unsigned count)
+{
+    // The listener moves to the new first shard
+    if (!shards.empty() && listenerAdded)
+        shards.front()->backend->remove(listener);
+    shards.clear();
+    for (unsigned i = 0; i < count; ++i)
+        shards.emplace_back(new Shard(i, count, backendType));
+    if (listenerAdded)
+        shards.front()->backend->add(listener, listenerId);
+    nextShard = 0;
+}
+
+TcpServer::ClientMap::Key TcpServer::getMaxKey(unsigned count)
+{
+    // So the IDs fit in an int
+    return static_cast<ClientMap::Key>((std::numeric_limits<int>::max() - (count - 1)) / count);
+}
+
+TcpServer::Shard* TcpServer::findShard(int id) const
+{
+    return (id >= 0 ? shards[id % shards.size()].get() : nullptr);
+}
+
+std::vector<TcpServer::LockType> TcpServer::lockShards() const
+{
+    // Only the setters lock more than one shard at a time, and always in the same order
+    std::vector<LockType> locks;
+    for (auto& shard: shards)
+        locks.emplace_back(shard->mutex);
+    return locks;
+}
+
+TcpServer::LockType TcpServer::lockShard(Shard& shard) const
+{
+    LockType lock(shard.mutex, std::defer_lock);
+    if (!metricsEnabled)
+        lock.lock();
+    else if (!lock.try_lock())
+    {
+        // Only waiting is timed, so taking a free lock stays cheap
+        MetricTimer timer;
+        lock.lock();
+        shard.metrics.lockWaits.add();
+        shard.metrics.lockWaitTime.add(timer.getMicroseconds());
+    }
+    return lock;
+}
+
+bool TcpServer::isRunning() const
+{
+    bool status = false;
+    for (auto& shard: shards)
+        status = (status || shard->thread.joinable());
+    return status;
+}
+
+TcpServer::Event& TcpServer::addEvent(Shard& shard, Event::Type type, int id)
+{
+    Event event;
+    event.type = type;
+    event.id = id;
+    event.offset = 0;
+    event.size = 0;
+    event.decompressed = false;
+    shard.events.push_back(event);
+    return shard.events.back();
+}
+
+void TcpServer::dispatchEvents(Shard& shard)
+{
+    for (auto& event: shard.events)
+    {
+        if (event.type == Event::TimerExpired)
+            dispatchTimer(shard.timerCallbacks[event.offset], event.id, shard.metrics.callbackTime);
+        else
+        {
+            // The packet data is still sitting in the receive buffer
+            PacketView view;
+            if (event.type == Event::Received)
+                view = PacketView(getPacketData(shard, event), event.size);
+            dispatchEvent(event.type, event.id, view, shard.packet, shard.metrics.callbackTime);
+        }
+    }
+    shard.events.clear();
+    shard.timerCallbacks.clear();
+    shard.receiveSize = 0;
+    shard.decompressBuffer.clear();
+}
+
+const char* TcpServer::getPacketData(Shard& shard, const Event& event) const
+{
+    auto& buffer = (event.decompressed ? shard.decompressBuffer : shard.receiveBuffer);
+    return buffer.data() + event.offset;
+}
+
+void TcpServer::dispatchEvent(Event::Type type, int id, const PacketView& view, sf::Packet& packet, Histogram& callbackTime)
+{
+    if (type == Event::Connected && connectedCallback)
+    {
+        auto lock = lockCallbacks();
+        MetricTimer timer;
+        connectedCallback(id);
+        callbackTime.add(timer.getMicroseconds());
+    }
+    else if (type == Event::Disconnected && disconnectedCallback)
+    {
+        auto lock = lockCallbacks();
+        MetricTimer timer;
+        disconnectedCallback(id);
+        callbackTime.add(timer.getMicroseconds());
+    }
+    else if (type == Event::Received)
+    {
+        if (packetViewCallback)
+        {
+            auto lock = lockCallbacks();
+            MetricTimer timer;
+            packetViewCallback(view, id);
+            callbackTime.add(timer.getMicroseconds());
+        }
+        else if (packetCallback)
+        {
+            view.copyTo(packet);
+            auto lock = lockCallbacks();
+            MetricTimer timer;
+            packetCallback(packet, id);
+            callbackTime.add(timer.getMicroseconds());
+        }
+    }
+}
+
+void TcpServer::dispatchTimer(const CallbackType& callback, int id, Histogram& callbackTime)
+{
+    auto lock = lockCallbacks();
+    MetricTimer timer;
+    callback(id);
+    callbackTime.add(timer.getMicroseconds());
+}
+
+void TcpServer::dispatchDisconnected(const std::vector<int>& ids)
+{
+    if (disconnectedCallback)
+    {
+        for (int id: ids)
+        {
+            auto lock = lockCallbacks();
+            disconnectedCallback(id);
+        }
+    }
+}
+
+void TcpServer::addKickedClient(Shard& shard, int id, std::vector<int>& kicked)
+{
+    if (dispatchMode == Queued)
+    {
+        // Let the shard's thread queue the event, so it comes after the client's other events
+        shard.kickedClients.push_back(id);
+        shard.backend->wake();
+    }
+    else
+        kicked.push_back(id);
+}
+
+TcpServer::LockType TcpServer::lockCallbacks()
+{
+    LockType lock(callbackMutex, std::defer_lock);
+    if (callbackLocking)
+        lock.lock();
+    return lock;
+}
+
+void TcpServer::queueEvents(Shard& shard)
+{
+    for (auto& event: shard.events)
+        queueEvent(event, shard);
+    shard.events.clear();
+    shard.timerCallbacks.clear();
+    shard.receiveSize = 0;
+    shard.decompressBuffer.clear();
+}
+
+void TcpServer::queueEvent(const Event& event, Shard& shard)
+{
+    auto& queue = *eventQueues[event.id % eventQueues.size()];
+    auto fill = [&](QueuedEvent& queued)
+    {
+        queued.type = event.type;
+        queued.id = event.id;
+        queued.data.clear();
+        if (event.type == Event::Received)
+        {
+            auto start = getPacketData(shard, event);
+            queued.data.assign(start, start + event.size);
+        }
+        else if (event.type == Event::TimerExpired)
+            queued.callback = std::move(shard.timerCallbacks[event.offset]);
+    };
+
+    // If the queue is full, wait for it to be handled instead of losing the event
+    bool queued = queue.events.push(fill);
+    while (!queued && running)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(fullQueueWaitTime));
+        queued = queue.events.push(fill);
+    }
+
+    // Wake up the worker if it is waiting for events
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (queued && queue.sleeping)
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.ready.notify_one();
+    }
+}
+
+bool TcpServer::handleQueuedEvent(EventQueue& queue)
+{
+    return queue.events.pop([&](QueuedEvent& event)
+    {
+        if (event.type == Event::TimerExpired)
+        {
+            dispatchTimer(event.callback, event.id, queue.callbackTime);
+            event.callback = nullptr;
+        }
+        else
+        {
+            PacketView view;
+            if (!event.data.empty())
+                view = PacketView(event.data.data(), event.data.size());
+            dispatchEvent(event.type, event.id, view, queue.packet, queue.callbackTime);
+        }
+    });
+}
+
+void TcpServer::workerLoop(EventQueue& queue)
+{
+    while (workersRunning)
+    {
+        if (!handleQueuedEvent(queue))
+        {
+            // The queue is checked again after setting the flag, so an event can't be missed
+            std::unique_lock<std::mutex> lock(queue.mutex);
+            queue.sleeping = true;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (queue.events.empty() && workersRunning)
+                queue.ready.wait_for(lock, std::chrono::milliseconds(idleWaitTime));
+            queue.sleeping = false;
+        }
+    }
+    // Handle anything that was queued right before stopping
+    while (handleQueuedEvent(queue));
+}
+
+void TcpServer::stopWorkers()
+{
+    if (!running && workersRunning)
+    {
+        workersRunning = false;
+        for (auto& queue: eventQueues)
+        {
+            {
+                std::lock_guard<std::mutex> lock(queue->mutex);
+                queue->ready.notify_one();
+            }
+            if (queue->thread.joinable())
+                queue->thread.join();
+        }
+    }
 }
 
 }
@@ -5,12 +5,26 @@
 #define TCPSERVER_H
 
 #include <vector>
+#include <string>
+#include <deque>
+#include <unordered_map>
 #include <memory>
 #include <functional>
 #include <thread>
 #include <mutex>
 #include <atomic>
+#include <condition_variable>
 #include <SFML/Network.hpp>
+#include "eventbackend.h"
+#include "frame.h"
+#include "packetview.h"
+#include "ringqueue.h"
+#include "timerwheel.h"
+#include "slotmap.h"
+#include "metrics.h"
+#include "compressor.h"
+#include "snapshot.h"
+#include "ratelimit.h"
 
 namespace net
 {
@@ -19,34 +33,124 @@ namespace net
 This class acts as a server that manages multiple TCP connections.
 It can handle new connections and disconnects, and can even invoke optional callbacks when these events occur.
 All clients can be accessed by their unique ID, which is simply an int.
-It uses a single separate thread with a socket selector to handle all of the sockets and the listener.
-    NOTE: This means that you are limited to:
-        63 connections on Windows
-        1023 connections on Linux
-        1023 connections on Mac OS X
-    (The listener takes up a slot in the socket selector)
+    The clients are stored contiguously in slot maps, so finding a client by its ID takes constant time.
+    An ID is only reused after many other clients have connected, and stale IDs are detected until then.
+It uses a separate thread with an event backend to handle all of the sockets and the listener.
+    On Linux this is edge-triggered epoll by default, which is only limited by the file descriptor limit.
+    Everywhere else (or if the selector backend is chosen with setEventBackend()), you are limited to:
+        62 connections on Windows, for each thread
+        1021 connections on Linux, for all of the threads together
+        1021 connections on Mac OS X, for all of the threads together
+    (The listener and the wake sockets take up the other slots. Outside of Windows, FD_SETSIZE limits the
+    socket handles of the whole process, so sockets past it are refused, even with fewer connections.)
+All of the sockets are non-blocking, so every ready socket is read until it has no more data.
+Data is read in large chunks into a receive buffer that is reused by every loop, and the packets are
+    found in place. With setPacketViewCallback(), the callback gets a view of the data right inside
+    of that buffer, so receiving doesn't copy or allocate anything.
+Packets are framed once per send, and the frame is shared by all of the clients it is sent to.
+    When sending the same data many times, a frame can also be made once with makeFrame() and reused.
+Sending never waits on a slow client. Anything that can't be sent right away goes into that client's
+    send queue, which is flushed when the socket can be written to again. When a client's queue is
+    over its limit, the overflow policy decides what happens (see setSendQueueLimit()).
+Small packets can be batched with setSendBatching(). They are then added to a write buffer for each
+    client, which is sent all at once when it gets big enough, when the oldest packet in it has
+    waited long enough, or when flush() is called. The frames in the buffer are the same as usual,
+    so the receivers don't need to know about it.
+Packets can be compressed with setCompression() (see compressor.h). Each client has to ask for it
+    when it connects (net::Client does this when its compression is on), and only gets compressed
+    packets once the server agrees, so clients without compression keep working. When sending to
+    many clients, the packet is only compressed once, and the compressed frame is shared.
+State that is sent to everyone over and over can be sent with sendSnapshot(), which only sends each client
+    what changed since the last snapshot it acked (see snapshot.h). net::Client acks them once its snapshots are on.
+Packet types from firstControlType to -1 are reserved for the library's control packets (see protocol.h).
+    The server only intercepts the ones of the features that are on (compression, the heartbeat, and
+    snapshots), so while a feature is off, packets of its types still reach the callbacks.
+Misbehaving clients can be limited with setRateLimit(), which gives each client token buckets for packets
+    and bytes per second (see ratelimit.h). The overflow policy decides what happens to a client that goes
+    over: its socket isn't read until the buckets refill, so TCP slows the client down by itself (Block),
+    the extra packets are thrown away (Drop), or the client is disconnected (Kick).
+    setConnectionRateLimit() limits how fast each IP address can connect, and setMaxPacketSize()
+    disconnects clients that announce bigger packets, before any of the packet is buffered. Compressed
+    packets also count with their original size, which is checked before decompressing them.
+
+More threads can be used with setThreadCount(). Each thread owns a shard of the clients, and has its
+    own event loop and lock. The first thread accepts new connections, and hands them out to the
+    shards in a round-robin fashion. A client's ID determines which shard it is in, so sending
+    to a client only locks that client's shard.
 
 To use this as a server, you must first set a listening port, then start the thread with start().
 To receive packets, or handle new clients connecting/disconnecting, set the callbacks.
+By default, the callbacks are called directly by the server threads, so a slow callback holds up the
+    networking. With setDispatchMode(Queued), the server threads only put the events into lock-free
+    queues instead, and the callbacks are called by your own thread when it calls poll(), or by
+    worker threads. Each client's events are always handled in order, by the same thread.
+    Using poll() is the recommended way to handle the callbacks, since then no locking is needed.
 Note: If you are modifying the same objects in the callbacks as you are in the main thread, they will
     need to be locked, since they are not running in the same thread. A lock is provided for
     convenience, which is locked before the callback is called. You can obtain this lock by calling
     the getLock() method, which returns a std::unique_lock<std::recursive_mutex>.
+    With multiple threads, this lock also keeps the callbacks from running at the same time. If your
+    callbacks are thread-safe, you can disable this with setCallbackLocking(false).
+Metrics like packets and bytes sent and received, lock contention, and callback time are kept by each
+    thread, and can be read with getMetrics(). Define NETLIB_NO_METRICS to compile them out.
+Timers can be set for each client with addTimer(), for things like login timeouts and heartbeats.
+    These are kept in a timing wheel in the client's shard, and the idle timeout uses the same timers.
+With setHeartbeat(), each client is pinged regularly by the server thread, and the answers are used to
+    measure the round trip time and jitter of each client (see getClientRtt()). The pings and answers
+    never reach the callbacks. The answers count as activity, so healthy clients aren't kicked by the
+    idle timeout, and clients that stop answering are kicked after the heartbeat timeout.
+    net::Client answers the pings once its heartbeat is on.
+To restart without dropping anyone, drain() stops accepting, sends everything that is queued and batched,
+    and then closes the sending side of each client, so they can read the rest of the data and close
+    the connection themselves. Clients that are still connected when the deadline passes are kicked,
+    and the server threads end on their own once every client is gone.
+    The listening socket can be handed to a successor process with handOffListener(), which picks it up
+    with adoptListener(), so new connections wait in the same queue instead of being refused (not on Windows).
 For some simple example usage, please refer to the readme.
 */
 class TcpServer
 {
     using CallbackType = std::function<void(int)>;
     using PacketCallbackType = std::function<void(sf::Packet&, int)>;
+    using PacketViewCallbackType = std::function<void(const PacketView&, int)>;
     using TcpSocketPtr = std::unique_ptr<sf::TcpSocket>;
     using LockType = std::unique_lock<std::recursive_mutex>;
 
     public:
 
+        using TimerId = std::uint64_t; // 0 is never a valid timer
+
+        // What happens when sending to a client whose send queue is full, or a client goes over its rate limits
+        enum OverflowPolicy
+        {
+            Block, // The sender waits for room in the queue without locking anything, and kicks the client after a timeout
+                // With rate limits, the client isn't read from until its rate allows it
+            Drop, // The packet is thrown away, and the send fails
+            Kick // The client is disconnected, and the send fails
+        };
+
+        // Where the callbacks are called from
+        enum DispatchMode
+        {
+            Inline, // The server threads call the callbacks directly
+            Queued // The events are queued, and the callbacks are called by poll() or the worker threads
+        };
+
+        static const std::size_t defaultSendQueueLimit = 1024 * 1024; // In bytes
+        static const std::size_t defaultEventQueueSize = 4096; // Events per queue
+        static const std::size_t defaultBatchSize = 16 * 1024; // In bytes
+        static const int defaultBatchDelay = 5; // Milliseconds
+        static const int defaultBlockTimeout = 1000; // Milliseconds
+        static const int defaultDrainTime = 10; // Seconds
+        static const int defaultHeartbeatInterval = 1000; // Milliseconds
+        static const int defaultHeartbeatTimeout = 5000; // Milliseconds
+        static const int defaultRateBurst = 1000; // Milliseconds of the rate that can be used at once
+
+        // Maximum connections when using the selector backend with one thread (the wake sockets and listener take the rest)
         #ifdef _WIN32
-            static const unsigned maxConnections = 63;
+            static const unsigned maxConnections = 62;
         #else
-            static const unsigned maxConnections = 1023;
+            static const unsigned maxConnections = 1021;
         #endif
 
         // Constructors/setup
@@ -55,70 +159,390 @@ class TcpServer
         TcpServer(unsigned short port, CallbackType c1, CallbackType c2, PacketCallbackType c3);
         ~TcpServer();
         void setListeningPort(unsigned short port);
+        bool adoptListener(const std::string& path, sf::Time timeout = sf::seconds(defaultDrainTime));
+            // Waits for another server to hand off its listener through the Unix socket at path, and listens with it
+        bool handOffListener(const std::string& path); // Gives the listener to adoptListener(), and stops listening
         void setConnectedCallback(CallbackType callback);
         void setDisconnectedCallback(CallbackType callback);
         void setPacketCallback(PacketCallbackType callback);
-        bool setConnectionLimit(unsigned connections = maxConnections);
+        void setPacketViewCallback(PacketViewCallbackType callback); // Used instead of the packet callback if set
+        bool setConnectionLimit(unsigned connections);
+        void setConnectionLimit(); // Allows as many as the backend supports (the default), this follows backend changes
         void setClientTimeout(float t = 0.0f);
+        void setHeartbeat(sf::Time interval = sf::milliseconds(defaultHeartbeatInterval),
+            sf::Time timeout = sf::milliseconds(defaultHeartbeatTimeout));
+            // Pings the clients every interval, and kicks the ones that haven't sent anything for timeout
+            // An interval of 0 turns this off (the default), and a timeout of 0 never kicks anyone
+        void setRateLimit(float packetsPerSecond = 0.0f, float bytesPerSecond = 0.0f, OverflowPolicy policy = Block,
+            sf::Time burst = sf::milliseconds(defaultRateBurst)); // Limits each client, a rate of 0 is unlimited
+        void setConnectionRateLimit(float connectionsPerSecond = 0.0f, sf::Time burst = sf::milliseconds(defaultRateBurst));
+            // Connections over the limit from the same IP address are closed right away
+        void setMaxPacketSize(std::size_t bytes = 0); // Clients that send bigger packets are kicked (0 is unlimited)
+        bool setEventBackend(EventBackend::Type type); // Can only be changed while the server isn't running
+        EventBackend::Type getEventBackend() const;
+        unsigned getMaxConnections() const; // Maximum supported connections with the current backend
+        bool setThreadCount(unsigned count); // Can only be changed while the server has no clients, fails if a thread couldn't hold any
+        unsigned getThreadCount() const;
+        void setSendQueueLimit(std::size_t bytes = defaultSendQueueLimit, OverflowPolicy policy = Block,
+            sf::Time blockTimeout = sf::milliseconds(defaultBlockTimeout)); // How long Block waits before kicking
+        void setSendBatching(std::size_t bytes = defaultBatchSize, sf::Time delay = sf::milliseconds(defaultBatchDelay));
+            // Packets smaller than bytes are batched, and sent within the delay (0 bytes turns this off)
+        bool setCompression(bool enabled, const Compressor& compressor = Compressor());
+            // Can only be changed while the server isn't running and has no clients
+        bool setDispatchMode(DispatchMode mode, unsigned workers = 0, std::size_t queueSize = defaultEventQueueSize);
+        DispatchMode getDispatchMode() const;
 
         // Thread synchronization
         LockType getLock();
+        void setCallbackLocking(bool enabled = true); // Enabled by default
+        unsigned poll(); // Calls the callbacks for the queued events, returns how many were handled
 
         // Communication
         bool send(sf::Packet& packet, int id); // Send to specific client
+        bool send(sf::Packet& packet, const std::vector<int>& ids); // Send to a list of clients
         bool sendToAll(sf::Packet& packet, int id = -1); // Send to all (with an optional exclusion)
-        void start(); // Launches the server loop thread
-        void stop(); // Stops the server loop thread
-        void join(); // Waits for the server thread to finish running
+        bool send(const SharedFrame& frame, int id); // These send an already framed packet
+        bool send(const SharedFrame& frame, const std::vector<int>& ids);
+        bool sendToAll(const SharedFrame& frame, int id = -1);
+        bool sendSnapshot(sf::Packet& packet); // Send to all, as a delta against what each client has
+        void setSnapshotHistory(std::size_t count = defaultSnapshotHistory); // Snapshots that can be used as baselines
+        bool flush(); // Sends the batched packets of all clients right away
+        bool flush(int id); // Sends the batched packets of a client right away
+        void start(); // Launches the server loop threads
+        void stop(); // Stops the server loop threads
+        void join(); // Waits for the server threads to finish running
+        void drain(sf::Time timeout = sf::seconds(defaultDrainTime)); // Gracefully closes the clients, then ends the threads
+        bool isDraining() const; // Whether drain() was called and the server threads are still running
 
         // Clients
         sf::IpAddress getClientAddress(int id) const; // Returns IP address of a client
         void kickClient(int id); // Disconnects a client
         bool clientIsConnected(int id) const; // Checks if a client is connected (uses a lock)
+        sf::Time getClientRtt(int id) const; // Smoothed round trip time measured by the heartbeat, 0 until measured
+        sf::Time getClientJitter(int id) const; // Average deviation of the round trip time
+
+        // Timers (millisecond precision, the callbacks are called like the other callbacks)
+        TimerId addTimer(int id, sf::Time delay, CallbackType callback); // Returns 0 if the client doesn't exist
+        bool cancelTimer(int id, TimerId timer); // Returns false if the timer already expired, or isn't one of the client's
+
+        // Metrics (these are all zero if NETLIB_NO_METRICS is defined)
+        ServerMetrics getMetrics() const; // Totals since the server was created
+        bool getClientMetrics(int id, ClientMetrics& metrics) const; // Returns false if the client doesn't exist
 
     private:
 
+        // A timer for a client, which is dropped if the client disconnects first
+        struct Timer
+        {
+            int id;
+            CallbackType callback; // Not set for the idle timeout and the heartbeat
+            bool heartbeat; // Whether this is the heartbeat instead of the idle timeout
+        };
+
+        using TimerHandle = TimerWheel<Timer>::Handle;
+
         struct TimedClient
         {
+            TimedClient();
+
+            int id;
             TcpSocketPtr socket;
-            sf::Clock timer;
+            sf::Time lastActive; // When data was last received, from the server's clock
+            TimerHandle idleTimer; // Checks the idle timeout, 0 if there is no timeout
+            TimerHandle heartbeatTimer; // Sends the next ping, 0 if there is no heartbeat
+
+            // Measured from the pongs, in microseconds
+            double smoothedRtt;
+            double rttVariance;
+            bool hasRtt;
+
+            // Data waiting to be sent, the first frame may have already been partially sent
+            std::deque<SharedFrame> sendQueue;
+            std::size_t sendOffset; // How much of the first frame has been sent
+            std::size_t sendQueueSize; // Total bytes left to send
+
+            // Small frames that are being batched, these are sent as a single frame later
+            std::vector<char> writeBuffer;
+            std::size_t bufferedPackets;
+            std::uint64_t bufferedSince; // Tick when the first frame in the buffer was added
+
+            bool compressed; // Whether the client agreed to use compression
+            bool closing; // The sending side was shut down while draining, and nothing else can be sent
+            SnapshotId ackedSnapshot; // The newest snapshot the client has, 0 if none
+
+            // Rate limits of the received packets
+            TokenBucket packetTokens;
+            TokenBucket byteTokens; // Includes the frame headers
+            bool throttled; // Isn't read from until the buckets refill
+
+            std::vector<char> partialFrame; // The start of a frame that hasn't been completely received
+
+            ClientMetrics metrics;
         };
 
-        using ClientMap = std::map<int, TimedClient>;
+        using ClientMap = SlotMap<TimedClient>;
+
+        // Something that happened in a shard, these are passed to the callbacks after the shard is unlocked
+        struct Event
+        {
+            enum Type
+            {
+                Connected,
+                Disconnected,
+                Received,
+                TimerExpired
+            };
+
+            Type type;
+            int id;
+            std::size_t offset; // Where the packet data is in the shard's receive buffer (or the timer callback)
+            std::size_t size;
+            bool decompressed; // The packet data is in the shard's decompress buffer instead
+        };
+
+        // These are only written by the shard's thread, or with the shard locked
+        struct ShardMetrics
+        {
+            Counter packetsReceived;
+            Counter bytesReceived;
+            Counter packetsSent;
+            Counter bytesSent;
+            Counter sendFailures;
+            Counter clientsAccepted;
+            Counter clientsRejected;
+            Counter clientsDisconnected;
+            Counter packetsLimited;
+            Counter lockWaits;
+            Counter lockWaitTime;
+            Histogram callbackTime; // Only for the callbacks called by the shard's thread
+            Histogram sendQueueSize;
+        };
+
+        // Each thread owns one of these
+        struct Shard
+        {
+            Shard(unsigned index, unsigned count, EventBackend::Type type);
+
+            unsigned index;
+            std::unique_ptr<EventBackend> backend; // Waits on the sockets (and the listener in the first shard)
+            ClientMap clients; // Stores the clients, their keys are turned into IDs that also contain the shard index
+            TimerWheel<Timer> timers; // The timers of this shard's clients
+            std::vector<Timer> expiredTimers; // Reused when handling the timers
+            std::thread thread;
+            mutable std::recursive_mutex mutex;
+
+            // Clients accepted by the first shard, waiting to be added to this one
+            std::mutex pendingMutex;
+            std::vector<TcpSocketPtr> pendingClients;
+
+            // Clients with queued data, only used if the backend doesn't report when sockets are writable
+            std::vector<int> unflushedClients;
+
+            // Clients with batched data in their write buffers
+            std::vector<int> bufferedClients;
+
+            // Clients kicked by other threads, their events are queued by this shard so they stay in order
+            std::vector<int> kickedClients;
+
+            // Clients that went over their rate limits with the Block policy, and the list they are moved to when resuming
+            std::vector<int> throttledClients;
+            std::vector<int> resumingClients;
+
+            // Clients that asked for compression, and still need to be told that it's on
+            std::vector<int> compressionAccepts;
+
+            // These are cleared after the events are dispatched, but they keep their memory
+            std::vector<Event> events;
+            std::vector<CallbackType> timerCallbacks; // Callbacks of the timer events
+            std::vector<char> receiveBuffer; // Only grows, the used size is kept separately
+            std::size_t receiveSize;
+            std::vector<char> decompressBuffer; // Decompressed packets, cleared along with the receive buffer
+            sf::Packet packet; // Reused for the packet callback
+
+            ShardMetrics metrics;
+        };
+
+        using ShardPtr = std::unique_ptr<Shard>;
+
+        // An event with its own copy of the packet data, since the receive buffer is reused
+        struct QueuedEvent
+        {
+            Event::Type type;
+            int id;
+            std::vector<char> data; // Keeps its memory when the slot in the queue is reused
+            CallbackType callback; // Only used for timer events
+        };
+
+        // The events are spread over these by client ID, so a client's events are always in the same queue
+        struct EventQueue
+        {
+            EventQueue(std::size_t size);
+
+            RingQueue<QueuedEvent> events;
+            std::thread thread; // Only used with worker threads
+            std::mutex mutex; // Only used for sleeping when the queue is empty
+            std::condition_variable ready;
+            std::atomic_bool sleeping;
+            sf::Packet packet; // Reused for the packet callback
+            Histogram callbackTime;
+        };
+
+        using EventQueuePtr = std::unique_ptr<EventQueue>;
+
+        static const int listenerId = -1; // ID the listener is registered with in the backend
+        static const int idleWaitTime = 500; // Milliseconds
+        static const int retryWaitTime = 10; // Milliseconds, used when sends need to be retried
+        static const int fullQueueWaitTime = 1; // Milliseconds, used when an event queue is full
+        static const std::size_t receiveChunkSize = 64 * 1024; // Bytes read from a socket at once
 
         // Main loop for handling connections and receiving data
-        void serverLoop();
+        void serverLoop(Shard& shard);
+
+        // Receives data from the clients that are ready
+        void receive(Shard& shard);
+        void receive(Shard& shard, TimedClient& client);
+        bool receiveFrame(Shard& shard, TimedClient& client, std::size_t offset, std::size_t size); // False if it's invalid
+
+        // Rate limits
+        bool takeTokens(Shard& shard, TimedClient& client, std::size_t size, bool& valid); // False if the packet is dropped
+        bool isThrottled(TimedClient& client) const;
+        void throttleClient(Shard& shard, TimedClient& client);
+        int resumeThrottledClients(Shard& shard, int maxWaitTime); // Returns the time until the next one can be resumed
+        void resetRateLimits(TimedClient& client, std::uint64_t now);
+        bool allowConnection(const sf::TcpSocket& socket); // Takes a token from the bucket of the socket's address
+
+        // Handles the expired timers, which also removes clients that have been idle for longer than the timeout
+        void handleTimers(Shard& shard, std::vector<int>& kicked);
+        void setIdleTimer(Shard& shard, TimedClient& client);
+
+        // Heartbeat
+        void handleHeartbeat(Shard& shard, TimedClient& client, std::vector<int>& kicked);
+        void setHeartbeatTimer(Shard& shard, TimedClient& client);
+        void updateRtt(TimedClient& client, sf::Uint32 timestamp);
+        sf::Uint32 getTimestamp() const; // Microseconds from the server's clock, which is allowed to wrap around
+        std::uint64_t getTick() const; // Current time from the server's clock, in milliseconds
+
+        // Sends a frame, or adds it to the client's send queue if the socket is full
+        // Small frames are added to the write buffer instead when batching
+        bool send(Shard& shard, TimedClient& client, const SharedFrame& frame, std::vector<int>& kicked);
+        bool sendFrame(Shard& shard, TimedClient& client, const SharedFrame& frame, std::size_t packets, std::vector<int>& kicked);
+
+        // Sends the write buffers, or only the ones that have waited long enough, returns false if any failed
+        bool flushBuffers(Shard& shard, bool all, std::vector<int>& kicked);
+        bool flushBuffer(Shard& shard, TimedClient& client, std::vector<int>& kicked);
+        int getTimeUntilFlush(Shard& shard, int maxWaitTime) const;
+
+        // Draining
+        void drainClients(Shard& shard, std::vector<int>& kicked); // Closes the clients that have nothing left to send
+        void stopListening();
 
-        // Receives data from a client and removes old clients
-        void receive();
+        // Compression
+        SharedFrame compressFrame(const SharedFrame& frame) const; // Returns null if it shouldn't be compressed
+        void sendCompressionAccepts(Shard& shard, std::vector<int>& kicked);
+
+        // Sends as much of the queue as possible, returns false if there was an error
+        bool flush(TimedClient& client);
+
+        // With the Block policy, these wait for room in the client's send queue before sending
+        // The shard isn't locked while waiting, so its thread and other senders keep going
+        LockType lockForSending(Shard& shard, int id, std::size_t size, std::vector<int>& kicked);
+        bool sendWhenReady(Shard& shard, int id, const SharedFrame& frame, const SharedFrame& compressed,
+            std::vector<int>& kicked); // The compressed frame is used for clients with compression, if it is set
+        bool hasQueueRoom(const TimedClient& client, std::size_t size) const;
+
+        // Tries to send the queued data again, when the backend can't report writable sockets
+        void retrySends(Shard& shard);
 
         // Clients
-        void acceptNewClient();
-        int addClient(TcpSocketPtr newClient);
-        ClientMap::iterator removeClient(ClientMap::iterator it);
+        void acceptNewClients(Shard& shard);
+        void addPendingClients(Shard& shard);
+        void addClient(Shard& shard, TcpSocketPtr newClient);
+        void removeClient(Shard& shard, TimedClient& client); // This moves another client into its place
         void setupClient(TcpSocketPtr& client);
-        bool clientIsConnected(ClientMap::const_iterator it) const;
+        bool clientIsConnected(const TimedClient* client) const;
+        TimedClient* findClient(Shard& shard, int id) const; // Returns null if the client doesn't exist
+
+        // Shards
+        void createShards(unsigned count);
+        static ClientMap::Key getMaxKey(unsigned count); // The highest key in each shard's slot map with this many shards
+        Shard* findShard(int id) const; // Returns the shard that owns this ID, or null if it is invalid
+        LockType lockShard(Shard& shard) const; // Also measures how long the lock was waited on
+        std::vector<LockType> lockShards() const; // Locks all of them, so the settings the shards read can be changed
+        bool isRunning() const;
 
         // Callbacks
+        Event& addEvent(Shard& shard, Event::Type type, int id);
+        void dispatchEvents(Shard& shard);
+        const char* getPacketData(Shard& shard, const Event& event) const;
+        void dispatchEvent(Event::Type type, int id, const PacketView& view, sf::Packet& packet, Histogram& callbackTime);
+        void dispatchTimer(const CallbackType& callback, int id, Histogram& callbackTime);
+        void dispatchDisconnected(const std::vector<int>& ids);
+        void addKickedClient(Shard& shard, int id, std::vector<int>& kicked);
+        LockType lockCallbacks();
+
+        // Event queues
+        void queueEvents(Shard& shard);
+        void queueEvent(const Event& event, Shard& shard);
+        bool handleQueuedEvent(EventQueue& queue);
+        void workerLoop(EventQueue& queue);
+        void stopWorkers();
+
         CallbackType connectedCallback;
         CallbackType disconnectedCallback;
         PacketCallbackType packetCallback;
+        PacketViewCallbackType packetViewCallback;
 
-        // Main thread
-        std::thread serverThread;
+        // Threads
+        std::vector<ShardPtr> shards;
         std::atomic_bool running;
-        mutable std::recursive_mutex internalMutex;
         std::recursive_mutex callbackMutex;
+        bool callbackLocking; // Whether to lock the callback mutex before calling the callbacks
+        DispatchMode dispatchMode;
+        unsigned workerCount; // Worker threads that handle the queued events, 0 if poll() is used
+        std::vector<EventQueuePtr> eventQueues; // One for each worker thread
+        std::atomic_bool workersRunning;
+        std::atomic_bool draining;
+        std::atomic<unsigned> drainingShards; // Shards that still have clients, the last one stops the server
+        std::uint64_t drainDeadline; // Tick when the remaining clients are kicked
 
         // Networking and client management
-        sf::SocketSelector selector; // Selector to handle the listener and sockets
+        EventBackend::Type backendType; // Type of backend used by all of the shards
         sf::TcpListener listener; // Listener for new connections
-        ClientMap clients; // Stores the pointers to the sockets (or clients)
         TcpSocketPtr tmpClient; // This is used by the listener to accept connections
-        int lastId; // This is used to generate unique IDs by just incrementing
+        unsigned nextShard; // The shard that will get the next accepted client
+        std::atomic<unsigned> clientCount; // Total clients in all shards, including the pending ones
+        sf::Clock clock; // Used to time the activity of clients
         bool listenerAdded; // So the listener isn't added more than once
         unsigned connectionLimit; // Maximum number of open sockets
+        bool connectionLimitSet; // Whether the limit was set, otherwise it is the most the backend supports
+        std::size_t sendQueueLimit; // Maximum bytes queued for a single client
+        OverflowPolicy overflowPolicy; // What to do when the send queue limit is reached
+        std::uint64_t blockTimeout; // Milliseconds that the Block policy waits for room in a send queue
+        std::size_t batchSize; // Packets smaller than this are batched, 0 if batching is off
+        std::uint64_t batchDelay; // Milliseconds until a write buffer is sent
+        bool compressionEnabled;
+        Compressor compressor;
+
+        // Rate limits, a rate of 0 is unlimited
+        float packetRate; // Per second
+        float byteRate;
+        float connectionRate;
+        float rateBurst; // Seconds
+        float connectionBurst;
+        OverflowPolicy ratePolicy;
+        std::size_t maxPacketSize; // 0 if there is no limit
+        std::unordered_map<sf::Uint32, TokenBucket> connectionTokens; // For each IP address, only used by the first shard
+        std::uint64_t nextConnectionPrune; // Tick when the full buckets are removed from the map
+
+        // Snapshots, these are only used by sendSnapshot()
+        std::mutex snapshotMutex;
+        std::atomic_bool snapshotsSent; // The acks are only intercepted once sendSnapshot() was used
+        SnapshotHistory snapshots;
+        SnapshotId lastSnapshot;
+        std::vector<std::pair<SnapshotId, SharedFrame> > snapshotFrames; // The frame for each baseline, reused by every call
         float timeout; // Time until idle client should be kicked
+        std::uint64_t heartbeatInterval; // Milliseconds between pings, 0 if the heartbeat is off
+        std::uint64_t heartbeatTimeout; // Milliseconds without anything received until a client is kicked
 };
 
 }
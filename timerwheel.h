@@ -0,0 +1,266 @@
+// See the file COPYRIGHT.txt for authors and copyright information.
+// See the file LICENSE.txt for copying conditions.
+
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <vector>
+#include <cstdint>
+
+namespace net
+{
+
+/*
+A hierarchical timing wheel, which stores timers that expire at a certain tick (usually milliseconds).
+Adding and removing timers takes constant time, and so does advancing by one tick.
+There are 4 levels of 256 slots. The first level holds the timers that expire within 256 ticks,
+    and each level above holds timers 256 times further away. When the first level wraps around,
+    the next slot of the level above is moved down, so a timer is only moved at most 3 times.
+The data of the expired timers is returned by advance(), so the caller can handle them however it wants.
+*/
+template <typename T>
+class TimerWheel
+{
+    public:
+        using Handle = std::uint64_t; // 0 is never a valid handle
+
+        TimerWheel();
+
+        // Adds a timer that expires at a tick, returns a handle that can be used to remove it
+        Handle add(std::uint64_t expiry, const T& data);
+
+        // Removes a timer before it expires, returns false if it already expired or was removed
+        bool remove(Handle handle);
+
+        // Returns the data of a timer that hasn't expired yet, or null if it already expired or was removed
+        const T* find(Handle handle) const;
+
+        // Removes all of the timers
+        void clear();
+
+        // Moves time forward to a tick, and adds the data of the expired timers to the vector
+        void advance(std::uint64_t now, std::vector<T>& expired);
+
+        // Returns the ticks until the next timer might expire, or the limit if that is sooner
+        std::uint64_t getTimeUntilNext(std::uint64_t limit) const;
+
+        bool empty() const;
+
+    private:
+        static const unsigned levelBits = 8;
+        static const unsigned slotsPerLevel = 1 << levelBits;
+        static const unsigned slotMask = slotsPerLevel - 1;
+        static const unsigned levels = 4;
+        static const int none = -1;
+
+        struct Node
+        {
+            std::uint64_t expiry;
+            int previous;
+            int next;
+            int slot; // none if the node is free
+            std::uint32_t generation; // Changes every time the node is reused, so old handles don't match
+            T data;
+        };
+
+        void insert(int index);
+        void unlink(int index);
+        void release(int index);
+        void cascade(unsigned level);
+
+        std::vector<Node> nodes;
+        std::vector<int> slots; // The first node in each slot, for all of the levels
+        std::vector<int> freeNodes;
+        std::uint64_t currentTick; // The next tick to be handled
+        std::size_t count;
+};
+
+template <typename T>
+TimerWheel<T>::TimerWheel():
+    slots(levels * slotsPerLevel, none),
+    currentTick(0),
+    count(0)
+{
+}
+
+template <typename T>
+typename TimerWheel<T>::Handle TimerWheel<T>::add(std::uint64_t expiry, const T& data)
+{
+    // Reuse a free node if there is one
+    int index = none;
+    if (freeNodes.empty())
+    {
+        index = static_cast<int>(nodes.size());
+        nodes.emplace_back();
+        nodes.back().generation = 0;
+    }
+    else
+    {
+        index = freeNodes.back();
+        freeNodes.pop_back();
+    }
+    auto& node = nodes[index];
+    node.expiry = (expiry < currentTick ? currentTick : expiry);
+    node.data = data;
+    ++node.generation;
+    insert(index);
+    ++count;
+    return (static_cast<Handle>(node.generation) << 32) | static_cast<std::uint32_t>(index + 1);
+}
+
+template <typename T>
+bool TimerWheel<T>::remove(Handle handle)
+{
+    bool status = false;
+    int index = static_cast<int>(handle & 0xFFFFFFFF) - 1;
+    if (index >= 0 && index < static_cast<int>(nodes.size()))
+    {
+        auto& node = nodes[index];
+        status = (node.slot != none && node.generation == static_cast<std::uint32_t>(handle >> 32));
+        if (status)
+        {
+            unlink(index);
+            release(index);
+        }
+    }
+    return status;
+}
+
+template <typename T>
+const T* TimerWheel<T>::find(Handle handle) const
+{
+    const T* data = nullptr;
+    int index = static_cast<int>(handle & 0xFFFFFFFF) - 1;
+    if (index >= 0 && index < static_cast<int>(nodes.size()))
+    {
+        auto& node = nodes[index];
+        if (node.slot != none && node.generation == static_cast<std::uint32_t>(handle >> 32))
+            data = &node.data;
+    }
+    return data;
+}
+
+template <typename T>
+void TimerWheel<T>::clear()
+{
+    nodes.clear();
+    freeNodes.clear();
+    slots.assign(levels * slotsPerLevel, none);
+    count = 0;
+}
+
+template <typename T>
+void TimerWheel<T>::advance(std::uint64_t now, std::vector<T>& expired)
+{
+    // Nothing can expire, so skip straight there
+    if (count == 0 && currentTick <= now)
+        currentTick = now + 1;
+
+    while (currentTick <= now)
+    {
+        // When a level wraps around, the next slot of the level above is moved down
+        unsigned level = 0;
+        while (level + 1 < levels && ((currentTick >> (levelBits * level)) & slotMask) == 0)
+            ++level;
+        for (; level > 0; --level)
+            cascade(level);
+
+        // Everything in the current slot of the first level has expired
+        auto& slot = slots[currentTick & slotMask];
+        while (slot != none)
+        {
+            int index = slot;
+            unlink(index);
+            expired.push_back(nodes[index].data);
+            release(index);
+        }
+        ++currentTick;
+    }
+}
+
+template <typename T>
+std::uint64_t TimerWheel<T>::getTimeUntilNext(std::uint64_t limit) const
+{
+    // The first level is exact, otherwise wait until it wraps around and the level above moves down
+    std::uint64_t ticks = 1;
+    bool found = (count == 0);
+    while (!found && ticks < limit)
+    {
+        std::uint64_t tick = currentTick + ticks - 1;
+        found = (slots[tick & slotMask] != none || (tick & slotMask) == 0);
+        if (!found)
+            ++ticks;
+    }
+    return (count == 0 || ticks > limit ? limit : ticks);
+}
+
+template <typename T>
+bool TimerWheel<T>::empty() const
+{
+    return (count == 0);
+}
+
+template <typename T>
+void TimerWheel<T>::insert(int index)
+{
+    // Find the lowest level that can hold the timer
+    auto& node = nodes[index];
+    std::uint64_t delta = node.expiry - currentTick;
+    std::uint64_t expiry = node.expiry;
+    unsigned level = 0;
+    while (level + 1 < levels && delta >= (std::uint64_t(1) << (levelBits * (level + 1))))
+        ++level;
+
+    // Timers past the last level are put at the end of it, and moved down again later
+    std::uint64_t maxDelta = (std::uint64_t(1) << (levelBits * levels)) - 1;
+    if (delta > maxDelta)
+        expiry = currentTick + maxDelta;
+
+    node.slot = static_cast<int>(level * slotsPerLevel + ((expiry >> (levelBits * level)) & slotMask));
+    node.previous = none;
+    node.next = slots[node.slot];
+    if (node.next != none)
+        nodes[node.next].previous = index;
+    slots[node.slot] = index;
+}
+
+template <typename T>
+void TimerWheel<T>::unlink(int index)
+{
+    auto& node = nodes[index];
+    if (node.previous != none)
+        nodes[node.previous].next = node.next;
+    else
+        slots[node.slot] = node.next;
+    if (node.next != none)
+        nodes[node.next].previous = node.previous;
+    node.slot = none;
+}
+
+template <typename T>
+void TimerWheel<T>::release(int index)
+{
+    // Don't keep the data alive
+    nodes[index].data = T();
+    freeNodes.push_back(index);
+    --count;
+}
+
+template <typename T>
+void TimerWheel<T>::cascade(unsigned level)
+{
+    // Take the whole slot, then put each timer into a lower level
+    auto& slot = slots[level * slotsPerLevel + ((currentTick >> (levelBits * level)) & slotMask)];
+    int index = slot;
+    slot = none;
+    while (index != none)
+    {
+        int next = nodes[index].next;
+        insert(index);
+        index = next;
+    }
+}
+
+}
+
+#endif
@@ -0,0 +1,237 @@
+// See the file COPYRIGHT.txt for authors and copyright information.
+// See the file LICENSE.txt for copying conditions.
+
+#include "udpbatch.h"
+#include "frame.h"
+#include "nativesocket.h"
+#include <cstring>
+#include <algorithm>
+#ifdef __linux__
+    #include <cerrno>
+    #include <arpa/inet.h>
+#endif
+
+namespace net
+{
+
+#ifdef __linux__
+
+namespace
+{
+
+void toSockAddr(const Address& address, sockaddr_in& sockAddr)
+{
+    std::memset(&sockAddr, 0, sizeof(sockAddr));
+    sockAddr.sin_family = AF_INET;
+    sockAddr.sin_port = htons(address.port);
+    sockAddr.sin_addr.s_addr = htonl(address.ip.toInteger());
+}
+
+void fromSockAddr(const sockaddr_in& sockAddr, Address& address)
+{
+    address.ip = sf::IpAddress(ntohl(sockAddr.sin_addr.s_addr));
+    address.port = ntohs(sockAddr.sin_port);
+}
+
+}
+
+#endif
+
+UdpBatch::UdpBatch(sf::UdpSocket& socket):
+    socket(socket),
+    batchSize(0),
+    bufferSize(0)
+{
+}
+
+void UdpBatch::setSize(std::size_t batchSize, std::size_t bufferSize)
+{
+    this->batchSize = batchSize;
+    this->bufferSize = bufferSize;
+    receiveBuffers.assign(batchSize * bufferSize, 0);
+    received.clear();
+    received.reserve(batchSize);
+    #ifdef __linux__
+        headers.reserve(std::max(batchSize, headers.size()));
+        vectors.reserve(std::max(batchSize, vectors.size()));
+        addresses.reserve(std::max(batchSize, addresses.size()));
+    #else
+        scratchBuffer.resize(sf::UdpSocket::MaxDatagramSize);
+    #endif
+}
+
+std::size_t UdpBatch::getBatchSize() const
+{
+    return batchSize;
+}
+
+bool UdpBatch::receive()
+{
+    received.clear();
+    bool status = false;
+    if (batchSize > 0)
+    {
+        #ifdef __linux__
+            // Point each header at its own buffer, the kernel fills in the sizes and addresses
+            headers.resize(batchSize);
+            vectors.resize(batchSize);
+            addresses.resize(batchSize);
+            for (std::size_t i = 0; i < batchSize; ++i)
+            {
+                vectors[i].iov_base = &receiveBuffers[i * bufferSize];
+                vectors[i].iov_len = bufferSize;
+                auto& header = headers[i].msg_hdr;
+                std::memset(&header, 0, sizeof(header));
+                header.msg_name = &addresses[i];
+                header.msg_namelen = sizeof(sockaddr_in);
+                header.msg_iov = &vectors[i];
+                header.msg_iovlen = 1;
+                headers[i].msg_len = 0;
+            }
+            int count = -1;
+            do
+                count = recvmmsg(getNativeHandle(socket), headers.data(), batchSize, MSG_DONTWAIT, nullptr);
+            while (count < 0 && errno == EINTR);
+            status = (count > 0);
+            for (int i = 0; i < count; ++i)
+            {
+                // Truncated datagrams are incomplete, so they can't be used
+                if ((headers[i].msg_hdr.msg_flags & MSG_TRUNC) == 0)
+                {
+                    Datagram datagram;
+                    datagram.data = &receiveBuffers[i * bufferSize];
+                    datagram.size = headers[i].msg_len;
+                    fromSockAddr(addresses[i], datagram.address);
+                    received.push_back(datagram);
+                }
+            }
+        #else
+            // Receive one datagram at a time, into a buffer that is big enough for any of them
+            Address address;
+            std::size_t size = 0;
+            std::size_t slot = 0;
+            while (slot < batchSize && socket.receive(scratchBuffer.data(), scratchBuffer.size(), size,
+                    address.ip, address.port) == sf::Socket::Done)
+            {
+                status = true;
+                if (size <= bufferSize)
+                {
+                    char* buffer = &receiveBuffers[slot * bufferSize];
+                    std::memcpy(buffer, scratchBuffer.data(), size);
+                    Datagram datagram = {buffer, size, address};
+                    received.push_back(datagram);
+                }
+                ++slot;
+            }
+        #endif
+    }
+    return status;
+}
+
+std::size_t UdpBatch::getCount() const
+{
+    return received.size();
+}
+
+const char* UdpBatch::getData(std::size_t index) const
+{
+    return received[index].data;
+}
+
+std::size_t UdpBatch::getSize(std::size_t index) const
+{
+    return received[index].size;
+}
+
+const Address& UdpBatch::getAddress(std::size_t index) const
+{
+    return received[index].address;
+}
+
+bool UdpBatch::queue(sf::Packet& packet, const Address& address)
+{
+    std::size_t size = 0;
+    const void* data = getPacketData(packet, size);
+    return queue(data, size, address);
+}
+
+bool UdpBatch::queue(const void* data, std::size_t size, const Address& address)
+{
+    bool status = (size <= sf::UdpSocket::MaxDatagramSize && address.ip != sf::IpAddress::None);
+    if (status)
+    {
+        QueuedDatagram datagram = {sendBuffer.size(), size, address};
+        auto bytes = static_cast<const char*>(data);
+        sendBuffer.insert(sendBuffer.end(), bytes, bytes + size);
+        queued.push_back(datagram);
+    }
+    return status;
+}
+
+bool UdpBatch::flush()
+{
+    bool status = true;
+    if (!queued.empty())
+    {
+        #ifdef __linux__
+            // SFML only creates UDP sockets when they are bound or used, so it might not exist yet
+            createNativeHandle(socket);
+            auto count = queued.size();
+            headers.resize(std::max(count, headers.size()));
+            vectors.resize(std::max(count, vectors.size()));
+            addresses.resize(std::max(count, addresses.size()));
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                vectors[i].iov_base = &sendBuffer[queued[i].offset];
+                vectors[i].iov_len = queued[i].size;
+                toSockAddr(queued[i].address, addresses[i]);
+                auto& header = headers[i].msg_hdr;
+                std::memset(&header, 0, sizeof(header));
+                header.msg_name = &addresses[i];
+                header.msg_namelen = sizeof(sockaddr_in);
+                header.msg_iov = &vectors[i];
+                header.msg_iovlen = 1;
+            }
+
+            // Only an error on the first datagram is reported, so that one gets skipped and the rest are retried
+            std::size_t sent = 0;
+            while (sent < count)
+            {
+                auto batch = std::min(count - sent, maxSendBatch);
+                int result = sendmmsg(getNativeHandle(socket), &headers[sent], batch, MSG_DONTWAIT);
+                if (result > 0)
+                    sent += result;
+                else if (result < 0 && errno == EINTR)
+                    continue;
+                else if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                {
+                    // The send buffer is full, so the rest are dropped like any other lost datagrams
+                    status = false;
+                    break;
+                }
+                else
+                {
+                    status = false;
+                    ++sent;
+                }
+            }
+        #else
+            for (auto& datagram: queued)
+            {
+                if (socket.send(&sendBuffer[datagram.offset], datagram.size,
+                        datagram.address.ip, datagram.address.port) != sf::Socket::Done)
+                    status = false;
+            }
+        #endif
+        queued.clear();
+        sendBuffer.clear();
+    }
+    return status;
+}
+
+std::size_t UdpBatch::getQueuedCount() const
+{
+    return queued.size();
+}
+
+}
@@ -0,0 +1,91 @@
+// See the file COPYRIGHT.txt for authors and copyright information.
+// See the file LICENSE.txt for copying conditions.
+
+#ifndef UDPBATCH_H
+#define UDPBATCH_H
+
+#include <vector>
+#include <SFML/Network.hpp>
+#include "address.h"
+#ifdef __linux__
+    #include <sys/socket.h>
+    #include <netinet/in.h>
+#endif
+
+namespace net
+{
+
+/*
+Sends and receives UDP datagrams in batches through an SFML socket.
+On Linux, a whole batch only costs one recvmmsg() or sendmmsg() call. Other platforms fall back to
+    one call per datagram, so they still work the same way.
+Datagrams are received into preallocated buffers, so receiving doesn't allocate anything.
+    Datagrams that don't fit into a buffer are dropped.
+Queued datagrams are copied into a buffer, and are all sent by the next flush().
+    Once the buffers have grown enough, queueing doesn't allocate anything either.
+*/
+class UdpBatch
+{
+    public:
+        static const std::size_t defaultBatchSize = 32;
+        static const std::size_t defaultBufferSize = 2048; // Enough for anything that fits into one Ethernet frame
+
+        UdpBatch(sf::UdpSocket& socket);
+        void setSize(std::size_t batchSize, std::size_t bufferSize = defaultBufferSize);
+        std::size_t getBatchSize() const;
+
+        // Receiving
+        bool receive(); // Receives up to a batch of datagrams, returns false if nothing was waiting
+        std::size_t getCount() const; // Datagrams from the last receive()
+        const char* getData(std::size_t index) const;
+        std::size_t getSize(std::size_t index) const;
+        const Address& getAddress(std::size_t index) const;
+
+        // Sending
+        bool queue(sf::Packet& packet, const Address& address); // Returns false if the packet is too big
+        bool queue(const void* data, std::size_t size, const Address& address);
+        bool flush(); // Sends all of the queued datagrams, returns false if any of them couldn't be sent
+        std::size_t getQueuedCount() const;
+
+    private:
+        static const std::size_t maxSendBatch = 1024; // The most that sendmmsg() takes at once (UIO_MAXIOV)
+
+        struct Datagram
+        {
+            const char* data;
+            std::size_t size;
+            Address address;
+        };
+
+        struct QueuedDatagram
+        {
+            std::size_t offset; // Into the send buffer
+            std::size_t size;
+            Address address;
+        };
+
+        sf::UdpSocket& socket;
+        std::size_t batchSize;
+        std::size_t bufferSize;
+
+        // Received datagrams point into these buffers, which are batchSize * bufferSize bytes
+        std::vector<char> receiveBuffers;
+        std::vector<Datagram> received;
+
+        // Queued datagrams are stored back to back
+        std::vector<char> sendBuffer;
+        std::vector<QueuedDatagram> queued;
+
+        #ifdef __linux__
+            // These are reused for every call, so that they don't have to be allocated each time
+            std::vector<mmsghdr> headers;
+            std::vector<iovec> vectors;
+            std::vector<sockaddr_in> addresses;
+        #else
+            std::vector<char> scratchBuffer; // Big enough for any datagram, so the big ones can be noticed
+        #endif
+};
+
+}
+
+#endif
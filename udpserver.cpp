@@ -0,0 +1,730 @@
+// See the file COPYRIGHT.txt for authors and copyright information.
+// See the file LICENSE.txt for copying conditions.
+
+#include "udpserver.h"
+#include "frame.h"
+#include "nativesocket.h"
+#include <algorithm>
+#include <limits>
+#ifdef __linux__
+    #include <cstring>
+    #include <unistd.h>
+    #include <sys/socket.h>
+    #include <netinet/in.h>
+#endif
+
+namespace net
+{
+
+constexpr float UdpServer::defaultPeerTimeout;
+
+UdpServer::Peer::Peer():
+    id(-1),
+    timeoutTimer(0),
+    updating(false)
+{
+}
+
+UdpServer::Shard::Shard(unsigned index, unsigned count):
+    index(index),
+    backend(EventBackend::create()),
+    receiveBatch(socket),
+    sendBatch(socket),
+    peers(getMaxKey(count))
+{
+    // The socket is drained every time it is ready
+    socket.setBlocking(false);
+}
+
+UdpServer::UdpServer():
+    running(false),
+    callbackLocking(true),
+    port(0),
+    batchSize(UdpBatch::defaultBatchSize),
+    bufferSize(UdpBatch::defaultBufferSize),
+    peerCount(0),
+    peerLimit(defaultPeerLimit),
+    timeout(defaultPeerTimeout)
+{
+    createShards(1);
+}
+
+UdpServer::UdpServer(unsigned short port):
+    UdpServer()
+{
+    setListeningPort(port);
+}
+
+UdpServer::~UdpServer()
+{
+    // Wait for the threads to finish if they are running
+    running = false;
+    join();
+    closeSockets();
+}
+
+void UdpServer::setListeningPort(unsigned short port)
+{
+    this->port = port;
+}
+
+unsigned short UdpServer::getLocalPort() const
+{
+    return shards.front()->socket.getLocalPort();
+}
+
+void UdpServer::setConnectedCallback(CallbackType callback)
+{
+    connectedCallback = callback;
+}
+
+void UdpServer::setDisconnectedCallback(CallbackType callback)
+{
+    disconnectedCallback = callback;
+}
+
+void UdpServer::setPacketCallback(PacketCallbackType callback)
+{
+    packetCallback = callback;
+}
+
+void UdpServer::setPacketViewCallback(PacketViewCallbackType callback)
+{
+    packetViewCallback = callback;
+}
+
+void UdpServer::setPeerLimit(unsigned peers)
+{
+    auto locks = lockShards();
+    peerLimit = peers;
+}
+
+void UdpServer::setPeerTimeout(float t)
+{
+    // Update the timeout timers of the existing peers
+    auto locks = lockShards();
+    timeout = t;
+    for (auto& shard: shards)
+    {
+        for (auto& peer: shard->peers)
+            setTimeoutTimer(*shard, peer);
+        shard->backend->wake();
+    }
+}
+
+bool UdpServer::setThreadCount(unsigned count)
+{
+    bool status = false;
+    // Spreading the peers over more than one socket needs SO_REUSEPORT
+    #ifdef __linux__
+        bool supported = true;
+    #else
+        bool supported = (count == 1);
+    #endif
+    // Every shard needs to be able to hold peers, which stops working with a huge number of them
+    if (count > 0 && supported && PeerMap(getMaxKey(count)).getMaxSize() > 0 && !isRunning())
+    {
+        createShards(count);
+        status = true;
+    }
+    return status;
+}
+
+unsigned UdpServer::getThreadCount() const
+{
+    return shards.size();
+}
+
+bool UdpServer::setBatchSize(std::size_t batchSize, std::size_t bufferSize)
+{
+    bool status = false;
+    if (batchSize > 0 && bufferSize > 0 && !isRunning())
+    {
+        this->batchSize = batchSize;
+        this->bufferSize = bufferSize;
+        status = true;
+    }
+    return status;
+}
+
+UdpServer::LockType UdpServer::getLock()
+{
+    return LockType(callbackMutex);
+}
+
+void UdpServer::setCallbackLocking(bool enabled)
+{
+    callbackLocking = enabled;
+}
+
+bool UdpServer::send(sf::Packet& packet, int id)
+{
+    bool status = false;
+    auto shard = findShard(id);
+    if (shard)
+    {
+        LockType lock(shard->mutex);
+        auto peer = findPeer(*shard, id);
+        if (peer)
+            status = (shard->sendBatch.queue(packet, peer->address) && shard->sendBatch.flush());
+    }
+    return status;
+}
+
+bool UdpServer::sendToAll(sf::Packet& packet, int id)
+{
+    // Each shard sends to all of its peers with a single batch
+    std::size_t size = 0;
+    const void* data = getPacketData(packet, size);
+    bool status = true;
+    for (auto& shard: shards)
+    {
+        LockType lock(shard->mutex);
+        for (auto& peer: shard->peers)
+        {
+            if (peer.id != id && !shard->sendBatch.queue(data, size, peer.address))
+                status = false;
+        }
+        if (!shard->sendBatch.flush())
+            status = false;
+    }
+    return status;
+}
+
+bool UdpServer::send(sf::Packet& packet, int id, Connection::Channel channel)
+{
+    bool status = false;
+    auto shard = findShard(id);
+    if (shard)
+    {
+        std::size_t size = 0;
+        const void* data = getPacketData(packet, size);
+        LockType lock(shard->mutex);
+        auto peer = findPeer(*shard, id);
+        if (peer)
+            status = (sendChannel(*shard, *peer, channel, data, size) && shard->sendBatch.flush());
+    }
+    return status;
+}
+
+bool UdpServer::sendToAll(sf::Packet& packet, Connection::Channel channel, int id)
+{
+    std::size_t size = 0;
+    const void* data = getPacketData(packet, size);
+    bool status = true;
+    for (auto& shard: shards)
+    {
+        LockType lock(shard->mutex);
+        for (auto& peer: shard->peers)
+        {
+            if (peer.id != id && !sendChannel(*shard, peer, channel, data, size))
+                status = false;
+        }
+        if (!shard->sendBatch.flush())
+            status = false;
+    }
+    return status;
+}
+
+bool UdpServer::start()
+{
+    bool status = isRunning();
+    if (!status && openSockets())
+    {
+        running = true;
+        for (auto& shard: shards)
+        {
+            shard->receiveBatch.setSize(batchSize, bufferSize);
+            shard->thread = std::thread(&UdpServer::serverLoop, this, std::ref(*shard));
+        }
+        status = true;
+    }
+    return status;
+}
+
+void UdpServer::stop()
+{
+    running = false;
+    join();
+    closeSockets();
+    for (auto& shard: shards)
+    {
+        LockType lock(shard->mutex);
+        shard->peers.clear();
+        shard->addresses.clear();
+        shard->timers.clear();
+        shard->updatingPeers.clear();
+    }
+    peerCount = 0;
+}
+
+void UdpServer::join()
+{
+    for (auto& shard: shards)
+    {
+        // Wake the thread up so it notices sooner if the server was stopped
+        if (!running)
+            shard->backend->wake();
+        if (shard->thread.joinable())
+            shard->thread.join();
+    }
+}
+
+Address UdpServer::getPeerAddress(int id) const
+{
+    Address address;
+    auto shard = findShard(id);
+    if (shard)
+    {
+        LockType lock(shard->mutex);
+        auto peer = findPeer(*shard, id);
+        if (peer)
+            address = peer->address;
+    }
+    return address;
+}
+
+void UdpServer::kickPeer(int id)
+{
+    auto shard = findShard(id);
+    if (shard)
+    {
+        bool kicked = false;
+        {
+            LockType lock(shard->mutex);
+            auto peer = findPeer(*shard, id);
+            if (peer)
+            {
+                sendControl(*shard, Disconnect, peer->address);
+                shard->sendBatch.flush();
+                removePeer(*shard, *peer);
+                kicked = true;
+            }
+        }
+        // Call the callback after unlocking the shard, the same as the server threads do
+        if (kicked && disconnectedCallback)
+        {
+            auto lock = lockCallbacks();
+            disconnectedCallback(id);
+        }
+    }
+}
+
+bool UdpServer::peerIsConnected(int id) const
+{
+    bool status = false;
+    auto shard = findShard(id);
+    if (shard)
+    {
+        LockType lock(shard->mutex);
+        status = (findPeer(*shard, id) != nullptr);
+    }
+    return status;
+}
+
+unsigned UdpServer::getPeerCount() const
+{
+    return peerCount;
+}
+
+sf::Time UdpServer::getPeerRtt(int id) const
+{
+    sf::Time rtt;
+    auto shard = findShard(id);
+    if (shard)
+    {
+        LockType lock(shard->mutex);
+        auto peer = findPeer(*shard, id);
+        if (peer && peer->connection)
+            rtt = sf::milliseconds(static_cast<sf::Int32>(peer->connection->getRtt()));
+    }
+    return rtt;
+}
+
+void UdpServer::serverLoop(Shard& shard)
+{
+    auto waitTime = sf::milliseconds(idleWaitTime);
+    while (running)
+    {
+        // Don't wait forever on the backend, so that the loop can gracefully end
+        bool ready = shard.backend->wait(waitTime);
+
+        // Each batch is dispatched before the next one is received, since the packets are in its buffers
+        bool received = false;
+        do
+        {
+            received = (ready && shard.receiveBatch.receive());
+            {
+                LockType lock(shard.mutex);
+                if (received)
+                    handleDatagrams(shard);
+                handleTimers(shard);
+                updateChannels(shard);
+                shard.sendBatch.flush();
+                // Wake up in time for the next timeout, or to resend on the channels
+                int maxWaitTime = (shard.updatingPeers.empty() ? idleWaitTime : channelWaitTime);
+                waitTime = sf::milliseconds(static_cast<int>(shard.timers.getTimeUntilNext(maxWaitTime)));
+            }
+            // The callbacks are called without the shard being locked, so they can use any other shard
+            dispatchEvents(shard);
+        }
+        while (received && running);
+    }
+}
+
+void UdpServer::handleDatagrams(Shard& shard)
+{
+    auto& batch = shard.receiveBatch;
+    auto now = clock.getElapsedTime();
+    for (std::size_t i = 0; i < batch.getCount(); ++i)
+    {
+        sf::Int32 type = 0;
+        if (readPacketType(batch.getData(i), batch.getSize(i), type))
+        {
+            auto peer = findPeer(shard, batch.getAddress(i));
+            if (peer)
+                peer->lastActive = now; // The timeout timer checks this when it expires
+            if (isControlType(type))
+                handleControl(shard, type, i, peer);
+            else if (peer)
+                addEvent(shard, Event::Received, peer->id, i);
+        }
+    }
+}
+
+void UdpServer::handleControl(Shard& shard, sf::Int32 type, std::size_t datagram, Peer* peer)
+{
+    auto& address = shard.receiveBatch.getAddress(datagram);
+    if (type == ConnectRequest)
+    {
+        // Check the version that comes after the type
+        PacketView view(shard.receiveBatch.getData(datagram), shard.receiveBatch.getSize(datagram));
+        view.copyTo(shard.packet);
+        sf::Int32 packetType = 0;
+        sf::Uint32 version = 0;
+        bool valid = (shard.packet >> packetType >> version && version == protocolVersion);
+
+        // The peer keeps sending requests until it gets an answer, so an existing peer is just answered again
+        if (valid && !peer)
+            peer = addPeer(shard, address);
+        sendControl(shard, (valid && peer ? ConnectAccept : Disconnect), address);
+    }
+    else if (type == Disconnect && peer)
+    {
+        addEvent(shard, Event::Disconnected, peer->id);
+        removePeer(shard, *peer);
+    }
+    else if (type == ChannelData && peer)
+        receiveChannels(shard, *peer, datagram);
+}
+
+void UdpServer::handleTimers(Shard& shard)
+{
+    auto& expired = shard.expiredTimers;
+    shard.timers.advance(getTick(), expired);
+    for (int id: expired)
+    {
+        auto peer = findPeer(shard, id);
+        if (peer)
+        {
+            // The timer isn't moved every time a datagram is received, so the peer may have been active since
+            peer->timeoutTimer = 0;
+            auto expiry = peer->lastActive + sf::seconds(timeout);
+            if (timeout > 0.0f && expiry <= clock.getElapsedTime())
+            {
+                addEvent(shard, Event::Disconnected, id);
+                removePeer(shard, *peer);
+            }
+            else
+                setTimeoutTimer(shard, *peer);
+        }
+    }
+    expired.clear();
+}
+
+void UdpServer::setTimeoutTimer(Shard& shard, Peer& peer)
+{
+    if (peer.timeoutTimer)
+        shard.timers.remove(peer.timeoutTimer);
+    peer.timeoutTimer = 0;
+    if (timeout > 0.0f)
+    {
+        // If the peer has already been idle for too long, this expires right away
+        auto expiry = (peer.lastActive + sf::seconds(timeout)).asMilliseconds();
+        peer.timeoutTimer = shard.timers.add(static_cast<std::uint64_t>(expiry), peer.id);
+    }
+}
+
+std::uint64_t UdpServer::getTick() const
+{
+    return static_cast<std::uint64_t>(clock.getElapsedTime().asMilliseconds());
+}
+
+void UdpServer::receiveChannels(Shard& shard, Peer& peer, std::size_t datagram)
+{
+    if (!peer.connection)
+        peer.connection.reset(new Connection());
+    auto& connection = *peer.connection;
+    auto& batch = shard.receiveBatch;
+    connection.receive(getTick(), batch.getData(datagram), batch.getSize(datagram));
+
+    // The connection reuses its buffer, so the messages are copied until they are dispatched
+    for (std::size_t i = 0; i < connection.getMessageCount(); ++i)
+    {
+        auto data = connection.getMessageData(i);
+        auto& event = addEvent(shard, Event::Received, peer.id, channelMessage);
+        event.offset = shard.messageBuffer.size();
+        event.size = connection.getMessageSize(i);
+        shard.messageBuffer.insert(shard.messageBuffer.end(), data, data + event.size);
+    }
+    updatePeer(shard, peer);
+}
+
+bool UdpServer::sendChannel(Shard& shard, Peer& peer, Connection::Channel channel, const void* data, std::size_t size)
+{
+    if (!peer.connection)
+        peer.connection.reset(new Connection());
+    bool status = peer.connection->send(channel, data, size);
+    if (status)
+    {
+        // Send it right away, the shard's thread takes care of any resends
+        peer.connection->update(getTick(), shard.sendBatch, peer.address);
+        updatePeer(shard, peer);
+    }
+    return status;
+}
+
+void UdpServer::updatePeer(Shard& shard, Peer& peer)
+{
+    if (!peer.updating && !peer.connection->isIdle())
+    {
+        peer.updating = true;
+        shard.updatingPeers.push_back(peer.id);
+        // The shard might be waiting for longer than it takes to resend
+        shard.backend->wake();
+    }
+}
+
+void UdpServer::updateChannels(Shard& shard)
+{
+    // Update the peers that have something to send, and keep the ones that still do afterwards
+    auto now = getTick();
+    auto& ids = shard.updatingPeers;
+    std::size_t kept = 0;
+    for (int id: ids)
+    {
+        auto peer = findPeer(shard, id);
+        if (peer)
+        {
+            peer->connection->update(now, shard.sendBatch, peer->address);
+            peer->updating = !peer->connection->isIdle();
+            if (peer->updating)
+                ids[kept++] = id;
+        }
+    }
+    ids.resize(kept);
+}
+
+bool UdpServer::openSockets()
+{
+    bool status = true;
+    auto boundPort = port;
+    for (auto& shard: shards)
+    {
+        if (status)
+        {
+            #ifdef __linux__
+                if (shards.size() > 1)
+                {
+                    // SFML can't set SO_REUSEPORT, so the socket is made here and handed over
+                    auto handle = ::socket(AF_INET, SOCK_DGRAM, 0);
+                    int enabled = 1;
+                    sockaddr_in address;
+                    std::memset(&address, 0, sizeof(address));
+                    address.sin_family = AF_INET;
+                    address.sin_port = htons(boundPort);
+                    address.sin_addr.s_addr = htonl(INADDR_ANY);
+                    status = (handle >= 0
+                        && setsockopt(handle, SOL_SOCKET, SO_REUSEPORT, &enabled, sizeof(enabled)) == 0
+                        && bind(handle, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0);
+                    if (status)
+                        adoptNativeHandle(shard->socket, handle);
+                    else if (handle >= 0)
+                        ::close(handle);
+                }
+                else
+                    status = (shard->socket.bind(boundPort) == sf::Socket::Done);
+            #else
+                status = (shard->socket.bind(boundPort) == sf::Socket::Done);
+            #endif
+        }
+
+        // The other sockets need to use the same port if the first one got any free port
+        if (status)
+        {
+            boundPort = shard->socket.getLocalPort();
+            status = shard->backend->add(shard->socket, socketId);
+        }
+    }
+    if (!status)
+        closeSockets();
+    return status;
+}
+
+void UdpServer::closeSockets()
+{
+    for (auto& shard: shards)
+    {
+        shard->backend->clear();
+        shard->socket.unbind();
+    }
+}
+
+void UdpServer::sendControl(Shard& shard, ControlType type, const Address& address)
+{
+    makeControlPacket(shard.controlPacket, type);
+    shard.sendBatch.queue(shard.controlPacket, address);
+}
+
+UdpServer::Peer* UdpServer::addPeer(Shard& shard, const Address& address)
+{
+    // The other shards add peers at the same time, so a place is reserved before adding the peer
+    Peer* peer = nullptr;
+    unsigned count = peerCount;
+    while (count < peerLimit && !peerCount.compare_exchange_weak(count, count + 1));
+    if (count < peerLimit)
+    {
+        auto key = shard.peers.insert(Peer());
+        if (key != PeerMap::invalidKey)
+        {
+            // Generate the ID from the key, so it always maps back to this shard and slot
+            peer = shard.peers.find(key);
+            peer->id = static_cast<int>(key * shards.size() + shard.index);
+            peer->address = address;
+            peer->lastActive = clock.getElapsedTime();
+            shard.addresses[address] = key;
+            setTimeoutTimer(shard, *peer);
+            addEvent(shard, Event::Connected, peer->id);
+        }
+        else
+            --peerCount;
+    }
+    return peer;
+}
+
+void UdpServer::removePeer(Shard& shard, Peer& peer)
+{
+    if (peer.timeoutTimer)
+        shard.timers.remove(peer.timeoutTimer);
+    shard.addresses.erase(peer.address);
+    shard.peers.erase(static_cast<PeerMap::Key>(peer.id / shards.size()));
+    --peerCount;
+}
+
+UdpServer::Peer* UdpServer::findPeer(Shard& shard, int id) const
+{
+    return (id >= 0 ? shard.peers.find(static_cast<PeerMap::Key>(id / shards.size())) : nullptr);
+}
+
+UdpServer::Peer* UdpServer::findPeer(Shard& shard, const Address& address) const
+{
+    auto found = shard.addresses.find(address);
+    return (found != shard.addresses.end() ? shard.peers.find(found->second) : nullptr);
+}
+
+UdpServer::PeerMap::Key UdpServer::getMaxKey(unsigned count)
+{
+    // So the IDs fit in an int
+    return static_cast<PeerMap::Key>((std::numeric_limits<int>::max() - (count - 1)) / count);
+}
+
+void UdpServer::createShards(unsigned count)
+{
+    shards.clear();
+    for (unsigned i = 0; i < count; ++i)
+        shards.emplace_back(new Shard(i, count));
+}
+
+UdpServer::Shard* UdpServer::findShard(int id) const
+{
+    return (id >= 0 ? shards[id % shards.size()].get() : nullptr);
+}
+
+bool UdpServer::isRunning() const
+{
+    bool status = false;
+    for (auto& shard: shards)
+        status = (status || shard->thread.joinable());
+    return status;
+}
+
+UdpServer::Event& UdpServer::addEvent(Shard& shard, Event::Type type, int id, std::size_t datagram)
+{
+    Event event;
+    event.type = type;
+    event.id = id;
+    event.datagram = datagram;
+    event.offset = 0;
+    event.size = 0;
+    shard.events.push_back(event);
+    return shard.events.back();
+}
+
+void UdpServer::dispatchEvents(Shard& shard)
+{
+    auto& batch = shard.receiveBatch;
+    for (auto& event: shard.events)
+    {
+        if (event.type == Event::Connected && connectedCallback)
+        {
+            auto lock = lockCallbacks();
+            connectedCallback(event.id);
+        }
+        else if (event.type == Event::Disconnected && disconnectedCallback)
+        {
+            auto lock = lockCallbacks();
+            disconnectedCallback(event.id);
+        }
+        else if (event.type == Event::Received)
+        {
+            // The packet data is still sitting in the batch's buffer (or the message buffer)
+            PacketView view;
+            if (event.datagram == channelMessage)
+                view = PacketView(shard.messageBuffer.data() + event.offset, event.size);
+            else
+                view = PacketView(batch.getData(event.datagram), batch.getSize(event.datagram));
+            if (packetViewCallback)
+            {
+                auto lock = lockCallbacks();
+                packetViewCallback(view, event.id);
+            }
+            else if (packetCallback)
+            {
+                view.copyTo(shard.packet);
+                auto lock = lockCallbacks();
+                packetCallback(shard.packet, event.id);
+            }
+        }
+    }
+    shard.events.clear();
+    shard.messageBuffer.clear();
+}
+
+std::vector<UdpServer::LockType> UdpServer::lockShards() const
+{
+    // Only the setters lock more than one shard at a time, and always in the same order
+    std::vector<LockType> locks;
+    for (auto& shard: shards)
+        locks.emplace_back(shard->mutex);
+    return locks;
+}
+
+UdpServer::LockType UdpServer::lockCallbacks()
+{
+    LockType lock(callbackMutex, std::defer_lock);
+    if (callbackLocking)
+        lock.lock();
+    return lock;
+}
+
+}
@@ -0,0 +1,224 @@
+// See the file COPYRIGHT.txt for authors and copyright information.
+// See the file LICENSE.txt for copying conditions.
+
+#ifndef UDPSERVER_H
+#define UDPSERVER_H
+
+#include <vector>
+#include <memory>
+#include <functional>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <SFML/Network.hpp>
+#include "address.h"
+#include "eventbackend.h"
+#include "packetview.h"
+#include "udpbatch.h"
+#include "timerwheel.h"
+#include "slotmap.h"
+#include "protocol.h"
+#include "connection.h"
+
+namespace net
+{
+
+/*
+This class acts as a server for UDP peers, with the same callback model as TcpServer.
+UDP has no connections, so the server keeps a session for each peer address instead:
+    A peer connects by sending a ConnectRequest, and gets a ConnectAccept back (see protocol.h).
+        Packets from addresses without a session are ignored.
+    A peer disconnects by sending a Disconnect, by being kicked, or by not sending anything
+        for longer than the peer timeout.
+All peers can be accessed by their unique ID, which works the same way as the client IDs of TcpServer.
+    The peers are stored in slot maps, and their addresses are looked up in a hash table.
+Packets can also be sent on channels, which can be reliable and/or ordered (see connection.h).
+    Each channel is independent, so a lost unreliable packet never holds up a reliable one.
+    The channel state of a peer is only created once it is used. Peers need to use a Connection
+    on their end too, which net::Client does when sending with a channel.
+Datagrams are received in batches (see udpbatch.h), and the callbacks get the packets straight from
+    the batch's buffers. Datagrams bigger than the buffers are dropped.
+More threads can be used with setThreadCount() (Linux only). Each thread gets its own socket, which
+    are all bound to the same port with SO_REUSEPORT. The kernel picks the socket for each datagram
+    by hashing its address, so each peer always ends up in the same thread, and the threads don't
+    share anything. Sending to a peer only locks its thread's shard.
+The callbacks are called by the server threads, after the shard is unlocked. Like TcpServer, they are
+    locked with a lock that you can get from getLock(), unless setCallbackLocking(false) is used.
+For some simple example usage, please refer to the readme.
+*/
+class UdpServer
+{
+    using CallbackType = std::function<void(int)>;
+    using PacketCallbackType = std::function<void(sf::Packet&, int)>;
+    using PacketViewCallbackType = std::function<void(const PacketView&, int)>;
+    using LockType = std::unique_lock<std::recursive_mutex>;
+
+    public:
+
+        static const unsigned defaultPeerLimit = 1024;
+        static constexpr float defaultPeerTimeout = 10.0f; // Seconds
+
+        // Constructors/setup
+        UdpServer();
+        UdpServer(unsigned short port);
+        ~UdpServer();
+        void setListeningPort(unsigned short port); // The port is bound when the server starts
+        unsigned short getLocalPort() const; // The bound port, or 0 if the server isn't running
+        void setConnectedCallback(CallbackType callback);
+        void setDisconnectedCallback(CallbackType callback);
+        void setPacketCallback(PacketCallbackType callback);
+        void setPacketViewCallback(PacketViewCallbackType callback); // Used instead of the packet callback if set
+        void setPeerLimit(unsigned peers = defaultPeerLimit);
+        void setPeerTimeout(float t = defaultPeerTimeout); // 0 means the peers never time out
+        bool setThreadCount(unsigned count); // Can only be changed while the server isn't running, fails if a thread couldn't hold any peers
+        unsigned getThreadCount() const;
+        bool setBatchSize(std::size_t batchSize, std::size_t bufferSize = UdpBatch::defaultBufferSize); // Same here
+
+        // Thread synchronization
+        LockType getLock();
+        void setCallbackLocking(bool enabled = true); // Enabled by default
+
+        // Communication
+        bool send(sf::Packet& packet, int id); // Send to specific peer
+        bool sendToAll(sf::Packet& packet, int id = -1); // Send to all (with an optional exclusion)
+        bool send(sf::Packet& packet, int id, Connection::Channel channel); // Send on a channel
+        bool sendToAll(sf::Packet& packet, Connection::Channel channel, int id = -1);
+        bool start(); // Binds the sockets and launches the server threads, returns false if binding failed
+        void stop(); // Stops the server threads, and forgets about all of the peers
+        void join(); // Waits for the server threads to finish running
+
+        // Peers
+        Address getPeerAddress(int id) const; // Returns an empty address if the peer doesn't exist
+        void kickPeer(int id); // Ends the peer's session, and tells the peer
+        bool peerIsConnected(int id) const;
+        unsigned getPeerCount() const;
+        sf::Time getPeerRtt(int id) const; // Round trip time measured by the channels, 0 if they weren't used
+
+    private:
+
+        using TimerHandle = TimerWheel<int>::Handle;
+        using ConnectionPtr = std::unique_ptr<Connection>;
+
+        struct Peer
+        {
+            Peer();
+
+            int id;
+            Address address;
+            sf::Time lastActive; // When a datagram was last received, from the server's clock
+            TimerHandle timeoutTimer; // Checks the timeout, 0 if there is no timeout
+            ConnectionPtr connection; // Only created once the channels are used
+            bool updating; // In the shard's list of connections to update
+        };
+
+        using PeerMap = SlotMap<Peer>;
+
+        // Something that happened in a shard, these are passed to the callbacks after the shard is unlocked
+        struct Event
+        {
+            enum Type
+            {
+                Connected,
+                Disconnected,
+                Received
+            };
+
+            Type type;
+            int id;
+            std::size_t datagram; // Index of the received datagram in the shard's batch, or channelMessage
+            std::size_t offset; // Where a channel message is in the shard's message buffer
+            std::size_t size;
+        };
+
+        // Each thread owns one of these
+        struct Shard
+        {
+            Shard(unsigned index, unsigned count);
+
+            unsigned index;
+            sf::UdpSocket socket;
+            std::unique_ptr<EventBackend> backend; // Waits on the socket
+            UdpBatch receiveBatch; // Only used by the shard's thread
+            UdpBatch sendBatch; // Only used with the shard locked
+            PeerMap peers; // Their keys are turned into IDs that also contain the shard index
+            std::unordered_map<Address, PeerMap::Key, AddressHash> addresses;
+            TimerWheel<int> timers; // The timeouts of this shard's peers
+            std::vector<int> updatingPeers; // Peers whose channels have something to send or resend
+            std::vector<int> expiredTimers; // Reused when handling the timers
+            std::thread thread;
+            mutable std::recursive_mutex mutex;
+            std::vector<Event> events; // Cleared after the events are dispatched, but keeps its memory
+            std::vector<char> messageBuffer; // Messages received on the channels, until they are dispatched
+            sf::Packet packet; // Reused for the packet callback, only used by the shard's thread
+            sf::Packet controlPacket; // Only used with the shard locked
+        };
+
+        using ShardPtr = std::unique_ptr<Shard>;
+
+        static const int socketId = 0; // ID the socket is registered with in the backend
+        static const int idleWaitTime = 500; // Milliseconds
+        static const int channelWaitTime = 10; // Milliseconds, used when the channels might need to resend
+        static const std::size_t channelMessage = static_cast<std::size_t>(-1); // Events that aren't whole datagrams
+
+        // Main loop for receiving datagrams
+        void serverLoop(Shard& shard);
+        void handleDatagrams(Shard& shard);
+        void handleControl(Shard& shard, sf::Int32 type, std::size_t datagram, Peer* peer);
+        void handleTimers(Shard& shard);
+        void setTimeoutTimer(Shard& shard, Peer& peer);
+        std::uint64_t getTick() const; // Current time from the server's clock, in milliseconds
+
+        // Channels
+        void receiveChannels(Shard& shard, Peer& peer, std::size_t datagram);
+        bool sendChannel(Shard& shard, Peer& peer, Connection::Channel channel, const void* data, std::size_t size);
+        void updatePeer(Shard& shard, Peer& peer); // Makes sure the channels are updated by the shard's thread
+        void updateChannels(Shard& shard);
+
+        // Sockets
+        bool openSockets();
+        void closeSockets();
+        void sendControl(Shard& shard, ControlType type, const Address& address); // Needs the shard locked
+
+        // Peers
+        Peer* addPeer(Shard& shard, const Address& address); // Returns null if the server is full
+        void removePeer(Shard& shard, Peer& peer); // This moves another peer into its place
+        Peer* findPeer(Shard& shard, int id) const; // Returns null if the peer doesn't exist
+        Peer* findPeer(Shard& shard, const Address& address) const;
+
+        // Shards
+        void createShards(unsigned count);
+        static PeerMap::Key getMaxKey(unsigned count); // The highest key in each shard's slot map with this many shards
+        Shard* findShard(int id) const; // Returns the shard that owns this ID, or null if it is invalid
+        bool isRunning() const;
+        std::vector<LockType> lockShards() const; // Locks all of them, so the settings the shards read can be changed
+
+        // Callbacks
+        Event& addEvent(Shard& shard, Event::Type type, int id, std::size_t datagram = 0);
+        void dispatchEvents(Shard& shard);
+        LockType lockCallbacks();
+
+        CallbackType connectedCallback;
+        CallbackType disconnectedCallback;
+        PacketCallbackType packetCallback;
+        PacketViewCallbackType packetViewCallback;
+
+        // Threads
+        std::vector<ShardPtr> shards;
+        std::atomic_bool running;
+        std::recursive_mutex callbackMutex;
+        bool callbackLocking; // Whether to lock the callback mutex before calling the callbacks
+
+        // Networking and peer management
+        unsigned short port; // Port to bind to when starting
+        std::size_t batchSize; // Datagrams received at once
+        std::size_t bufferSize; // Size of each datagram buffer
+        std::atomic<unsigned> peerCount; // Total peers in all shards
+        unsigned peerLimit; // Maximum number of peers, only changed with all of the shards locked
+        sf::Clock clock; // Used to time the activity of peers
+        float timeout; // Time until an idle peer is disconnected, only changed with all of the shards locked
+};
+
+}
+
+#endif